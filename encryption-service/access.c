@@ -0,0 +1,312 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#include <dbusaccess_peer.h>
+#include <dbusaccess_policy.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "access.h"
+
+#define ACCESS_DENIED_ERROR "org.freedesktop.DBus.Error.AccessDenied"
+#define DBUS_NAME "org.freedesktop.DBus"
+#define DBUS_PATH "/org/freedesktop/DBus"
+#define DBUS_IFACE DBUS_NAME
+
+typedef struct {
+    GDBusMethodInvocation *invocation;
+    access_allowed_func allowed;
+    gpointer user_data;
+} access_request;
+
+typedef struct {
+    gboolean resolved;
+    gboolean valid;
+    DACred cred;
+    GArray *groups;
+    GSList *waiting;
+} peer_entry;
+
+static struct {
+    GDBusConnection *connection;
+    DAPolicy *policy;
+    GHashTable *peers;
+    guint name_owner_changed_id;
+} data;
+
+static void finish_request(access_request *request, gboolean allowed)
+{
+    if (allowed) {
+        request->allowed(request->invocation, request->user_data);
+    } else {
+        g_dbus_method_invocation_return_dbus_error(
+                request->invocation, ACCESS_DENIED_ERROR, "Access denied");
+    }
+    g_free(request);
+}
+
+static void deny_waiting(peer_entry *entry)
+{
+    GSList *waiting = g_slist_reverse(entry->waiting);
+
+    entry->waiting = NULL;
+    while (waiting != NULL) {
+        finish_request(waiting->data, FALSE);
+        waiting = g_slist_delete_link(waiting, waiting);
+    }
+}
+
+static void peer_entry_free(gpointer user_data)
+{
+    peer_entry *entry = user_data;
+
+    deny_waiting(entry);
+    g_array_free(entry->groups, TRUE);
+    g_free(entry);
+}
+
+static gboolean is_allowed(peer_entry *entry)
+{
+    return entry->valid && da_policy_check(
+            data.policy, &entry->cred, 0, NULL,
+            DA_ACCESS_DENY) != DA_ACCESS_DENY;
+}
+
+/*
+ * Fills effective ids and supplementary groups from /proc like
+ * da_peer_get() does. The bus only knows the process and user id.
+ */
+static gboolean read_process_cred(guint32 pid, peer_entry *entry)
+{
+    gchar *path, *contents, **lines, **line, *value, *end;
+    gboolean has_uid = FALSE, has_gid = FALSE;
+    unsigned int id;
+    gid_t gid;
+
+    path = g_strdup_printf("/proc/%u/status", pid);
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_free(path);
+        return FALSE;
+    }
+    g_free(path);
+
+    lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+
+    // Uid and Gid lines list real, effective, saved and fs ids
+    for (line = lines; *line != NULL; line++) {
+        if (sscanf(*line, "Uid: %*u %u", &id) == 1) {
+            entry->cred.euid = id;
+            has_uid = TRUE;
+        } else if (sscanf(*line, "Gid: %*u %u", &id) == 1) {
+            entry->cred.egid = id;
+            has_gid = TRUE;
+        } else if (g_str_has_prefix(*line, "Groups:")) {
+            value = *line + (sizeof "Groups:" - 1);
+            for (;;) {
+                gid = strtoul(value, &end, 10);
+                if (end == value)
+                    break;
+                g_array_append_val(entry->groups, gid);
+                value = end;
+            }
+        }
+    }
+    g_strfreev(lines);
+
+    entry->cred.groups = (const gid_t *)entry->groups->data;
+    entry->cred.ngroups = entry->groups->len;
+    return has_uid && has_gid;
+}
+
+static void credentials_received(
+        GObject *connection,
+        GAsyncResult *res,
+        gpointer user_data)
+{
+    gchar *sender = user_data;
+    GError *error = NULL;
+    GVariant *reply, *credentials;
+    peer_entry *entry;
+    access_request *request;
+    GSList *waiting;
+    guint32 pid;
+
+    reply = g_dbus_connection_call_finish(
+            (GDBusConnection *)connection, res, &error);
+
+    entry = data.peers ? g_hash_table_lookup(data.peers, sender) : NULL;
+    if (entry == NULL) {
+        // Peer disconnected while resolving, the request went with it
+        if (reply != NULL)
+            g_variant_unref(reply);
+        else
+            g_error_free(error);
+        g_free(sender);
+        return;
+    }
+
+    if (reply == NULL) {
+        fprintf(stderr, "Could not get credentials of %s: %s\n",
+                sender, error->message);
+        g_error_free(error);
+    } else {
+        g_variant_get(reply, "(@a{sv})", &credentials);
+        if (g_variant_lookup(credentials, "ProcessID", "u", &pid))
+            entry->valid = read_process_cred(pid, entry);
+        g_variant_unref(credentials);
+        g_variant_unref(reply);
+    }
+
+    entry->resolved = TRUE;
+    waiting = g_slist_reverse(entry->waiting);
+    entry->waiting = NULL;
+
+    while (waiting != NULL) {
+        request = waiting->data;
+        waiting = g_slist_delete_link(waiting, waiting);
+        finish_request(request, is_allowed(entry));
+    }
+
+    // Failed lookups are not cached, next call retries
+    if (!entry->valid)
+        g_hash_table_remove(data.peers, sender);
+
+    g_free(sender);
+}
+
+static void on_name_owner_changed(
+        GDBusConnection *connection,
+        const gchar *sender_name,
+        const gchar *object_path,
+        const gchar *interface_name,
+        const gchar *signal_name,
+        GVariant *parameters,
+        gpointer user_data)
+{
+    const gchar *name, *old_owner, *new_owner;
+
+    g_variant_get(parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
+
+    // Unique names are never reused, drop the entry when peer disconnects
+    if (name[0] == ':' && new_owner[0] == '\0')
+        g_hash_table_remove(data.peers, name);
+}
+
+void access_init(GDBusConnection *connection, const char *policy)
+{
+    if (data.connection != NULL)
+        return;
+
+    data.policy = da_policy_new(policy);
+    data.connection = g_object_ref(connection);
+    data.peers = g_hash_table_new_full(
+            g_str_hash, g_str_equal, g_free, peer_entry_free);
+    data.name_owner_changed_id = g_dbus_connection_signal_subscribe(
+            connection, DBUS_NAME, DBUS_IFACE, "NameOwnerChanged",
+            DBUS_PATH, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+            on_name_owner_changed, NULL, NULL);
+}
+
+void access_check(
+        GDBusMethodInvocation *invocation,
+        access_allowed_func allowed,
+        gpointer user_data)
+{
+    const gchar *sender = g_dbus_method_invocation_get_sender(invocation);
+    access_request *request;
+    peer_entry *entry;
+
+    request = g_new0(access_request, 1);
+    request->invocation = invocation;
+    request->allowed = allowed;
+    request->user_data = user_data;
+
+    if (data.peers == NULL || sender == NULL) {
+        finish_request(request, FALSE);
+        return;
+    }
+
+    entry = g_hash_table_lookup(data.peers, sender);
+    if (entry != NULL && entry->resolved) {
+        finish_request(request, is_allowed(entry));
+        return;
+    }
+
+    if (entry != NULL) {
+        entry->waiting = g_slist_prepend(entry->waiting, request);
+        return;
+    }
+
+    entry = g_new0(peer_entry, 1);
+    entry->groups = g_array_new(FALSE, FALSE, sizeof(gid_t));
+    entry->waiting = g_slist_prepend(NULL, request);
+    g_hash_table_insert(data.peers, g_strdup(sender), entry);
+
+    g_dbus_connection_call(
+            data.connection, DBUS_NAME, DBUS_PATH, DBUS_IFACE,
+            "GetConnectionCredentials", g_variant_new("(s)", sender),
+            G_VARIANT_TYPE("(a{sv})"), G_DBUS_CALL_FLAGS_NONE, -1,
+            NULL, credentials_received, g_strdup(sender));
+}
+
+void access_cleanup(void)
+{
+    if (data.name_owner_changed_id != 0) {
+        g_dbus_connection_signal_unsubscribe(
+                data.connection, data.name_owner_changed_id);
+        data.name_owner_changed_id = 0;
+    }
+
+    if (data.peers != NULL) {
+        g_hash_table_destroy(data.peers);
+        data.peers = NULL;
+    }
+
+    if (data.connection != NULL) {
+        g_object_unref(data.connection);
+        data.connection = NULL;
+    }
+
+    if (data.policy != NULL) {
+        da_policy_unref(data.policy);
+        data.policy = NULL;
+    }
+}
+
+// vim: expandtab:ts=4:sw=4
@@ -0,0 +1,263 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <stdio.h>
+#include <udisks/udisks.h>
+#include "clients.h"
+#include "trace.h"
+
+typedef struct {
+    clients_ready_func ready;
+    gpointer user_data;
+} clients_waiter;
+
+static struct {
+    gboolean started;
+    guint pending;
+    gint64 started_time;
+    GDBusConnection *connection;
+    UDisksClient *udisks;
+    GDBusProxy *systemd_manager;
+    GDBusProxy *login_manager;
+    GDBusProxy *usb_moded;
+    GSList *waiters;
+} data;
+
+static void client_done(const char *name)
+{
+    clients_waiter *waiter;
+    GSList *waiters;
+
+    trace_span("clients", name, data.started_time);
+
+    if (--data.pending > 0)
+        return;
+
+    printf("Clients ready in %" G_GINT64_FORMAT " ms\n",
+           (trace_now() - data.started_time) / 1000);
+
+    waiters = g_slist_reverse(data.waiters);
+    data.waiters = NULL;
+    while (waiters != NULL) {
+        waiter = waiters->data;
+        waiters = g_slist_delete_link(waiters, waiters);
+        waiter->ready(waiter->user_data);
+        g_free(waiter);
+    }
+}
+
+static GDBusProxy *proxy_new_finish(GAsyncResult *res)
+{
+    GError *error = NULL;
+    GDBusProxy *proxy;
+
+    proxy = g_dbus_proxy_new_finish(res, &error);
+    if (proxy == NULL) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+    }
+    return proxy;
+}
+
+static void got_subscription(
+        GObject *proxy,
+        GAsyncResult *res,
+        gpointer user_data)
+{
+    GError *error = NULL;
+    GVariant *result;
+
+    result = g_dbus_proxy_call_finish((GDBusProxy *)proxy, res, &error);
+    if (result == NULL) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        // Without subscription there are no job signals
+        g_clear_object(&data.systemd_manager);
+    } else {
+        g_variant_unref(result);
+    }
+    client_done("systemd subscription");
+}
+
+static void got_systemd_manager(
+        GObject *proxy,
+        GAsyncResult *res,
+        gpointer user_data)
+{
+    data.systemd_manager = proxy_new_finish(res);
+    if (data.systemd_manager != NULL) {
+        data.pending++;
+        g_dbus_proxy_call(
+                data.systemd_manager, "Subscribe",
+                NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                got_subscription, NULL);
+    }
+    client_done("systemd manager");
+}
+
+static void got_login_manager(
+        GObject *proxy,
+        GAsyncResult *res,
+        gpointer user_data)
+{
+    data.login_manager = proxy_new_finish(res);
+    client_done("login manager");
+}
+
+static void got_usb_moded(
+        GObject *proxy,
+        GAsyncResult *res,
+        gpointer user_data)
+{
+    data.usb_moded = proxy_new_finish(res);
+    client_done("usb_moded");
+}
+
+static void got_udisks(GObject *proxy, GAsyncResult *res, gpointer user_data)
+{
+    GError *error = NULL;
+
+    data.udisks = udisks_client_new_finish(res, &error);
+    if (data.udisks == NULL) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+    }
+    client_done("udisks client");
+}
+
+static void got_bus(GObject *proxy, GAsyncResult *res, gpointer user_data)
+{
+    GError *error = NULL;
+
+    data.connection = g_bus_get_finish(res, &error);
+    if (data.connection == NULL) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        client_done("bus");
+        return;
+    }
+
+    data.pending += 4;
+    udisks_client_new(NULL, got_udisks, NULL);
+    g_dbus_proxy_new(
+            data.connection, G_DBUS_PROXY_FLAGS_NONE, NULL,
+            "org.freedesktop.systemd1",
+            "/org/freedesktop/systemd1",
+            "org.freedesktop.systemd1.Manager",
+            NULL, got_systemd_manager, NULL);
+    g_dbus_proxy_new(
+            data.connection, G_DBUS_PROXY_FLAGS_NONE, NULL,
+            "org.freedesktop.login1",
+            "/org/freedesktop/login1",
+            "org.freedesktop.login1.Manager",
+            NULL, got_login_manager, NULL);
+    g_dbus_proxy_new(
+            data.connection, G_DBUS_PROXY_FLAGS_NONE, NULL,
+            "com.meego.usb_moded",
+            "/com/meego/usb_moded",
+            "com.meego.usb_moded",
+            NULL, got_usb_moded, NULL);
+    client_done("bus");
+}
+
+void clients_init(void)
+{
+    if (data.started)
+        return;
+
+    data.started = TRUE;
+    data.started_time = trace_now();
+    data.pending = 1;
+    g_bus_get(G_BUS_TYPE_SYSTEM, NULL, got_bus, NULL);
+}
+
+void clients_wait(clients_ready_func ready, gpointer user_data)
+{
+    clients_waiter *waiter;
+
+    clients_init();
+
+    if (data.pending == 0) {
+        ready(user_data);
+        return;
+    }
+
+    waiter = g_new0(clients_waiter, 1);
+    waiter->ready = ready;
+    waiter->user_data = user_data;
+    data.waiters = g_slist_prepend(data.waiters, waiter);
+}
+
+GDBusConnection *clients_get_connection(void)
+{
+    return data.connection;
+}
+
+UDisksClient *clients_get_udisks(void)
+{
+    return data.udisks;
+}
+
+GDBusProxy *clients_get_systemd_manager(void)
+{
+    return data.systemd_manager;
+}
+
+GDBusProxy *clients_get_login_manager(void)
+{
+    return data.login_manager;
+}
+
+GDBusProxy *clients_get_usb_moded(void)
+{
+    return data.usb_moded;
+}
+
+void clients_cleanup(void)
+{
+    g_slist_free_full(data.waiters, g_free);
+    data.waiters = NULL;
+    g_clear_object(&data.usb_moded);
+    g_clear_object(&data.login_manager);
+    g_clear_object(&data.systemd_manager);
+    g_clear_object(&data.udisks);
+    g_clear_object(&data.connection);
+    data.started = FALSE;
+}
+
+// vim: expandtab:ts=4:sw=4
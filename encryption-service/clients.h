@@ -0,0 +1,63 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#ifndef __CLIENTS_H
+#define __CLIENTS_H
+
+#include <gio/gio.h>
+#include <udisks/udisks.h>
+
+/*
+ * Bus connection and service proxies shared by the whole daemon. They are
+ * created in parallel at startup, while bus names are being acquired, so
+ * method calls do not pay for setting them up. Getters return borrowed
+ * references or NULL if creating the client failed.
+ */
+
+typedef void (*clients_ready_func)(gpointer user_data);
+
+void clients_init(void);
+void clients_wait(clients_ready_func ready, gpointer user_data);
+GDBusConnection *clients_get_connection(void);
+UDisksClient *clients_get_udisks(void);
+GDBusProxy *clients_get_systemd_manager(void);
+GDBusProxy *clients_get_login_manager(void);
+GDBusProxy *clients_get_usb_moded(void);
+void clients_cleanup(void);
+
+#endif // __CLIENTS_H
+
+// vim: expandtab:ts=4:sw=4
@@ -34,14 +34,14 @@
 **
 ****************************************************************************************/
 
-#include <dbusaccess_peer.h>
-#include <dbusaccess_policy.h>
 #include <gio/gio.h>
 #include <glib.h>
 #include <stdio.h>
+#include "access.h"
 #include "dbus.h"
+#include "estimate.h"
+#include "trace.h"
 
-#define ACCESS_DENIED_ERROR "org.freedesktop.DBus.Error.AccessDenied"
 #define BUS_NAME "org.sailfishos.EncryptionService"
 #define ENCRYPTION_IFACE BUS_NAME
 #define ENCRYPTION_PATH "/org/sailfishos/EncryptionService"
@@ -50,6 +50,8 @@
 #define ENCRYPTION_METHOD "BeginEncryption"
 #define ENCRYPTION_FINISHED_SIGNAL "EncryptionFinished"
 #define FINALIZATION_METHOD "FinalizeEncryption"
+#define GET_TRACE_METHOD "GetTrace"
+#define ESTIMATE_METHOD "EstimateDuration"
 #define PRIVILEGED_ONLY_POLICY "1;group(privileged) = allow;"
 
 static const gchar introspection_xml[] =
@@ -63,6 +65,15 @@ static const gchar introspection_xml[] =
     "</method>"
     "<method name=\"" FINALIZATION_METHOD "\">"
     "</method>"
+    "<method name=\"" GET_TRACE_METHOD "\">"
+    "<arg name=\"events\" direction=\"out\" type=\"a(ssxx)\"></arg>"
+    "</method>"
+    "<method name=\"" ESTIMATE_METHOD "\">"
+    "<arg name=\"overwriteType\" direction=\"in\" type=\"s\"></arg>"
+    "<arg name=\"copyTarget\" direction=\"in\" type=\"s\"></arg>"
+    "<arg name=\"total\" direction=\"out\" type=\"t\"></arg>"
+    "<arg name=\"phases\" direction=\"out\" type=\"a{st}\"></arg>"
+    "</method>"
     "<signal name=\"" ENCRYPTION_FINISHED_SIGNAL "\">"
     "<arg name=\"success\" type=\"b\" />"
     "<arg name=\"error\" type=\"s\" />"
@@ -79,12 +90,9 @@ static struct {
     prepare_call_handler prepare_method;
     encrypt_call_handler encrypt_method;
     finalize_call_handler finalize_method;
-    DAPolicy *policy;
     gchar *receiver;
 } data;
 
-static gboolean is_allowed(GDBusConnection *connection, const gchar *sender);
-
 static void bus_acquired_handler(
         GDBusConnection *connection,
         const gchar *name,
@@ -95,6 +103,7 @@ static void bus_acquired_handler(
     printf("Acquired bus for %s\n", name);
 
     data.connection = connection;
+    access_init(connection, PRIVILEGED_ONLY_POLICY);
     data.encrypt_iface_id = g_dbus_connection_register_object(
             connection, ENCRYPTION_PATH,
             g_dbus_node_info_lookup_interface(data.info, ENCRYPTION_IFACE),
@@ -127,26 +136,52 @@ static void name_lost_handler(
         data.connection = connection;
 }
 
-void method_call_handler(
-        GDBusConnection *connection,
-        const gchar *sender,
-        const gchar *object_path,
-        const gchar *interface_name,
-        const gchar *method_name,
-        GVariant *parameters,
-        GDBusMethodInvocation *invocation,
+static gboolean parse_overwrite_type(const gchar *overwrite_type, erase_t *erase)
+{
+    if (strcmp(overwrite_type, "none") == 0) {
+        *erase = DONT_ERASE;
+    } else if (strcmp(overwrite_type, "zero") == 0) {
+        *erase = ERASE_WITH_ZEROS;
+    } else if (strcmp(overwrite_type, "random") == 0) {
+        *erase = ERASE_WITH_RANDOM;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void estimate_ready(
+        GObject *source_object,
+        GAsyncResult *res,
         gpointer user_data)
 {
+    GDBusMethodInvocation *invocation = user_data;
     GError *error = NULL;
-    GVariantIter iter;
-    gchar *passphrase, *overwrite_type;
-    erase_t erase;
+    GVariant *estimate;
 
-    if (!is_allowed(connection, sender)) {
+    estimate = estimate_duration_finish(res, &error);
+    if (estimate != NULL) {
+        g_dbus_method_invocation_return_value(invocation, estimate);
+        g_variant_unref(estimate);
+    } else {
         g_dbus_method_invocation_return_dbus_error(
-                invocation, ACCESS_DENIED_ERROR, "Access denied");
-        return;
+                invocation, ENCRYPTION_FAILED_ERROR, error->message);
+        g_error_free(error);
     }
+}
+
+static void handle_method_call(
+        GDBusMethodInvocation *invocation,
+        gpointer user_data)
+{
+    const gchar *method_name = g_dbus_method_invocation_get_method_name(
+            invocation);
+    GVariant *parameters = g_dbus_method_invocation_get_parameters(invocation);
+    const gchar *sender = g_dbus_method_invocation_get_sender(invocation);
+    GError *error = NULL;
+    GVariantIter iter;
+    gchar *passphrase, *overwrite_type, *copy_target;
+    erase_t erase;
 
     // Currently doesn't check path or interface name because
     // this implements only one interface on only one path
@@ -157,13 +192,7 @@ void method_call_handler(
         g_variant_iter_next(&iter, "s", &passphrase);
         g_variant_iter_next(&iter, "s", &overwrite_type);
 
-        if (strcmp(overwrite_type, "none") == 0) {
-            erase = DONT_ERASE;
-        } else if (strcmp(overwrite_type, "zero") == 0) {
-            erase = ERASE_WITH_ZEROS;
-        } else if (strcmp(overwrite_type, "random") == 0) {
-            erase = ERASE_WITH_RANDOM;
-        } else {
+        if (!parse_overwrite_type(overwrite_type, &erase)) {
             g_dbus_method_invocation_return_dbus_error(
                     invocation, ENCRYPTION_FAILED_ERROR,
                     "Invalid argument to overwriteType");
@@ -195,6 +224,21 @@ void method_call_handler(
             g_dbus_method_invocation_return_gerror(invocation, error);
             g_error_free(error);
         }
+    } else if (strcmp(method_name, GET_TRACE_METHOD) == 0) {
+        g_dbus_method_invocation_return_value(
+                invocation, g_variant_new("(@a(ssxx))", trace_get_events()));
+    } else if (strcmp(method_name, ESTIMATE_METHOD) == 0) {
+        g_variant_get(parameters, "(&s&s)", &overwrite_type, &copy_target);
+
+        if (!parse_overwrite_type(overwrite_type, &erase)) {
+            g_dbus_method_invocation_return_dbus_error(
+                    invocation, ENCRYPTION_FAILED_ERROR,
+                    "Invalid argument to overwriteType");
+            return;
+        }
+
+        // Measuring takes seconds, reply when the worker is done
+        estimate_duration(erase, copy_target, estimate_ready, invocation);
     } else {
         g_dbus_method_invocation_return_dbus_error(
                 invocation, ENCRYPTION_FAILED_ERROR,
@@ -202,6 +246,19 @@ void method_call_handler(
     }
 }
 
+void method_call_handler(
+        GDBusConnection *connection,
+        const gchar *sender,
+        const gchar *object_path,
+        const gchar *interface_name,
+        const gchar *method_name,
+        GVariant *parameters,
+        GDBusMethodInvocation *invocation,
+        gpointer user_data)
+{
+    access_check(invocation, handle_method_call, NULL);
+}
+
 void init_dbus(
         prepare_call_handler prepare_method,
         encrypt_call_handler encrypt_method,
@@ -211,7 +268,6 @@ void init_dbus(
     data.encrypt_method = encrypt_method;
     data.finalize_method = finalize_method;
 
-    data.policy = da_policy_new(PRIVILEGED_ONLY_POLICY);
     data.receiver = NULL;
 
     data.info = g_dbus_node_info_new_for_xml(introspection_xml, NULL);
@@ -254,21 +310,4 @@ void signal_encrypt_finished(GError *error)
     data.receiver = NULL;
 }
 
-static gboolean is_allowed(GDBusConnection *connection, const gchar *sender)
-{
-    DAPeer *peer;
-
-    peer = da_peer_get(DA_BUS_SYSTEM, sender);
-    if (peer == NULL)
-        return FALSE;
-
-    if (da_policy_check(
-            data.policy, &peer->cred, 0, NULL,
-            DA_ACCESS_DENY) == DA_ACCESS_DENY) {
-        return FALSE;
-    }
-
-    return TRUE;
-}
-
 // vim: expandtab:ts=4:sw=4
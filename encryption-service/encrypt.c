@@ -46,11 +46,20 @@
 #include <sys/types.h>
 #include <udisks/udisks.h>
 #include <unistd.h>
+#include "clients.h"
 #include "encrypt.h"
+#include "pipeline.h"
+#include "probes.h"
+#include "trace.h"
 
 #define BLOCK_SIZE 4096
 #define KEY_SIZE 16
 
+/*
+ * Device, paths and bus are not fixed to a phone. make check-pipeline
+ * builds the service for a loop device and a scratch directory and runs
+ * it on a private bus with the mock services from tests/.
+ */
 // TODO: Make this more dynamic
 #ifndef DEVICE_TO_ENCRYPT
 #define DEVICE_TO_ENCRYPT /dev/sailfish/home
@@ -71,14 +80,16 @@
 #define SYSTEMD_UNIT_DIR /etc/systemd/system/
 #endif
 
-#define TEMPORARY_KEY_FILE \
-    "/var/lib/sailfish-device-encryption/temporary-encryption-key"
-#define UPDATE_KEY_FILE \
-    "/var/lib/sailfish-device-encryption/update-encryption-key"
+#ifndef STATE_DIR
+#define STATE_DIR /var/lib/sailfish-device-encryption
+#endif
 
 #define QUOTE(s) #s
 #define STR(s) QUOTE(s)
 
+#define TEMPORARY_KEY_FILE STR(STATE_DIR) "/temporary-encryption-key"
+#define UPDATE_KEY_FILE STR(STATE_DIR) "/update-encryption-key"
+
 const char *unit_dir = STR(SYSTEMD_UNIT_DIR);
 
 const char *home_conf_name = "50-home.conf";
@@ -101,10 +112,31 @@ const char *device_conf_template = "[Unit]\n" \
  */
 encryption_state status = ENCRYPTION_NOT_STARTED;
 encryption_status_changed status_change_callback;
+static gint64 status_changed_time = 0;
+
+static const char *status_names[] = {
+    [ENCRYPTION_NOT_STARTED] = "not started",
+    [ENCRYPTION_IN_PREPARATION] = "in preparation",
+    [ENCRYPTION_ERASURE_IN_PROGRESS] = "erasure in progress",
+    [ENCRYPTION_IN_PROGRESS] = "in progress",
+    [ENCRYPTION_NEEDS_RESCAN] = "needs rescan",
+    [ENCRYPTION_RESCAN_FINISHED] = "rescan finished",
+    [ENCRYPTION_FINISHED] = "finished",
+    [ENCRYPTION_FAILED] = "failed",
+};
 
 void set_status(encryption_state state)
 {
+    if (status_changed_time != 0)
+        trace_span("state", status_names[status], status_changed_time);
+    status_changed_time = trace_now();
     status = state;
+
+    if (state == ENCRYPTION_FINISHED || state == ENCRYPTION_FAILED) {
+        trace_instant("state", status_names[state]);
+        trace_write();
+    }
+
     status_change_callback(state);
 }
 
@@ -113,6 +145,26 @@ void init_encryption_service(encryption_status_changed change_callback)
     status_change_callback = change_callback;
 }
 
+/*
+ * Steps of the encryption. These are run by the pipeline as soon as
+ * the steps they depend on are done, so lookups and checks overlap
+ * and only erasure and formatting remain on the critical path.
+ */
+typedef enum {
+    STEP_BUS,
+    STEP_CLIENT,
+    STEP_RESOLVE_DEVICE,
+    STEP_BLOCK_DEVICE,
+    STEP_CAN_FORMAT,
+    STEP_UNMOUNT,
+    STEP_PREPARE_CONFIGURATION,
+    STEP_ERASE,
+    STEP_FORMAT,
+    STEP_RESCAN,
+    STEP_CLEARTEXT_DEVICE,
+    STEP_WRITE_CONFIGURATION,
+} encryption_step;
+
 /*
  * Struct to track internal state.
  */
@@ -128,26 +180,39 @@ typedef struct {
     gchar *crypto_device_path;
     gchar *cleartext_device_uuid;
     gulong signal_handler;
+    pipeline *steps;
 } invocation_data;
 
 static inline void invocation_data_free(invocation_data *data)
 {
     if (data == NULL)
         return;
-    g_object_unref(data->connection);
-    g_object_unref(data->manager);
-    g_object_unref(data->block);
+    if (data->signal_handler)
+        g_signal_handler_disconnect(
+                data->object_manager, data->signal_handler);
+    if (data->connection)
+        g_object_unref(data->connection);
+    if (data->client)
+        g_object_unref(data->client);
+    if (data->block)
+        g_object_unref(data->block);
+    pipeline_free(data->steps);
     g_free(data->passphrase);
     g_free(data->crypto_device_path);
     g_free(data->cleartext_device_uuid);
     g_free(data);
 }
 
-static inline void end_encryption_to_failure(invocation_data *data)
+static inline void fail_step(
+        invocation_data *data,
+        encryption_step step,
+        GError *error)
 {
-    set_status(ENCRYPTION_FAILED);
-    g_signal_handler_disconnect(data->object_manager, data->signal_handler);
-    invocation_data_free(data);
+    if (error != NULL) {
+        fprintf(stderr, "%s. Aborting.\n", error->message);
+        g_error_free(error);
+    }
+    pipeline_step_failed(data->steps, step);
 }
 
 static inline gboolean set_unit_conf(
@@ -252,20 +317,63 @@ static inline gboolean write_systemd_configuration(invocation_data *data)
     return TRUE;
 }
 
-static inline void finish_if_ready(invocation_data *data)
+static gboolean create_unit_conf_dir(const char *unit)
 {
-    if (status == ENCRYPTION_RESCAN_FINISHED &&
-            data->cleartext_device_uuid != NULL) {
-        if (!write_systemd_configuration(data)) {
-            end_encryption_to_failure(data);
-            return;
-        }
+    gboolean ret = TRUE;
+    gchar *path = g_strdup_printf("%s/%s.d", unit_dir, unit);
+
+    errno = 0;
+    if (mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 &&
+            errno != EEXIST) {
+        fprintf(stderr, "Could not create directory %s: %s. Aborting.\n", path,
+                strerror(errno));
+        ret = FALSE;
+    }
 
+    g_free(path);
+    return ret;
+}
+
+static void prepare_configuration(pipeline *p, guint id, gpointer user_data)
+{
+    invocation_data *data = user_data;
+
+    // Drop-in files are written only after encryption has succeeded
+    if (!create_unit_conf_dir("multi-user.target") ||
+            !create_unit_conf_dir("systemd-user-sessions.service") ||
+            !create_unit_conf_dir("home-mount-settle.service") ||
+            !create_unit_conf_dir("home.mount")) {
+        fail_step(data, id, NULL);
+        return;
+    }
+
+    pipeline_step_done(p, id);
+}
+
+static void write_configuration(pipeline *p, guint id, gpointer user_data)
+{
+    invocation_data *data = user_data;
+
+    if (!write_systemd_configuration(data)) {
+        fail_step(data, id, NULL);
+        return;
+    }
+
+    pipeline_step_done(p, id);
+}
+
+static void encryption_finished(pipeline *p, gboolean success,
+                                gpointer user_data)
+{
+    invocation_data *data = user_data;
+
+    if (success) {
         set_status(ENCRYPTION_FINISHED);
         printf("Finished encryption successfully.\n");
-        g_signal_handler_disconnect(data->object_manager, data->signal_handler);
-        invocation_data_free(data);
+    } else {
+        set_status(ENCRYPTION_FAILED);
     }
+    invocation_data_free(data);
 }
 
 static void on_properties_changed(
@@ -305,11 +413,15 @@ static void on_properties_changed(
             while (g_variant_iter_loop(&iter, "{sv}", &key, &value)) {
                 if (strcmp(key, "IdUUID") == 0) {
                     tmp = g_variant_get_string(value, NULL);
-                    if (tmp != NULL && strcmp(tmp, "") != 0) {
+                    if (tmp != NULL && strcmp(tmp, "") != 0 &&
+                            data->cleartext_device_uuid == NULL) {
                         g_free(cleartext_device_path);
                         cleartext_device_path = NULL;
                         data->cleartext_device_uuid = g_strdup(tmp);
-                        finish_if_ready(data);
+                        if (pipeline_step_running(
+                                    data->steps, STEP_CLEARTEXT_DEVICE))
+                            pipeline_step_done(
+                                    data->steps, STEP_CLEARTEXT_DEVICE);
                     }
                     break;
                 }
@@ -318,18 +430,42 @@ static void on_properties_changed(
     }
 }
 
+static void wait_for_cleartext_device(
+        pipeline *p,
+        guint id,
+        gpointer user_data)
+{
+    invocation_data *data = user_data;
+
+    // UUID may have been seen already, otherwise on_properties_changed
+    // completes this step
+    if (data->cleartext_device_uuid != NULL)
+        pipeline_step_done(p, id);
+}
+
 static void rescan_complete(
         GObject *block,
         GAsyncResult *res,
         gpointer user_data)
 {
     invocation_data *data = user_data;
+    gboolean success;
 
-    udisks_block_call_rescan_finish((UDisksBlock *)block, res, NULL);
-    if (status == ENCRYPTION_NEEDS_RESCAN) {
-        set_status(ENCRYPTION_RESCAN_FINISHED);
-        finish_if_ready(data);
-    }
+    success = udisks_block_call_rescan_finish((UDisksBlock *)block, res, NULL);
+    PROBE(udisks_call_done, "Rescan", success);
+    set_status(ENCRYPTION_RESCAN_FINISHED);
+    pipeline_step_done(data->steps, STEP_RESCAN);
+}
+
+static void rescan_device(pipeline *p, guint id, gpointer user_data)
+{
+    invocation_data *data = user_data;
+    GVariant *arguments;
+
+    arguments = g_variant_new_array(G_VARIANT_TYPE("{sv}"), NULL, 0);
+    udisks_block_call_rescan(
+            data->block, arguments, NULL,
+            rescan_complete, data);
 }
 
 static inline void create_empty_file(const char *path)
@@ -344,33 +480,29 @@ static void format_complete(
         GAsyncResult *res,
         gpointer user_data)
 {
-    GVariant *arguments;
     invocation_data *data = user_data;
     GError *error = NULL;
 
-    if (udisks_block_call_format_finish((UDisksBlock *)block, res, &error)) {
-        set_status(ENCRYPTION_NEEDS_RESCAN);
+    if (!udisks_block_call_format_finish((UDisksBlock *)block, res, &error)) {
+        PROBE(udisks_call_done, "Format", 0);
+        fail_step(data, STEP_FORMAT, error);
+        return;
+    }
 
-        if (data->passphrase_is_temporary)
-            create_empty_file(TEMPORARY_KEY_FILE);
-        else
-            create_empty_file(UPDATE_KEY_FILE);
+    PROBE(udisks_call_done, "Format", 1);
+    set_status(ENCRYPTION_NEEDS_RESCAN);
 
-    } else {
-        fprintf(stderr, "%s. Aborting.\n", error->message);
-        end_encryption_to_failure(data);
-        g_error_free(error);
-        data = NULL;  // Data was freed in end_encryption_to_failure
-    }
+    if (data->passphrase_is_temporary)
+        create_empty_file(TEMPORARY_KEY_FILE);
+    else
+        create_empty_file(UPDATE_KEY_FILE);
 
-    arguments = g_variant_new_array(G_VARIANT_TYPE("{sv}"), NULL, 0);
-    udisks_block_call_rescan(
-            (UDisksBlock *)block, arguments, NULL,
-            rescan_complete, data);
+    pipeline_step_done(data->steps, STEP_FORMAT);
 }
 
-static inline void start_format_luks(invocation_data *data)
+static void format_luks(pipeline *p, guint id, gpointer user_data)
 {
+    invocation_data *data = user_data;
     GVariantBuilder builder, subbuilder;
     GVariant *config_items, *options;
 
@@ -471,6 +603,7 @@ static gboolean erase_data(gpointer user_data)
         if (fread(key, 1, KEY_SIZE, stream) < KEY_SIZE) {
             fprintf(stderr, "Warning: %s\n",
                     "Could not get random key. Skipping device erasure!");
+            pipeline_step_done(data->steps, STEP_ERASE);
             return FALSE;
         }
         key[KEY_SIZE] = '\0';
@@ -499,6 +632,7 @@ static gboolean erase_data(gpointer user_data)
             // Left out EVP_EncryptFinal_ex since those
             // last few bytes are not needed here
             printf("Wrote %lld bytes to erased block device.\n", count);
+            PROBE(erase_done, count);
 
         } else {
             fprintf(stderr,
@@ -507,12 +641,13 @@ static gboolean erase_data(gpointer user_data)
         }
     } else {  // Wrote the whole block, not done yet
         count += len;
+        PROBE(erase_chunk, count, len);
         return TRUE;  // Not finished, continue looping
     }
 
     // Got here, erasure finished or incomplete. Continue to next task.
-    start_format_luks(data);
     EVP_CIPHER_CTX_free(ctx);
+    pipeline_step_done(data->steps, STEP_ERASE);
     return FALSE;  // End looping
 }
 
@@ -525,22 +660,30 @@ static inline void tear_down_complete(
     GError *error = NULL;
 
     if (udisks_block_call_format_finish((UDisksBlock *)block, res, &error)) {
+        PROBE(udisks_call_done, "Format", 1);
         printf("Removed /home from fstab. Starting to erase.\n");
         g_idle_add(erase_data, data);
 
     } else {
-        fprintf(stderr, "%s. Aborting.\n", error->message);
-        end_encryption_to_failure(data);
-        g_error_free(error);
-        data = NULL;  // Data was freed in end_encryption_to_failure
+        PROBE(udisks_call_done, "Format", 0);
+        fail_step(data, STEP_ERASE, error);
     }
 }
 
-static void start_erasure_with_random(invocation_data *data)
+static void erase_device(pipeline *p, guint id, gpointer user_data)
 {
+    invocation_data *data = user_data;
     GVariantBuilder builder;
     GVariant *options;
 
+    printf("Starting encryption. All data will be destroyed.\n");
+
+    // Erasing with zeros is done by udisks while formatting
+    if (data->erase != ERASE_WITH_RANDOM) {
+        pipeline_step_done(p, id);
+        return;
+    }
+
     set_status(ENCRYPTION_ERASURE_IN_PROGRESS);
 
     // Tear down all configuration and wipe file system signature
@@ -557,6 +700,64 @@ static void start_erasure_with_random(invocation_data *data)
             data->block, "empty", options, NULL, tear_down_complete, data);
 }
 
+static void unmount_complete(
+        GObject *filesystem,
+        GAsyncResult *res,
+        gpointer user_data)
+{
+    invocation_data *data = user_data;
+    GError *error = NULL;
+
+    if (!udisks_filesystem_call_unmount_finish(
+                (UDisksFilesystem *)filesystem, res, &error)) {
+        PROBE(udisks_call_done, "Unmount", 0);
+        fail_step(data, STEP_UNMOUNT, error);
+    } else {
+        PROBE(udisks_call_done, "Unmount", 1);
+        printf("Unmounted %s\n", data->crypto_device_path);
+        pipeline_step_done(data->steps, STEP_UNMOUNT);
+    }
+    g_object_unref(filesystem);
+}
+
+static void found_filesystem(
+        GObject *proxy,
+        GAsyncResult *res,
+        gpointer user_data)
+{
+    invocation_data *data = user_data;
+    GError *error = NULL;
+    const gchar *const *mount_points;
+    UDisksFilesystem *udfs;
+
+    udfs = udisks_filesystem_proxy_new_finish(res, &error);
+    if (!udfs) {
+        fail_step(data, STEP_UNMOUNT, error);
+        return;
+    }
+
+    mount_points = udisks_filesystem_get_mount_points(udfs);
+    // If the array is not empty, there is a mount point
+    if (mount_points != NULL && *mount_points != NULL) {
+        udisks_filesystem_call_unmount(
+                udfs, g_variant_new("a{sv}", NULL), NULL,
+                unmount_complete, data);
+    } else {
+        g_object_unref(udfs);
+        pipeline_step_done(data->steps, STEP_UNMOUNT);
+    }
+}
+
+static void unmount_filesystem(pipeline *p, guint id, gpointer user_data)
+{
+    invocation_data *data = user_data;
+
+    // Unmount if mounted, otherwise encryption fails
+    udisks_filesystem_proxy_new(
+            data->connection, G_DBUS_PROXY_FLAGS_NONE, UDISKS_INTERFACE,
+            data->crypto_device_path, NULL, found_filesystem, data);
+}
+
 static void can_format_to_type(
         GObject *manager,
         GAsyncResult *res,
@@ -567,56 +768,37 @@ static void can_format_to_type(
     gchar *bin;
     invocation_data *data = user_data;
     GError *error = NULL;
-    const gchar *const *mount_points;
-    UDisksFilesystem *udfs;
 
     if (!udisks_manager_call_can_format_finish(
                 (UDisksManager *)manager, &avail, res, &error)) {
-        fprintf(stderr, "%s. Aborting.\n", error->message);
-        end_encryption_to_failure(data);
-        g_error_free(error);
+        PROBE(udisks_call_done, "CanFormat", 0);
+        fail_step(data, STEP_CAN_FORMAT, error);
         return;
     }
+    PROBE(udisks_call_done, "CanFormat", 1);
 
     g_variant_get(avail, "(bs)", &available, &bin);
+    g_variant_unref(avail);
 
     if (!available) {
         fprintf(stderr, "%s is not available, needs %s. Aborting.\n",
                 STR(FILESYSTEM_FORMAT), bin);
-        end_encryption_to_failure(data);
+        g_free(bin);
+        fail_step(data, STEP_CAN_FORMAT, NULL);
         return;
     }
 
-    // Unmount if mounted, otherwise encryption fails
-    udfs = udisks_filesystem_proxy_new_sync(
-            data->connection, G_DBUS_PROXY_FLAGS_NONE, UDISKS_INTERFACE,
-            data->crypto_device_path, NULL, &error);
-    if (!udfs) {
-        fprintf(stderr, "%s. Aborting.\n", error->message);
-        end_encryption_to_failure(data);
-        g_error_free(error);
-    } else {
-        mount_points = udisks_filesystem_get_mount_points(udfs);
-        // If the array is not empty, there is a mount point
-        if (mount_points != NULL && *mount_points != NULL) {
-            if (!udisks_filesystem_call_unmount_sync(
-                        udfs, g_variant_new("a{sv}", NULL), NULL, &error)) {
-                fprintf(stderr, "%s. Aborting.\n", error->message);
-                end_encryption_to_failure(data);
-                g_error_free(error);
-                return;
-            } else {
-                printf("Unmounted %s\n", data->crypto_device_path);
-            }
-        }
-    }
+    g_free(bin);
+    pipeline_step_done(data->steps, STEP_CAN_FORMAT);
+}
 
-    printf("Starting encryption. All data will be destroyed.\n");
-    if (data->erase == ERASE_WITH_RANDOM) {
-        start_erasure_with_random(data);
-    } else {
-        start_format_luks(data);
-    }
+static void can_format(pipeline *p, guint id, gpointer user_data)
+{
+    invocation_data *data = user_data;
+
+    udisks_manager_call_can_format(
+            data->manager, STR(FILESYSTEM_FORMAT), NULL,
+            can_format_to_type, data);
 }
 
 static void found_block_device(
@@ -630,9 +812,7 @@ static void found_block_device(
 
     block = udisks_block_proxy_new_finish(res, &error);
     if (block == NULL) {
-        fprintf(stderr, "%s. Aborting.\n", error->message);
-        end_encryption_to_failure(data);
-        g_error_free(error);
+        fail_step(data, STEP_BLOCK_DEVICE, error);
         return;
     }
 
@@ -640,9 +820,16 @@ static void found_block_device(
 
     printf("Selected '%s' for encryption.\n", udisks_block_get_device(block));
 
-    udisks_manager_call_can_format(
-            data->manager, STR(FILESYSTEM_FORMAT), NULL,
-            can_format_to_type, data);
+    pipeline_step_done(data->steps, STEP_BLOCK_DEVICE);
+}
+
+static void find_block_device(pipeline *p, guint id, gpointer user_data)
+{
+    invocation_data *data = user_data;
+
+    udisks_block_proxy_new(
+            data->connection, G_DBUS_PROXY_FLAGS_NONE, UDISKS_INTERFACE,
+            data->crypto_device_path, NULL, found_block_device, data);
 }
 
 static void check_device_list(
@@ -659,10 +846,11 @@ static void check_device_list(
 
     if (!udisks_manager_call_resolve_device_finish(
                 (UDisksManager *)manager, &devices, res, &error)) {
-        fprintf(stderr, "%s. Aborting.\n", error->message);
-        end_encryption_to_failure(data);
+        PROBE(udisks_call_done, "ResolveDevice", 0);
+        fail_step(data, STEP_RESOLVE_DEVICE, error);
         return;
     }
+    PROBE(udisks_call_done, "ResolveDevice", 1);
 
     devnames = g_variant_new_objv((const gchar * const *)devices, -1);
     iter = g_variant_iter_new(devnames);
@@ -674,10 +862,10 @@ static void check_device_list(
 
     if (length < 1) {
         fprintf(stderr, "No device found. Aborting.\n");
-        end_encryption_to_failure(data);
         g_variant_iter_free(iter);
         g_free(devices);
         g_variant_unref(devnames);
+        fail_step(data, STEP_RESOLVE_DEVICE, NULL);
         return;
     }
 
@@ -688,20 +876,18 @@ static void check_device_list(
             data->object_manager, "interface-proxy-properties-changed",
             G_CALLBACK(on_properties_changed), data);
 
-    udisks_block_proxy_new(
-            data->connection, G_DBUS_PROXY_FLAGS_NONE, UDISKS_INTERFACE,
-            data->crypto_device_path, NULL, found_block_device, data);
-
     g_variant_unref(dev);
     g_variant_iter_free(iter);
     g_free(devices);
     g_variant_unref(devnames);
+
+    pipeline_step_done(data->steps, STEP_RESOLVE_DEVICE);
 }
 
-static inline void find_device_to_encrypt(invocation_data *data_)
+static void find_device_to_encrypt(pipeline *p, guint id, gpointer user_data)
 {
     GVariantBuilder builder;
-    invocation_data *data = (invocation_data *)data_;
+    invocation_data *data = user_data;
     GVariant *devnames, *arguments;
 
     g_variant_builder_init(&builder, G_VARIANT_TYPE_ARRAY);
@@ -715,41 +901,82 @@ static inline void find_device_to_encrypt(invocation_data *data_)
             check_device_list, data);
 }
 
-static void got_client(GObject *proxy, GAsyncResult *res, gpointer user_data)
+static void got_client(gpointer user_data)
 {
     invocation_data *data = user_data;
-    GError *error = NULL;
 
-    data->client = udisks_client_new_finish(res, &error);
-    if (data->client == NULL) {
-        fprintf(stderr, "%s\n", error->message);
-        end_encryption_to_failure(data);
-        g_error_free(error);
+    if (clients_get_udisks() == NULL) {
+        fail_step(data, STEP_CLIENT, NULL);
         return;
     }
 
+    data->client = g_object_ref(clients_get_udisks());
     data->manager = udisks_client_get_manager(data->client);
     data->object_manager = udisks_client_get_object_manager(data->client);
 
-    find_device_to_encrypt(data);
+    pipeline_step_done(data->steps, STEP_CLIENT);
 }
 
-static void got_bus(GObject *proxy, GAsyncResult *res, gpointer user_data)
+static void get_client(pipeline *p, guint id, gpointer user_data)
+{
+    clients_wait(got_client, user_data);
+}
+
+static void got_bus(gpointer user_data)
 {
     invocation_data *data = user_data;
-    GError *error = NULL;
 
-    data->connection = g_bus_get_finish(res, &error);
-    if (data->connection == NULL) {
-        fprintf(stderr, "%s\n", error->message);
-        end_encryption_to_failure(data);
-        g_error_free(error);
+    if (clients_get_connection() == NULL) {
+        fail_step(data, STEP_BUS, NULL);
         return;
     }
 
-    udisks_client_new(NULL, got_client, data);
+    data->connection = g_object_ref(clients_get_connection());
+    pipeline_step_done(data->steps, STEP_BUS);
 }
 
+static void get_bus(pipeline *p, guint id, gpointer user_data)
+{
+    clients_wait(got_bus, user_data);
+}
+
+static const pipeline_step encryption_steps[] = {
+    [STEP_BUS] = { "bus", get_bus, 0 },
+    [STEP_CLIENT] = { "udisks client", get_client, 0 },
+    [STEP_RESOLVE_DEVICE] = {
+        "resolve device", find_device_to_encrypt,
+        STEP(STEP_CLIENT) },
+    [STEP_BLOCK_DEVICE] = {
+        "block device", find_block_device,
+        STEP(STEP_BUS) | STEP(STEP_RESOLVE_DEVICE) },
+    [STEP_CAN_FORMAT] = {
+        "can format", can_format,
+        STEP(STEP_CLIENT) },
+    [STEP_UNMOUNT] = {
+        "unmount", unmount_filesystem,
+        STEP(STEP_BUS) | STEP(STEP_RESOLVE_DEVICE) },
+    [STEP_PREPARE_CONFIGURATION] = {
+        "prepare configuration", prepare_configuration, 0 },
+    [STEP_ERASE] = {
+        "erase", erase_device,
+        STEP(STEP_BLOCK_DEVICE) | STEP(STEP_CAN_FORMAT) |
+        STEP(STEP_UNMOUNT) },
+    [STEP_FORMAT] = {
+        "format", format_luks,
+        STEP(STEP_ERASE) },
+    [STEP_RESCAN] = {
+        "rescan", rescan_device,
+        STEP(STEP_FORMAT) },
+    [STEP_CLEARTEXT_DEVICE] = {
+        "cleartext device", wait_for_cleartext_device,
+        STEP(STEP_FORMAT) },
+    [STEP_WRITE_CONFIGURATION] = {
+        "write configuration", write_configuration,
+        STEP(STEP_PREPARE_CONFIGURATION) | STEP(STEP_RESCAN) |
+        STEP(STEP_CLEARTEXT_DEVICE) },
+    { NULL }
+};
+
 gboolean start_to_encrypt(
         gchar *passphrase,
         gboolean passphrase_is_temporary,
@@ -765,7 +992,9 @@ gboolean start_to_encrypt(
     data->passphrase = passphrase;
     data->passphrase_is_temporary = passphrase_is_temporary;
     data->erase = erase;
-    g_bus_get(G_BUS_TYPE_SYSTEM, NULL, got_bus, data);
+    data->steps = pipeline_new(
+            "Encryption", encryption_steps, encryption_finished, data);
+    pipeline_start(data->steps);
     return TRUE;
 }
 
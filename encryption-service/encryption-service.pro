@@ -1,18 +1,32 @@
 TEMPLATE = aux
 
 HEADERS += \
+    access.h \
+    clients.h \
     dbus.h \
     encrypt.h \
     erase.h \
-    manage.h
+    estimate.h \
+    holders.h \
+    manage.h \
+    pipeline.h \
+    probes.h \
+    trace.h
 
 SOURCES += \
+    access.c \
+    clients.c \
     dbus.c \
     encrypt.c \
+    estimate.c \
+    holders.c \
     main.c \
-    manage.c
+    manage.c \
+    pipeline.c \
+    trace.c
 
 OTHER_FILES += \
     dbus-org.sailfishos.EncryptionService.service \
     home-mount-settle.service \
-    org.sailfishos.EncryptionService.*
+    org.sailfishos.EncryptionService.* \
+    tests/*
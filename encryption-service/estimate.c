@@ -0,0 +1,451 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <linux/fs.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+#include "encrypt.h"
+#include "estimate.h"
+
+#ifndef DEVICE_TO_ENCRYPT
+#define DEVICE_TO_ENCRYPT /dev/sailfish/home
+#endif
+
+#ifndef STATE_DIR
+#define STATE_DIR /var/lib/sailfish-device-encryption
+#endif
+
+#ifndef HOME_DIR
+#define HOME_DIR /home
+#endif
+
+#define QUOTE(s) #s
+#define STR(s) QUOTE(s)
+
+#define PROBE_FILE_NAME ".estimate-probe"
+// Memory cards are mounted here by udisks, like home-encryption-copy.sh checks
+#define MEDIA_DIR "/run/media/"
+#define PROBE_SIZE (16 * 1024 * 1024)
+#define PROBE_CHUNK (1024 * 1024)
+#define KEYSTREAM_SIZE (32 * 1024 * 1024)
+#define KEYSTREAM_BLOCK 4096
+#define KEY_SIZE 16
+
+// LUKS header with PBKDF and mkfs with lazy inode table init
+#define FORMAT_SECONDS 20
+
+G_DEFINE_QUARK(estimate-error-quark, estimate_error)
+#define ESTIMATE_ERROR (estimate_error_quark())
+
+// Concurrent estimates would share the probe file and disturb each other
+G_LOCK_DEFINE_STATIC(measurement);
+
+typedef struct {
+    erase_t erase;
+    gchar *copy_target;
+} estimate_data;
+
+typedef struct {
+    double write;
+    double read;
+} throughput;
+
+static void estimate_data_free(gpointer user_data)
+{
+    estimate_data *data = user_data;
+
+    g_free(data->copy_target);
+    g_free(data);
+}
+
+static inline double seconds_since(gint64 start)
+{
+    gint64 elapsed = g_get_monotonic_time() - start;
+    return (double)(elapsed > 0 ? elapsed : 1) / G_USEC_PER_SEC;
+}
+
+static inline guint64 seconds_for(guint64 bytes, double bytes_per_second)
+{
+    if (bytes_per_second <= 0)
+        return 0;
+    return (guint64)(bytes / bytes_per_second + 0.5);
+}
+
+static gboolean get_device_size(guint64 *size, GError **error)
+{
+    int fd;
+
+    fd = open(STR(DEVICE_TO_ENCRYPT), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || ioctl(fd, BLKGETSIZE64, size) < 0) {
+        g_set_error(error, ESTIMATE_ERROR, errno,
+                    "Could not get size of %s: %s",
+                    STR(DEVICE_TO_ENCRYPT), strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return FALSE;
+    }
+
+    close(fd);
+    return TRUE;
+}
+
+static guint64 get_used_bytes(const gchar *path)
+{
+    struct statvfs buf;
+
+    if (statvfs(path, &buf) < 0) {
+        fprintf(stderr, "Could not stat %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    return (guint64)(buf.f_blocks - buf.f_bfree) * buf.f_frsize;
+}
+
+/*
+ * Resolves copy_target to the mount point of a memory card under
+ * MEDIA_DIR. The caller picks the path, so nothing else is written to.
+ */
+static gchar *resolve_copy_target(const gchar *copy_target, GError **error)
+{
+    struct stat st, parent_st;
+    gchar *path = realpath(copy_target, NULL);
+    gchar *resolved;
+    gchar *parent;
+    gboolean valid;
+
+    if (path == NULL || !g_str_has_prefix(path, MEDIA_DIR)) {
+        g_set_error(error, ESTIMATE_ERROR, EINVAL,
+                    "%s is not a memory card", copy_target);
+        free(path);
+        return NULL;
+    }
+
+    parent = g_path_get_dirname(path);
+    valid = stat(path, &st) == 0 && S_ISDIR(st.st_mode)
+            && stat(parent, &parent_st) == 0 && st.st_dev != parent_st.st_dev;
+    g_free(parent);
+    if (!valid) {
+        g_set_error(error, ESTIMATE_ERROR, EINVAL,
+                    "%s is not a mounted memory card", copy_target);
+        free(path);
+        return NULL;
+    }
+
+    resolved = g_strdup(path);
+    free(path);
+    return resolved;
+}
+
+static int create_probe(int dir_fd, gboolean named, gboolean direct)
+{
+    int flags = O_RDWR | O_CLOEXEC | (direct ? O_DIRECT : 0);
+
+    if (named)
+        return openat(dir_fd, PROBE_FILE_NAME,
+                      flags | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    return openat(dir_fd, ".", flags | O_TMPFILE, 0600);
+}
+
+/*
+ * Creates the probe file in dir_fd, without a name if the filesystem
+ * supports O_TMPFILE. Otherwise a new PROBE_FILE_NAME is created, never
+ * following a link or opening an existing file.
+ */
+static int open_probe(int dir_fd, gboolean *direct, gboolean *named)
+{
+    int fd;
+
+    *named = FALSE;
+    *direct = TRUE;
+    fd = create_probe(dir_fd, *named, *direct);
+    if (fd < 0 && errno == EINVAL) {
+        *direct = FALSE;
+        fd = create_probe(dir_fd, *named, *direct);
+    }
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR))
+        return fd;
+
+    // No O_TMPFILE on vfat and exfat, a probe left by a crash is replaced
+    *named = TRUE;
+    *direct = TRUE;
+    unlinkat(dir_fd, PROBE_FILE_NAME, 0);
+    fd = create_probe(dir_fd, *named, *direct);
+    if (fd < 0 && errno == EINVAL) {
+        *direct = FALSE;
+        fd = create_probe(dir_fd, *named, *direct);
+    }
+    return fd;
+}
+
+/*
+ * Writes and reads back PROBE_SIZE bytes in directory to measure the
+ * storage below it. The device to encrypt can not be written before
+ * erasure, so for it the state directory on the same flash is used.
+ * O_DIRECT is not supported everywhere (e.g. some vfat mounts), in which
+ * case the write is synced and the page cache dropped before reading.
+ */
+static gboolean measure_storage(
+        const gchar *directory,
+        throughput *result,
+        GError **error)
+{
+    void *buffer = NULL;
+    gboolean direct;
+    gboolean named;
+    gboolean success = FALSE;
+    gint64 start;
+    size_t done;
+    int dir_fd;
+    int fd;
+
+    dir_fd = open(directory, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    fd = dir_fd >= 0 ? open_probe(dir_fd, &direct, &named) : -1;
+    if (fd < 0) {
+        g_set_error(error, ESTIMATE_ERROR, errno,
+                    "Could not create probe in %s: %s", directory,
+                    strerror(errno));
+        if (dir_fd >= 0)
+            close(dir_fd);
+        return FALSE;
+    }
+
+    if (posix_memalign(&buffer, 4096, PROBE_CHUNK) != 0) {
+        g_set_error_literal(error, ESTIMATE_ERROR, ENOMEM,
+                            "Out of memory");
+        goto out;
+    }
+    memset(buffer, 0xa5, PROBE_CHUNK);
+
+    start = g_get_monotonic_time();
+    for (done = 0; done < PROBE_SIZE; done += PROBE_CHUNK) {
+        if (write(fd, buffer, PROBE_CHUNK) != PROBE_CHUNK) {
+            g_set_error(error, ESTIMATE_ERROR, errno,
+                        "Could not write probe in %s: %s", directory,
+                        strerror(errno));
+            goto out;
+        }
+    }
+    if (fdatasync(fd) < 0) {
+        g_set_error(error, ESTIMATE_ERROR, errno,
+                    "Could not sync probe in %s: %s", directory,
+                    strerror(errno));
+        goto out;
+    }
+    result->write = PROBE_SIZE / seconds_since(start);
+
+    if (!direct)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    start = g_get_monotonic_time();
+    for (done = 0; done < PROBE_SIZE; done += PROBE_CHUNK) {
+        if (pread(fd, buffer, PROBE_CHUNK, done) != PROBE_CHUNK) {
+            g_set_error(error, ESTIMATE_ERROR, errno,
+                        "Could not read probe in %s: %s", directory,
+                        strerror(errno));
+            goto out;
+        }
+    }
+    result->read = PROBE_SIZE / seconds_since(start);
+
+    printf("Storage at %s: write %.1f MB/s, read %.1f MB/s%s\n",
+           directory, result->write / 1e6, result->read / 1e6,
+           direct ? "" : " (buffered)");
+    success = TRUE;
+
+out:
+    close(fd);
+    if (named)
+        unlinkat(dir_fd, PROBE_FILE_NAME, 0);
+    close(dir_fd);
+    free(buffer);
+    return success;
+}
+
+// Same keystream as erase_data() in encrypt.c
+static double measure_keystream(void)
+{
+    static unsigned char inbuf[KEYSTREAM_BLOCK];
+    static unsigned char outbuf[KEYSTREAM_BLOCK];
+    unsigned char key[KEY_SIZE] = { 0 };
+    unsigned char iv[] = "1234567890123456";
+    EVP_CIPHER_CTX *ctx;
+    double speed;
+    gint64 start;
+    size_t done;
+    int outlen;
+
+    ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, iv);
+
+    start = g_get_monotonic_time();
+    for (done = 0; done < KEYSTREAM_SIZE; done += KEYSTREAM_BLOCK)
+        EVP_CipherUpdate(ctx, outbuf, &outlen, inbuf, sizeof(inbuf));
+    speed = KEYSTREAM_SIZE / seconds_since(start);
+
+    EVP_CIPHER_CTX_free(ctx);
+    printf("Keystream: %.1f MB/s\n", speed / 1e6);
+    return speed;
+}
+
+static void estimate_thread(
+        GTask *task,
+        gpointer source_object,
+        gpointer task_data,
+        GCancellable *cancellable)
+{
+    estimate_data *data = task_data;
+    GError *error = NULL;
+    GVariantBuilder builder;
+    throughput device, target;
+    guint64 device_size, home_used, erase = 0, copy = 0, restore = 0;
+    double erase_speed;
+
+    G_LOCK(measurement);
+
+    if (!get_device_size(&device_size, &error) ||
+            !measure_storage(STR(STATE_DIR), &device, &error)) {
+        G_UNLOCK(measurement);
+        g_task_return_error(task, error);
+        return;
+    }
+
+    switch (data->erase) {
+        case ERASE_WITH_ZEROS:
+            erase = seconds_for(device_size, device.write);
+            break;
+        case ERASE_WITH_RANDOM:
+            erase_speed = measure_keystream();
+            if (device.write < erase_speed)
+                erase_speed = device.write;
+            erase = seconds_for(device_size, erase_speed);
+            break;
+        default:
+            break;
+    }
+
+    if (data->copy_target[0] != '\0') {
+        if (!measure_storage(data->copy_target, &target, &error)) {
+            G_UNLOCK(measurement);
+            g_task_return_error(task, error);
+            return;
+        }
+        home_used = get_used_bytes(STR(HOME_DIR));
+        copy = seconds_for(home_used, MIN(device.read, target.write));
+        restore = seconds_for(home_used, MIN(target.read, device.write));
+    }
+
+    G_UNLOCK(measurement);
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{st}"));
+    g_variant_builder_add(&builder, "{st}", "copy", copy);
+    g_variant_builder_add(&builder, "{st}", "erase", erase);
+    g_variant_builder_add(&builder, "{st}", "format",
+                          (guint64)FORMAT_SECONDS);
+    g_variant_builder_add(&builder, "{st}", "restore", restore);
+
+    printf("Estimated duration: copy %" G_GUINT64_FORMAT
+           " s, erase %" G_GUINT64_FORMAT " s, restore %" G_GUINT64_FORMAT
+           " s\n", copy, erase, restore);
+
+    g_task_return_pointer(
+            task,
+            g_variant_ref_sink(g_variant_new(
+                    "(ta{st})", copy + erase + FORMAT_SECONDS + restore,
+                    &builder)),
+            (GDestroyNotify)g_variant_unref);
+}
+
+void estimate_duration(
+        erase_t erase,
+        const gchar *copy_target,
+        GAsyncReadyCallback callback,
+        gpointer user_data)
+{
+    estimate_data *data;
+    GError *error = NULL;
+    gchar *target = NULL;
+    GTask *task;
+
+    task = g_task_new(NULL, NULL, callback, user_data);
+
+    // Probes would compete with erasure and copying for the storage
+    switch (get_encryption_status()) {
+        case ENCRYPTION_NOT_STARTED:
+        case ENCRYPTION_FINISHED:
+        case ENCRYPTION_FAILED:
+            break;
+        default:
+            g_task_return_new_error(task, ESTIMATE_ERROR, EBUSY,
+                                    "Encryption is in progress");
+            g_object_unref(task);
+            return;
+    }
+
+    if (copy_target != NULL && copy_target[0] != '\0') {
+        target = resolve_copy_target(copy_target, &error);
+        if (target == NULL) {
+            g_task_return_error(task, error);
+            g_object_unref(task);
+            return;
+        }
+    }
+
+    data = g_new0(estimate_data, 1);
+    data->erase = erase;
+    data->copy_target = target ? target : g_strdup("");
+
+    g_task_set_task_data(task, data, estimate_data_free);
+    g_task_run_in_thread(task, estimate_thread);
+    g_object_unref(task);
+}
+
+GVariant *estimate_duration_finish(GAsyncResult *res, GError **error)
+{
+    return g_task_propagate_pointer(G_TASK(res), error);
+}
+
+// vim: expandtab:ts=4:sw=4
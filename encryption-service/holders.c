@@ -0,0 +1,692 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#include <dirent.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "holders.h"
+
+#define UNIT_PATH_PREFIX "/org/freedesktop/systemd1/unit/"
+#define SYSTEMD_PATH "/org/freedesktop/systemd1"
+#define SYSTEMD_MANAGER_IFACE "org.freedesktop.systemd1.Manager"
+#define SYSTEMD_UNIT_IFACE "org.freedesktop.systemd1.Unit"
+#define NO_UNIT_FOR_PID_ERROR "org.freedesktop.systemd1.NoUnitForPID"
+#define NO_SUCH_UNIT_ERROR "org.freedesktop.systemd1.NoSuchUnit"
+// Private socket of the user manager, it takes root too
+#define USER_MANAGER_ADDRESS "unix:path=/run/user/%u/systemd/private"
+
+typedef struct {
+    holders_found_func found;
+    gpointer user_data;
+    GDBusProxy *systemd_manager;
+    gchar **directories;
+    GPtrArray *units;
+    GHashTable *user_pids;
+    GHashTable *user_managers;
+    guint pending;
+    gboolean unrestartable;
+    gboolean mount_dependents;
+    gboolean dependents_looked_up;
+} holders_data;
+
+typedef struct {
+    holders_data *data;
+    guint uid;
+    guint32 pid;
+} pid_lookup;
+
+typedef struct {
+    holders_data *data;
+    guint uid;
+    GArray *pids;
+} user_lookup;
+
+typedef struct {
+    holders_data *data;
+    GDBusProxy *manager;
+    guint uid;
+} mount_lookup;
+
+static gboolean is_under(const char *path, const char * const *directories)
+{
+    size_t length;
+
+    for (; *directories != NULL; directories++) {
+        length = strlen(*directories);
+        if (strncmp(path, *directories, length) == 0 &&
+                (path[length] == '\0' || path[length] == '/'))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean link_is_under(
+        const char *path,
+        const char * const *directories)
+{
+    char target[PATH_MAX];
+    ssize_t length;
+
+    length = readlink(path, target, sizeof(target) - 1);
+    if (length < 0)
+        return FALSE;
+    target[length] = '\0';
+    return is_under(target, directories);
+}
+
+// Mapped files, like libraries and databases, hold home as open files do
+static gboolean maps_are_under(
+        const char *pid,
+        const char * const *directories)
+{
+    char line[PATH_MAX + 128];
+    gboolean holds = FALSE;
+    gboolean continued = FALSE;
+    gchar *path;
+    char *file, *end;
+    FILE *maps;
+
+    path = g_strdup_printf("/proc/%s/maps", pid);
+    maps = fopen(path, "r");
+    g_free(path);
+    if (maps == NULL)
+        return FALSE;
+
+    while (!holds && fgets(line, sizeof(line), maps) != NULL) {
+        end = strchr(line, '\n');
+        if (end != NULL)
+            *end = '\0';
+        // Rest of a line that did not fit is not a mapping of its own
+        if (!continued) {
+            file = strchr(line, '/');
+            holds = file != NULL && is_under(file, directories);
+        }
+        continued = end == NULL;
+    }
+    fclose(maps);
+
+    return holds;
+}
+
+/*
+ * Working directory is not counted, the user manager starts services in
+ * home by default and every one of them would be restarted for it.
+ */
+static gboolean process_holds(
+        const char *pid,
+        const char * const *directories)
+{
+    gchar *path, *fd_path;
+    gboolean holds = FALSE;
+    struct dirent *entry;
+    DIR *fds;
+
+    path = g_strdup_printf("/proc/%s/root", pid);
+    holds = link_is_under(path, directories);
+    g_free(path);
+
+    if (holds)
+        return TRUE;
+
+    path = g_strdup_printf("/proc/%s/fd", pid);
+    fds = opendir(path);
+    while (fds != NULL && !holds && (entry = readdir(fds)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        fd_path = g_strdup_printf("%s/%s", path, entry->d_name);
+        holds = link_is_under(fd_path, directories);
+        g_free(fd_path);
+    }
+    if (fds != NULL)
+        closedir(fds);
+    g_free(path);
+
+    return holds || maps_are_under(pid, directories);
+}
+
+// Unit object paths escape everything but alphanumerics as _xx
+static gchar *unit_name_from_path(const char *path)
+{
+    GString *name;
+    const char *c;
+    char hex[3] = { 0 };
+
+    if (!g_str_has_prefix(path, UNIT_PATH_PREFIX))
+        return NULL;
+
+    name = g_string_new(NULL);
+    for (c = path + strlen(UNIT_PATH_PREFIX); *c != '\0'; c++) {
+        if (c[0] == '_' && g_ascii_isxdigit(c[1]) &&
+                g_ascii_isxdigit(c[2])) {
+            hex[0] = c[1];
+            hex[1] = c[2];
+            g_string_append_c(name, (char)strtol(hex, NULL, 16));
+            c += 2;
+        } else {
+            g_string_append_c(name, *c);
+        }
+    }
+    return g_string_free(name, FALSE);
+}
+
+static void holder_unit_free(gpointer user_data)
+{
+    holder_unit *unit = user_data;
+
+    g_free(unit->name);
+    g_object_unref(unit->manager);
+    g_free(unit);
+}
+
+static void add_unit(
+        holders_data *data,
+        GDBusProxy *manager,
+        guint uid,
+        gchar *name)
+{
+    holder_unit *unit;
+    guint i;
+
+    for (i = 0; i < data->units->len; i++) {
+        unit = g_ptr_array_index(data->units, i);
+        if (unit->manager == manager && !strcmp(unit->name, name)) {
+            g_free(name);
+            return;
+        }
+    }
+
+    unit = g_new0(holder_unit, 1);
+    unit->name = name;
+    unit->manager = g_object_ref(manager);
+    unit->uid = uid;
+    g_ptr_array_add(data->units, unit);
+}
+
+static void report(holders_data *data)
+{
+    holder_unit *unit;
+    guint i;
+
+    for (i = 0; i < data->units->len; i++) {
+        unit = g_ptr_array_index(data->units, i);
+        printf("%s unit %s holds home\n",
+               unit->manager == data->systemd_manager ? "System" : "User",
+               unit->name);
+    }
+
+    data->found(data->units, !data->unrestartable, data->user_data);
+    g_hash_table_destroy(data->user_pids);
+    g_hash_table_destroy(data->user_managers);
+    g_object_unref(data->systemd_manager);
+    g_strfreev(data->directories);
+    g_free(data);
+}
+
+static void look_up_user_units(holders_data *data);
+static void look_up_mount_dependents(holders_data *data);
+
+static void lookup_done(holders_data *data)
+{
+    if (--data->pending > 0)
+        return;
+
+    // Session processes are in the user manager unit, look at them there
+    if (!data->unrestartable && g_hash_table_size(data->user_pids) > 0) {
+        data->pending++;
+        look_up_user_units(data);
+        if (--data->pending > 0)
+            return;
+    }
+
+    // Units that require the mounts may have nothing open there yet
+    if (data->mount_dependents && !data->unrestartable &&
+            !data->dependents_looked_up) {
+        data->dependents_looked_up = TRUE;
+        data->pending++;
+        look_up_mount_dependents(data);
+        if (--data->pending > 0)
+            return;
+    }
+
+    report(data);
+}
+
+static void got_unit(GObject *proxy, GAsyncResult *res, gpointer user_data)
+{
+    pid_lookup *lookup = user_data;
+    holders_data *data = lookup->data;
+    GError *error = NULL;
+    GVariant *result;
+    gchar *path, *unit = NULL, *remote;
+    GArray *pids;
+    guint uid;
+    int end = 0;
+
+    result = g_dbus_proxy_call_finish((GDBusProxy *)proxy, res, &error);
+    if (result == NULL) {
+        // Process has exited meanwhile, anything else is a failed lookup
+        remote = g_dbus_error_get_remote_error(error);
+        if (g_strcmp0(remote, NO_UNIT_FOR_PID_ERROR) != 0) {
+            fprintf(stderr, "%s\n", error->message);
+            data->unrestartable = TRUE;
+        }
+        g_free(remote);
+        g_error_free(error);
+        goto out;
+    }
+
+    g_variant_get(result, "(o)", &path);
+    g_variant_unref(result);
+    unit = unit_name_from_path(path);
+
+    if (unit != NULL && (GDBusProxy *)proxy == data->systemd_manager &&
+            sscanf(unit, "user@%u.service%n", &uid, &end) == 1 &&
+            unit[end] == '\0') {
+        pids = g_hash_table_lookup(data->user_pids, GUINT_TO_POINTER(uid));
+        if (pids == NULL) {
+            pids = g_array_new(FALSE, FALSE, sizeof(guint32));
+            g_hash_table_insert(data->user_pids, GUINT_TO_POINTER(uid), pids);
+        }
+        g_array_append_val(pids, lookup->pid);
+        g_free(unit);
+    } else if (unit == NULL || g_str_has_suffix(unit, ".scope")) {
+        printf("Home is held by %s, restarting the whole session\n",
+               unit ? unit : path);
+        data->unrestartable = TRUE;
+        g_free(unit);
+    } else {
+        add_unit(data, (GDBusProxy *)proxy, lookup->uid, unit);
+    }
+    g_free(path);
+
+out:
+    g_free(lookup);
+    lookup_done(data);
+}
+
+static void get_unit(
+        holders_data *data,
+        GDBusProxy *manager,
+        guint uid,
+        guint32 pid)
+{
+    pid_lookup *lookup = g_new0(pid_lookup, 1);
+
+    lookup->data = data;
+    lookup->uid = uid;
+    lookup->pid = pid;
+    data->pending++;
+    g_dbus_proxy_call(
+            manager, "GetUnitByPID", g_variant_new("(u)", pid),
+            G_DBUS_CALL_FLAGS_NONE, -1, NULL, got_unit, lookup);
+}
+
+static void user_lookup_free(user_lookup *lookup)
+{
+    g_array_unref(lookup->pids);
+    g_free(lookup);
+}
+
+static void got_user_manager(
+        GObject *source,
+        GAsyncResult *res,
+        gpointer user_data)
+{
+    user_lookup *lookup = user_data;
+    holders_data *data = lookup->data;
+    GError *error = NULL;
+    GDBusProxy *manager;
+    guint i;
+
+    manager = g_dbus_proxy_new_finish(res, &error);
+    if (manager == NULL) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        data->unrestartable = TRUE;
+    } else {
+        for (i = 0; i < lookup->pids->len; i++)
+            get_unit(data, manager, lookup->uid,
+                     g_array_index(lookup->pids, guint32, i));
+        g_hash_table_insert(data->user_managers,
+                            GUINT_TO_POINTER(lookup->uid), manager);
+    }
+
+    user_lookup_free(lookup);
+    lookup_done(data);
+}
+
+static void got_user_connection(
+        GObject *source,
+        GAsyncResult *res,
+        gpointer user_data)
+{
+    user_lookup *lookup = user_data;
+    holders_data *data = lookup->data;
+    GDBusConnection *connection;
+    GError *error = NULL;
+
+    connection = g_dbus_connection_new_for_address_finish(res, &error);
+    if (connection == NULL) {
+        fprintf(stderr, "User manager of %u: %s\n",
+                lookup->uid, error->message);
+        g_error_free(error);
+        data->unrestartable = TRUE;
+        user_lookup_free(lookup);
+        lookup_done(data);
+        return;
+    }
+
+    // Peer connection to the manager itself, there is no bus name
+    g_dbus_proxy_new(
+            connection, G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES, NULL,
+            NULL, SYSTEMD_PATH, SYSTEMD_MANAGER_IFACE,
+            NULL, got_user_manager, lookup);
+    g_object_unref(connection);
+}
+
+static void look_up_user_units(holders_data *data)
+{
+    GHashTableIter iter;
+    gpointer uid, pids;
+    user_lookup *lookup;
+    gchar *address;
+
+    g_hash_table_iter_init(&iter, data->user_pids);
+    while (g_hash_table_iter_next(&iter, &uid, &pids)) {
+        lookup = g_new0(user_lookup, 1);
+        lookup->data = data;
+        lookup->uid = GPOINTER_TO_UINT(uid);
+        lookup->pids = g_array_ref(pids);
+        address = g_strdup_printf(USER_MANAGER_ADDRESS, lookup->uid);
+        data->pending++;
+        g_dbus_connection_new_for_address(
+                address, G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+                NULL, NULL, got_user_connection, lookup);
+        g_free(address);
+    }
+    g_hash_table_remove_all(data->user_pids);
+}
+
+// Mount unit names escape the path as systemd-escape --path does
+static gchar *mount_unit_name(const char *path)
+{
+    GString *name;
+    const char *c;
+
+    while (*path == '/')
+        path++;
+    if (*path == '\0')
+        return g_strdup("-.mount");
+
+    name = g_string_new(NULL);
+    for (c = path; *c != '\0'; c++) {
+        if (*c == '/')
+            g_string_append_c(name, '-');
+        else if (g_ascii_isalnum(*c) || *c == '_' ||
+                (*c == '.' && c != path))
+            g_string_append_c(name, *c);
+        else
+            g_string_append_printf(name, "\\x%02x", (guchar)*c);
+    }
+    g_string_append(name, ".mount");
+    return g_string_free(name, FALSE);
+}
+
+static void mount_lookup_done(mount_lookup *lookup)
+{
+    holders_data *data = lookup->data;
+
+    g_object_unref(lookup->manager);
+    g_free(lookup);
+    lookup_done(data);
+}
+
+// A mount that is not loaded has no dependents, anything else is a failure
+static void mount_lookup_failed(mount_lookup *lookup, GError *error)
+{
+    gchar *remote;
+
+    remote = g_dbus_error_get_remote_error(error);
+    if (g_strcmp0(remote, NO_SUCH_UNIT_ERROR) != 0) {
+        fprintf(stderr, "%s\n", error->message);
+        lookup->data->unrestartable = TRUE;
+    }
+    g_free(remote);
+    g_error_free(error);
+    mount_lookup_done(lookup);
+}
+
+static void got_dependent_units(
+        GObject *proxy,
+        GAsyncResult *res,
+        gpointer user_data)
+{
+    mount_lookup *lookup = user_data;
+    GError *error = NULL;
+    GVariant *result, *units, *unit;
+    const gchar *name, *state;
+    GVariantIter iter;
+
+    result = g_dbus_proxy_call_finish((GDBusProxy *)proxy, res, &error);
+    if (result == NULL) {
+        mount_lookup_failed(lookup, error);
+        return;
+    }
+
+    // Only running units are stopped, so only they are started again
+    units = g_variant_get_child_value(result, 0);
+    g_variant_iter_init(&iter, units);
+    while ((unit = g_variant_iter_next_value(&iter)) != NULL) {
+        g_variant_get_child(unit, 0, "&s", &name);
+        g_variant_get_child(unit, 3, "&s", &state);
+        if (strcmp(state, "active") == 0)
+            add_unit(lookup->data, lookup->manager, lookup->uid,
+                     g_strdup(name));
+        g_variant_unref(unit);
+    }
+    g_variant_unref(units);
+    g_variant_unref(result);
+
+    mount_lookup_done(lookup);
+}
+
+static void got_mount_dependents(
+        GObject *connection,
+        GAsyncResult *res,
+        gpointer user_data)
+{
+    mount_lookup *lookup = user_data;
+    GError *error = NULL;
+    GVariant *result, *value;
+    const gchar **names;
+    GPtrArray *services;
+    guint i;
+
+    result = g_dbus_connection_call_finish(
+            (GDBusConnection *)connection, res, &error);
+    if (result == NULL) {
+        mount_lookup_failed(lookup, error);
+        return;
+    }
+
+    /*
+     * RequiresMountsFor makes the unit require the mount. Targets are not
+     * restarted and sessions are covered by their processes.
+     */
+    g_variant_get(result, "(v)", &value);
+    names = g_variant_get_strv(value, NULL);
+    services = g_ptr_array_new();
+    for (i = 0; names[i] != NULL; i++) {
+        if (g_str_has_suffix(names[i], ".service") &&
+                !g_str_has_prefix(names[i], "user@"))
+            g_ptr_array_add(services, (gpointer)names[i]);
+    }
+
+    if (services->len == 0) {
+        mount_lookup_done(lookup);
+    } else {
+        g_ptr_array_add(services, NULL);
+        g_dbus_proxy_call(
+                lookup->manager, "ListUnitsByNames",
+                g_variant_new("(^as)", services->pdata),
+                G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                got_dependent_units, lookup);
+    }
+    g_ptr_array_free(services, TRUE);
+    g_free(names);
+    g_variant_unref(value);
+    g_variant_unref(result);
+}
+
+static void got_mount_unit(
+        GObject *proxy,
+        GAsyncResult *res,
+        gpointer user_data)
+{
+    mount_lookup *lookup = user_data;
+    GError *error = NULL;
+    GVariant *result;
+    gchar *path;
+
+    result = g_dbus_proxy_call_finish((GDBusProxy *)proxy, res, &error);
+    if (result == NULL) {
+        mount_lookup_failed(lookup, error);
+        return;
+    }
+
+    g_variant_get(result, "(o)", &path);
+    g_variant_unref(result);
+    g_dbus_connection_call(
+            g_dbus_proxy_get_connection(lookup->manager),
+            g_dbus_proxy_get_name(lookup->manager), path,
+            "org.freedesktop.DBus.Properties", "Get",
+            g_variant_new("(ss)", SYSTEMD_UNIT_IFACE, "RequiredBy"),
+            G_VARIANT_TYPE("(v)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+            got_mount_dependents, lookup);
+    g_free(path);
+}
+
+static void get_mount_dependents(
+        holders_data *data,
+        GDBusProxy *manager,
+        guint uid)
+{
+    mount_lookup *lookup;
+    gchar *mount;
+    guint i;
+
+    for (i = 0; data->directories[i] != NULL; i++) {
+        lookup = g_new0(mount_lookup, 1);
+        lookup->data = data;
+        lookup->manager = g_object_ref(manager);
+        lookup->uid = uid;
+        mount = mount_unit_name(data->directories[i]);
+        data->pending++;
+        g_dbus_proxy_call(
+                manager, "GetUnit", g_variant_new("(s)", mount),
+                G_DBUS_CALL_FLAGS_NONE, -1, NULL, got_mount_unit, lookup);
+        g_free(mount);
+    }
+}
+
+static void look_up_mount_dependents(holders_data *data)
+{
+    GHashTableIter iter;
+    gpointer uid, manager;
+
+    get_mount_dependents(data, data->systemd_manager, 0);
+    g_hash_table_iter_init(&iter, data->user_managers);
+    while (g_hash_table_iter_next(&iter, &uid, &manager))
+        get_mount_dependents(data, manager, GPOINTER_TO_UINT(uid));
+}
+
+void find_holders(
+        GDBusProxy *systemd_manager,
+        const char * const *directories,
+        gboolean mount_dependents,
+        holders_found_func found,
+        gpointer user_data)
+{
+    holders_data *data;
+    struct dirent *entry;
+    pid_t self = getpid();
+    char *end;
+    DIR *proc;
+    long pid;
+
+    data = g_new0(holders_data, 1);
+    data->found = found;
+    data->user_data = user_data;
+    data->systemd_manager = g_object_ref(systemd_manager);
+    data->directories = g_strdupv((gchar **)directories);
+    data->mount_dependents = mount_dependents;
+    data->units = g_ptr_array_new_with_free_func(holder_unit_free);
+    data->user_pids = g_hash_table_new_full(
+            g_direct_hash, g_direct_equal, NULL,
+            (GDestroyNotify)g_array_unref);
+    data->user_managers = g_hash_table_new_full(
+            g_direct_hash, g_direct_equal, NULL, g_object_unref);
+
+    // Keep one reference until the scan is done
+    data->pending = 1;
+
+    proc = opendir("/proc");
+    if (proc == NULL) {
+        fprintf(stderr, "Could not open /proc\n");
+        data->unrestartable = TRUE;
+    }
+
+    while (proc != NULL && (entry = readdir(proc)) != NULL) {
+        pid = strtol(entry->d_name, &end, 10);
+        if (*end != '\0' || pid <= 0 || pid == self)
+            continue;
+        if (!process_holds(entry->d_name, directories))
+            continue;
+
+        get_unit(data, systemd_manager, 0, (guint32)pid);
+    }
+    if (proc != NULL)
+        closedir(proc);
+
+    lookup_done(data);
+}
+
+// vim: expandtab:ts=4:sw=4
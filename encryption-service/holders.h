@@ -0,0 +1,74 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#ifndef __HOLDERS_H
+#define __HOLDERS_H
+
+#include <gio/gio.h>
+
+/*
+ * Finds systemd units whose processes have their root, open files or
+ * mapped files under the given directories. With mount_dependents also
+ * running services that require the mounts of the directories, i.e. have
+ * RequiresMountsFor on them, are found. Processes of a user session are looked up again on the user
+ * manager of the session, so its units are reported with that manager
+ * and the uid of the user. Units are reported as an array of holder_unit
+ * owned by the callback. restartable is FALSE when a holder can not be
+ * restarted on its own, i.e. it is in a scope or in no unit, or when a
+ * lookup fails.
+ */
+
+typedef struct {
+    gchar *name;
+    GDBusProxy *manager;
+    guint uid;
+} holder_unit;
+
+typedef void (*holders_found_func)(
+        GPtrArray *units,
+        gboolean restartable,
+        gpointer user_data);
+
+void find_holders(
+        GDBusProxy *systemd_manager,
+        const char * const *directories,
+        gboolean mount_dependents,
+        holders_found_func found,
+        gpointer user_data);
+
+#endif // __HOLDERS_H
+
+// vim: expandtab:ts=4:sw=4
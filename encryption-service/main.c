@@ -38,13 +38,27 @@
 #include <glib.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "access.h"
+#include "clients.h"
+#include "copyservice.h"
 #include "dbus.h"
 #include "encrypt.h"
+#include "homecopy.h"
 #include "manage.h"
+#include "trace.h"
 
 #define TEMPORARY_PASSPHRASE "00000"
 #define QUIT_TIMEOUT 60
 
+#ifndef STATE_DIR
+#define STATE_DIR /var/lib/sailfish-device-encryption
+#endif
+
+#define QUOTE(s) #s
+#define STR(s) QUOTE(s)
+
+#define ENCRYPT_HOME_MARKER STR(STATE_DIR) "/encrypt-home"
+
 G_DEFINE_QUARK(encryption-error-quark, encryption_error)
 #define ENCRYPTION_ERROR (encryption_error_quark())
 
@@ -57,8 +71,28 @@ static GMainLoop *main_loop;
 static gchar *saved_passphrase = NULL;
 static erase_t erase_type = DONT_ERASE;
 
+/*
+ * The daemon also serves home copy, so it runs without the marker too.
+ * Encryption itself is refused unless it was requested.
+ */
+static gboolean encryption_requested(GError **error)
+{
+    if (g_file_test(ENCRYPT_HOME_MARKER, G_FILE_TEST_EXISTS))
+        return TRUE;
+
+    g_set_error_literal(
+            error, ENCRYPTION_ERROR, ENCRYPTION_ERROR_FAILED,
+            "Encryption was not requested");
+    return FALSE;
+}
+
 static gboolean call_prepare(gchar *passphrase, erase_t erase, GError **error)
 {
+    if (!encryption_requested(error)) {
+        g_free(passphrase);
+        return FALSE;
+    }
+
     if (saved_passphrase != NULL) {
         g_free(passphrase);
         g_set_error_literal(
@@ -86,6 +120,10 @@ static gboolean call_encrypt(
 {
     gchar *passphrase = saved_passphrase;
     gboolean passphrase_is_temporary = FALSE;
+
+    if (!encryption_requested(error))
+        return FALSE;
+
     if (saved_passphrase == NULL) {
         passphrase_is_temporary = TRUE;
         passphrase = g_strdup(TEMPORARY_PASSPHRASE);
@@ -131,6 +169,10 @@ static gboolean call_finalize(GError **error)
 }
 
 static gboolean quit_if_idle(gpointer user_data) {
+    // Home copy may keep the daemon up, check again later
+    if (get_copy_state() == COPYING)
+        return TRUE;
+
     if (get_encryption_status() == ENCRYPTION_NOT_STARTED &&
             saved_passphrase == NULL)
         g_main_loop_quit(main_loop);
@@ -161,10 +203,17 @@ int main(int argc, char **argv)
     setlinebuf(stdout);
     main_loop = g_main_loop_new(NULL, FALSE);
 
+    // Connect to services while bus names are acquired
+    clients_init();
     init_encryption_service(status_changed_handler);
     init_dbus(call_prepare, call_encrypt, call_finalize);
+    init_copy_service(main_loop);
     g_timeout_add_seconds(QUIT_TIMEOUT, quit_if_idle, NULL);
     g_main_loop_run(main_loop);
+    trace_write();
+    cleanup_copy_service();
+    access_cleanup();
+    clients_cleanup();
 
     switch (get_encryption_status()) {
         case ENCRYPTION_NOT_STARTED:
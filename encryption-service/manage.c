@@ -48,18 +48,33 @@
 #include <usb-moded/usb_moded-dbus.h>
 #include <sailfishaccesscontrol/sailfishaccesscontrol.h>
 
+#include "clients.h"
+#include "holders.h"
+#include "homecopy.h"
 #include "manage.h"
+#include "pipeline.h"
+#include "probes.h"
+#include "trace.h"
 
-#define DEVICE_OWNER_LOCALE \
-    "/home/.system/var/lib/environment/100000/locale.conf"
+#ifndef STATE_DIR
+#define STATE_DIR /var/lib/sailfish-device-encryption
+#endif
 
-typedef void (*job_handler)(GDBusProxy *proxy, guint32 id, gpointer user_data);
+#ifndef HOME_DIR
+#define HOME_DIR /home
+#endif
 
-typedef struct {
-    job_handler handler;
-    guint32 id;
-    gchar result[20];
-} job_watch;
+#define QUOTE(s) #s
+#define STR(s) QUOTE(s)
+
+#define ENCRYPT_HOME_MARKER STR(STATE_DIR) "/encrypt-home"
+#define DEVICE_OWNER_LOCALE \
+    STR(HOME_DIR) "/.system/var/lib/environment/100000/locale.conf"
+
+// Seconds to wait for a systemd job, as systemd's default start timeout
+#define JOB_TIMEOUT 90
+// Seconds between checks whether home copy lets the daemon quit
+#define COPY_CHECK_INTERVAL 5
 
 typedef enum {
     END_OF_MANAGE_TASKS,
@@ -71,40 +86,124 @@ typedef enum {
     UNMASK_UNIT,
     CREATE_MARKER,
     REMOVE_MARKER,
+    STOP_HOLDERS,
+    SET_HOLDERS_HOME,
+    START_HOLDERS,
 } manage_action;
 
+/*
+ * Task tables are dependency graphs run by the pipeline. A task starts as
+ * soon as the tasks in depends are done, so independent systemd jobs are
+ * submitted concurrently.
+ */
 typedef struct {
     manage_action action;
     const char *argument;
+    guint32 depends;
 } manage_task;
 
+/*
+ * Holders are the units that have the temporary home open. When they can
+ * be restarted on their own, only they are stopped while home is moved
+ * back instead of terminating the whole user session. Otherwise these
+ * tasks have nothing to do. User managers of the holders still have HOME
+ * in the temporary home, it is set back before the holders are started.
+ */
+enum {
+    FINALIZE_STOP_HOLDERS,
+    FINALIZE_UNMASK_HOME,
+    FINALIZE_RELOAD,
+    FINALIZE_ENABLE_CHARGING,
+    FINALIZE_START_HOME,
+    FINALIZE_STOP_PREPARATION,
+    FINALIZE_SET_HOLDERS_HOME,
+    FINALIZE_START_HOLDERS,
+    FINALIZE_START_DEFAULT,
+};
+
+// The reload also loads drop-ins written after encryption, no other is done
 const manage_task finalization_tasks[] = {
-    { UNMASK_UNIT, "home.mount" },
-    { RELOAD_UNITS, NULL },
-    { ENABLE_UNIT, "jolla-actdead-charging.service" },
-    { START_UNIT, "home.mount" },
-    { STOP_UNIT, "home-encryption-preparation.service" },
-    { START_UNIT, "default.target" },
+    [FINALIZE_STOP_HOLDERS] = { STOP_HOLDERS, NULL, 0 },
+    [FINALIZE_UNMASK_HOME] = { UNMASK_UNIT, "home.mount", 0 },
+    [FINALIZE_RELOAD] = {
+        RELOAD_UNITS, NULL, STEP(FINALIZE_UNMASK_HOME) },
+    [FINALIZE_ENABLE_CHARGING] = {
+        ENABLE_UNIT, "jolla-actdead-charging.service", 0 },
+    [FINALIZE_START_HOME] = {
+        START_UNIT, "home.mount", STEP(FINALIZE_RELOAD) },
+    // Stopping moves data back to /home so it must be mounted
+    [FINALIZE_STOP_PREPARATION] = {
+        STOP_UNIT, "home-encryption-preparation.service",
+        STEP(FINALIZE_START_HOME) | STEP(FINALIZE_STOP_HOLDERS) },
+    // Stopping also changes home of the users back
+    [FINALIZE_SET_HOLDERS_HOME] = {
+        SET_HOLDERS_HOME, NULL, STEP(FINALIZE_STOP_PREPARATION) },
+    [FINALIZE_START_HOLDERS] = {
+        START_HOLDERS, NULL, STEP(FINALIZE_SET_HOLDERS_HOME) },
+    [FINALIZE_START_DEFAULT] = {
+        START_UNIT, "default.target",
+        STEP(FINALIZE_START_HOLDERS) | STEP(FINALIZE_ENABLE_CHARGING) },
     { END_OF_MANAGE_TASKS }
 };
 
+/*
+ * Marker and runtime mask are both in place before the only daemon-reload,
+ * the mask used to need a reload of its own.
+ */
+enum {
+    PREPARE_CREATE_MARKER,
+    PREPARE_MASK_HOME,
+    PREPARE_RELOAD,
+    PREPARE_START_PREPARATION,
+    PREPARE_START_DEFAULT,
+};
+
+#define PREPARATION_RELOADS_AVOIDED 1
+
 const manage_task preparation_tasks[] = {
-    { RELOAD_UNITS, NULL },
-    { CREATE_MARKER, "/var/lib/sailfish-device-encryption/encrypt-home" },
-    { START_UNIT, "home-encryption-preparation.service" },
-    { MASK_UNIT, "home.mount" },
-    { RELOAD_UNITS, NULL },
-    { START_UNIT, "default.target" },
+    [PREPARE_CREATE_MARKER] = { CREATE_MARKER, ENCRYPT_HOME_MARKER, 0 },
+    [PREPARE_MASK_HOME] = { MASK_UNIT, "home.mount", 0 },
+    [PREPARE_RELOAD] = {
+        RELOAD_UNITS, NULL,
+        STEP(PREPARE_CREATE_MARKER) | STEP(PREPARE_MASK_HOME) },
+    // Preparation service is conditional on the marker
+    [PREPARE_START_PREPARATION] = {
+        START_UNIT, "home-encryption-preparation.service",
+        STEP(PREPARE_RELOAD) },
+    [PREPARE_START_DEFAULT] = {
+        START_UNIT, "default.target", STEP(PREPARE_START_PREPARATION) },
     { END_OF_MANAGE_TASKS }
 };
 
+enum {
+    RESTORE_STOP_HOLDERS,
+    RESTORE_UNMASK_HOME,
+    RESTORE_RELOAD,
+    RESTORE_REMOVE_MARKER,
+    RESTORE_START_HOME,
+    RESTORE_STOP_PREPARATION,
+    RESTORE_SET_HOLDERS_HOME,
+    RESTORE_START_HOLDERS,
+    RESTORE_START_DEFAULT,
+};
+
 const manage_task restoration_tasks[] = {
-    { UNMASK_UNIT, "home.mount" },
-    { RELOAD_UNITS, NULL },
-    { REMOVE_MARKER, "/var/lib/sailfish-device-encryption/encrypt-home" },
-    { START_UNIT, "home.mount" },
-    { STOP_UNIT, "home-encryption-preparation.service" },
-    { START_UNIT, "default.target" },
+    [RESTORE_STOP_HOLDERS] = { STOP_HOLDERS, NULL, 0 },
+    [RESTORE_UNMASK_HOME] = { UNMASK_UNIT, "home.mount", 0 },
+    [RESTORE_RELOAD] = { RELOAD_UNITS, NULL, STEP(RESTORE_UNMASK_HOME) },
+    [RESTORE_REMOVE_MARKER] = { REMOVE_MARKER, ENCRYPT_HOME_MARKER, 0 },
+    [RESTORE_START_HOME] = {
+        START_UNIT, "home.mount", STEP(RESTORE_RELOAD) },
+    [RESTORE_STOP_PREPARATION] = {
+        STOP_UNIT, "home-encryption-preparation.service",
+        STEP(RESTORE_START_HOME) | STEP(RESTORE_STOP_HOLDERS) },
+    [RESTORE_SET_HOLDERS_HOME] = {
+        SET_HOLDERS_HOME, NULL, STEP(RESTORE_STOP_PREPARATION) },
+    [RESTORE_START_HOLDERS] = {
+        START_HOLDERS, NULL, STEP(RESTORE_SET_HOLDERS_HOME) },
+    [RESTORE_START_DEFAULT] = {
+        START_UNIT, "default.target",
+        STEP(RESTORE_START_HOLDERS) | STEP(RESTORE_REMOVE_MARKER) },
     { END_OF_MANAGE_TASKS }
 };
 
@@ -116,38 +215,144 @@ typedef struct {
     GDBusProxy *usb_moded;
     gulong signal_handler;
     GList *job_watches;
-    guint task;
     const manage_task *tasks;
+    pipeline_step *task_steps;
+    pipeline *steps;
+    guint pending_jobs[PIPELINE_MAX_STEPS];
+    // Steps with a failed job, reported when their last job ends
+    guint32 failed_jobs;
+    GPtrArray *holders;
     gchar *orig_usb_mode;
     guint uid;
+    gint64 started;
+    gint64 terminate_started;
 } manage_data;
 
+// Job ids are per manager, user units have jobs on the user manager
+typedef struct {
+    manage_data *data;
+    GDBusProxy *manager;
+    guint step;
+    guint32 id;
+    guint timeout;
+} job_watch;
+
 static manage_data *private_data = NULL;
 
+static void job_watch_free(gpointer user_data)
+{
+    job_watch *watch = user_data;
+
+    if (watch->timeout != 0)
+        g_source_remove(watch->timeout);
+    g_free(watch);
+}
+
+static void free_task_steps(manage_data *data)
+{
+    pipeline_step *step;
+
+    if (data->task_steps == NULL)
+        return;
+
+    for (step = data->task_steps; step->name != NULL; step++)
+        g_free((gchar *)step->name);
+    g_free(data->task_steps);
+    data->task_steps = NULL;
+    pipeline_free(data->steps);
+    data->steps = NULL;
+}
+
+static void on_signal_from_systemd(
+        GDBusProxy *proxy,
+        gchar *sender,
+        gchar *name,
+        GVariant *parameters,
+        gpointer user_data);
+
+static void unwatch_user_managers(manage_data *data)
+{
+    holder_unit *holder;
+    guint i;
+
+    for (i = 0; data->holders != NULL && i < data->holders->len; i++) {
+        holder = g_ptr_array_index(data->holders, i);
+        if (holder->manager != data->systemd_manager)
+            g_signal_handlers_disconnect_by_func(
+                    holder->manager, on_signal_from_systemd, data);
+    }
+}
+
 static inline void manage_data_free(manage_data *data)
 {
+    // Proxies are shared and outlive this data
+    unwatch_user_managers(data);
+    if (data->signal_handler != 0) {
+        if (g_signal_handler_is_connected(
+                    data->systemd_manager, data->signal_handler))
+            g_signal_handler_disconnect(
+                    data->systemd_manager, data->signal_handler);
+        else if (g_signal_handler_is_connected(
+                    data->login_manager, data->signal_handler))
+            g_signal_handler_disconnect(
+                    data->login_manager, data->signal_handler);
+    }
+    if (private_data == data)
+        private_data = NULL;
+    free_task_steps(data);
     g_main_loop_unref(data->main_loop);
-    g_object_unref(data->connection);
-    g_object_unref(data->systemd_manager);
-    g_object_unref(data->login_manager);
-    g_object_unref(data->usb_moded);
-    g_list_free_full(data->job_watches, g_free);
+    g_clear_object(&data->connection);
+    g_clear_object(&data->systemd_manager);
+    g_clear_object(&data->login_manager);
+    g_clear_object(&data->usb_moded);
+    g_list_free_full(data->job_watches, job_watch_free);
+    if (data->holders != NULL)
+        g_ptr_array_unref(data->holders);
     g_free(data->orig_usb_mode);
     g_free(data);
 }
 
-static void add_job_watch(
-        manage_data *data,
-        job_handler handler,
-        guint32 id,
-        gchar *result)
+/*
+ * Task ends when all of its jobs have, stopping holders has several. It
+ * fails if any of them failed, but only after the last one answered, as
+ * the pipeline may free the data once the task ends.
+ */
+static void job_ended(manage_data *data, guint step, gboolean success)
 {
-    job_watch *watch = g_new0(job_watch, 1);
-    watch->handler = handler;
-    watch->id = id;
-    g_assert(strlen(result) < sizeof(watch->result));
-    strncpy(watch->result, result, sizeof(watch->result));
-    data->job_watches = g_list_append(data->job_watches, watch);
+    if (!success)
+        data->failed_jobs |= STEP(step);
+    if (data->pending_jobs[step] == 0 || --data->pending_jobs[step] > 0)
+        return;
+
+    if (data->failed_jobs & STEP(step))
+        pipeline_step_failed(data->steps, step);
+    else
+        pipeline_step_done(data->steps, step);
+}
+
+static void job_finished(job_watch *watch, gboolean success)
+{
+    manage_data *data = watch->data;
+    guint step = watch->step;
+
+    data->job_watches = g_list_remove(data->job_watches, watch);
+    job_watch_free(watch);
+    job_ended(data, step, success);
+}
+
+/*
+ * Later tasks rely on the job, like moving home back relies on the mount
+ * of home, so a job that does not finish in time fails its task.
+ */
+static gboolean job_timed_out(gpointer user_data)
+{
+    job_watch *watch = user_data;
+
+    fprintf(stderr, "Timeout waiting for job %u of %s\n",
+            watch->id, watch->data->task_steps[watch->step].name);
+    watch->timeout = 0;
+    job_finished(watch, FALSE);
+    return G_SOURCE_REMOVE;
 }
 
 static void on_signal_from_systemd(
@@ -169,15 +374,16 @@ static void on_signal_from_systemd(
         return;
 
     g_variant_get(parameters, "(uoss)", &id, &path, &unit, &result);
-    w = data->job_watches;
-    while (w != NULL) {
+    PROBE(job_removed, id, unit, result);
+    for (w = data->job_watches; w != NULL; w = w->next) {
         watch = w->data;
-        if (watch->id == id && strcmp(result, watch->result) == 0) {
-            watch->handler(proxy, id, user_data);
-            data->job_watches = g_list_delete_link(data->job_watches, w);
+        if (watch->manager == proxy && watch->id == id) {
+            if (strcmp(result, "done") != 0)
+                fprintf(stderr, "Job %u for %s finished with result %s\n",
+                        id, unit, result);
+            job_finished(watch, strcmp(result, "done") == 0);
             break;
         }
-        w = w->next;
     }
     g_free(path);
     g_free(unit);
@@ -213,6 +419,12 @@ static const gchar *get_unit_action(manage_action action)
             return "MaskUnitFiles";
         case UNMASK_UNIT:
             return "UnmaskUnitFiles";
+        case STOP_HOLDERS:
+            return "StopHolders";
+        case SET_HOLDERS_HOME:
+            return "SetHoldersHome";
+        case START_HOLDERS:
+            return "StartHolders";
         case CREATE_MARKER:
         case REMOVE_MARKER:
         case END_OF_MANAGE_TASKS:
@@ -244,6 +456,9 @@ static GVariant *get_unit_arguments(manage_task task)
             g_variant_builder_init(&builder, G_VARIANT_TYPE("as"));
             g_variant_builder_add(&builder, "s", task.argument);
             return g_variant_new("(asb)", &builder, TRUE);
+        case STOP_HOLDERS:
+        case SET_HOLDERS_HOME:
+        case START_HOLDERS:
         case CREATE_MARKER:
         case REMOVE_MARKER:
         case END_OF_MANAGE_TASKS:
@@ -252,42 +467,34 @@ static GVariant *get_unit_arguments(manage_task task)
     return NULL;
 }
 
-static void handle_next_unit_task(manage_data *data);
-
-static void unit_changed_state(
-        GDBusProxy *proxy,
-        guint32 id,
-        gpointer user_data)
-{
-    manage_data *data = user_data;
-
-    (void)proxy;
-    (void)id;
-    handle_next_unit_task(data);
-}
-
 static void unit_changing_state(
         GObject *proxy,
         GAsyncResult *res,
         gpointer user_data)
 {
-    manage_data *data = user_data;
+    job_watch *watch = user_data;
+    manage_data *data = watch->data;
     GError *error = NULL;
     GVariant *job;
 
     job = g_dbus_proxy_call_finish((GDBusProxy *)proxy, res, &error);
     if (job == NULL) {
         fprintf(stderr, "%s\n", error->message);
-        g_main_loop_quit(data->main_loop);
-        manage_data_free(data);
         g_error_free(error);
+        job_ended(data, watch->step, FALSE);
+        g_free(watch);
         return;
     }
 
-    if (g_variant_is_of_type(job, G_VARIANT_TYPE("(o)")))
-        add_job_watch(data, unit_changed_state, get_job_id(job), "done");
-    else
-        handle_next_unit_task(data);
+    if (g_variant_is_of_type(job, G_VARIANT_TYPE("(o)"))) {
+        watch->id = get_job_id(job);
+        watch->timeout = g_timeout_add_seconds(
+                JOB_TIMEOUT, job_timed_out, watch);
+        data->job_watches = g_list_append(data->job_watches, watch);
+    } else {
+        job_ended(data, watch->step, TRUE);
+        g_free(watch);
+    }
 
     g_variant_unref(job);
 }
@@ -311,9 +518,112 @@ static void remove_file(const char *path)
         fprintf(stderr, "Failed to remove file %s\n", path);
 }
 
-static void handle_next_unit_task(manage_data *data)
+static const char *get_phase_name(manage_data *data)
+{
+    if (data->tasks == preparation_tasks)
+        return "preparation";
+    if (data->tasks == restoration_tasks)
+        return "restoration";
+    return "finalization";
+}
+
+static gchar *get_task_name(manage_task task)
+{
+    switch (task.action) {
+        case CREATE_MARKER:
+            return g_strdup_printf("CreateMarker %s", task.argument);
+        case REMOVE_MARKER:
+            return g_strdup_printf("RemoveMarker %s", task.argument);
+        default:
+            return g_strdup_printf("%s %s", get_unit_action(task.action),
+                                   task.argument ? task.argument : "");
+    }
+}
+
+static void submit_job(
+        manage_data *data,
+        guint id,
+        GDBusProxy *manager,
+        const gchar *method,
+        GVariant *arguments)
+{
+    job_watch *watch = g_new0(job_watch, 1);
+
+    watch->data = data;
+    watch->manager = manager;
+    watch->step = id;
+    data->pending_jobs[id]++;
+    g_dbus_proxy_call(
+            manager, method, arguments,
+            G_DBUS_CALL_FLAGS_NONE, -1, NULL, unit_changing_state, watch);
+}
+
+static void change_holders(manage_data *data, guint id, const gchar *method)
+{
+    holder_unit *holder;
+    guint i;
+
+    if (data->holders == NULL || data->holders->len == 0) {
+        pipeline_step_done(data->steps, id);
+        return;
+    }
+
+    for (i = 0; i < data->holders->len; i++) {
+        holder = g_ptr_array_index(data->holders, i);
+        submit_job(data, id, holder->manager, method,
+                   g_variant_new("(ss)", holder->name, "replace"));
+    }
+}
+
+/*
+ * Units started by a user manager get HOME from its environment, which
+ * was set when home was in the temporary place. Home of the user is back
+ * in the user database after the preparation has been stopped.
+ */
+static void set_holders_home(manage_data *data, guint id)
 {
-    manage_task task = data->tasks[data->task];
+    GPtrArray *managers = g_ptr_array_new();
+    GPtrArray *homes = g_ptr_array_new_with_free_func(g_free);
+    holder_unit *holder;
+    struct passwd *pw;
+    const gchar *environment[2] = { NULL, NULL };
+    guint i;
+
+    for (i = 0; data->holders != NULL && i < data->holders->len; i++) {
+        holder = g_ptr_array_index(data->holders, i);
+        if (holder->manager == data->systemd_manager ||
+                g_ptr_array_find(managers, holder->manager, NULL))
+            continue;
+
+        pw = getpwuid(holder->uid);
+        if (pw == NULL) {
+            fprintf(stderr, "Home of user %u not found\n", holder->uid);
+            g_ptr_array_free(managers, TRUE);
+            g_ptr_array_free(homes, TRUE);
+            pipeline_step_failed(data->steps, id);
+            return;
+        }
+        g_ptr_array_add(managers, holder->manager);
+        g_ptr_array_add(homes, g_strdup_printf("HOME=%s", pw->pw_dir));
+    }
+
+    if (managers->len == 0)
+        pipeline_step_done(data->steps, id);
+
+    for (i = 0; i < managers->len; i++) {
+        environment[0] = g_ptr_array_index(homes, i);
+        submit_job(data, id, g_ptr_array_index(managers, i),
+                   "SetEnvironment", g_variant_new("(^as)", environment));
+    }
+
+    g_ptr_array_free(managers, TRUE);
+    g_ptr_array_free(homes, TRUE);
+}
+
+static void run_task(pipeline *p, guint id, gpointer user_data)
+{
+    manage_data *data = user_data;
+    manage_task task = data->tasks[id];
 
     switch (task.action) {
         case START_UNIT:
@@ -322,44 +632,156 @@ static void handle_next_unit_task(manage_data *data)
         case ENABLE_UNIT:
         case MASK_UNIT:
         case UNMASK_UNIT:
-            g_dbus_proxy_call(
-                    data->systemd_manager, get_unit_action(task.action),
-                    get_unit_arguments(task), G_DBUS_CALL_FLAGS_NONE, -1,
-                    NULL, unit_changing_state, data);
+            submit_job(data, id, data->systemd_manager,
+                       get_unit_action(task.action),
+                       get_unit_arguments(task));
+            break;
+        case STOP_HOLDERS:
+            change_holders(data, id, "StopUnit");
+            break;
+        case SET_HOLDERS_HOME:
+            set_holders_home(data, id);
+            break;
+        case START_HOLDERS:
+            change_holders(data, id, "StartUnit");
             break;
         case CREATE_MARKER:
             create_file(task.argument);
+            pipeline_step_done(p, id);
             break;
         case REMOVE_MARKER:
             remove_file(task.argument);
+            pipeline_step_done(p, id);
             break;
         case END_OF_MANAGE_TASKS:
-            g_signal_handler_disconnect(
-                    data->systemd_manager, data->signal_handler);
-            if (data->tasks == preparation_tasks) {
-                // Stay waiting for BeginEncryption
-                printf("Preparation done.\n");
-                data->tasks = NULL;
-                data->task = 0;
-            } else {
-                if (data->orig_usb_mode) {
-                    // Restore USB mode back to the original
-                    g_dbus_proxy_call_sync(
-                            data->usb_moded, USB_MODE_STATE_SET,
-                            g_variant_new("(s)", data->orig_usb_mode),
-                            G_DBUS_CALL_FLAGS_NONE, -1, NULL,
-                            NULL);
-                }
-                g_main_loop_quit(data->main_loop);
-                manage_data_free(data);
-            }
-            return;
+            g_assert_not_reached();
+    }
+}
+
+static void report_avoided_reloads(manage_data *data)
+{
+    gint64 duration = 0;
+    guint i, reloads = 0;
+
+    if (data->tasks != preparation_tasks)
+        return;
+
+    for (i = 0; data->tasks[i].action != END_OF_MANAGE_TASKS; i++) {
+        if (data->tasks[i].action == RELOAD_UNITS) {
+            duration += pipeline_step_duration(data->steps, i);
+            reloads++;
+        }
+    }
+
+    if (reloads == 0)
+        return;
+
+    // Estimate from the reload that was done
+    duration = duration / reloads * PREPARATION_RELOADS_AVOIDED;
+    printf("%s: avoided %d daemon-reload, saved about %" G_GINT64_FORMAT
+           " ms.\n", get_phase_name(data), PREPARATION_RELOADS_AVOIDED,
+           duration / 1000);
+    trace_instant("manage", "Reload avoided");
+}
+
+/*
+ * The daemon serves home copy too, and restore is started as soon as the
+ * home is back. Quitting would kill the copy, so wait for it to end.
+ */
+static gboolean quit_if_idle(gpointer user_data)
+{
+    GMainLoop *main_loop = user_data;
+
+    if (get_copy_state() == COPYING)
+        return G_SOURCE_CONTINUE;
+
+    g_main_loop_quit(main_loop);
+    g_main_loop_unref(main_loop);
+    return G_SOURCE_REMOVE;
+}
+
+static void quit_when_idle(GMainLoop *main_loop)
+{
+    g_main_loop_ref(main_loop);
+    if (quit_if_idle(main_loop))
+        g_timeout_add_seconds(COPY_CHECK_INTERVAL, quit_if_idle, main_loop);
+}
+
+static void tasks_finished(pipeline *p, gboolean success, gpointer user_data)
+{
+    manage_data *data = user_data;
+
+    g_signal_handler_disconnect(data->systemd_manager, data->signal_handler);
+    data->signal_handler = 0;
+    unwatch_user_managers(data);
+    trace_span("manage", get_phase_name(data), data->started);
+    if (success)
+        report_avoided_reloads(data);
+    trace_write();
+    free_task_steps(data);
+
+    if (!success) {
+        quit_when_idle(data->main_loop);
+        manage_data_free(data);
+    } else if (data->tasks == preparation_tasks) {
+        // Stay waiting for BeginEncryption
+        printf("Preparation done.\n");
+        data->tasks = NULL;
+    } else {
+        if (data->orig_usb_mode) {
+            // Restore USB mode back to the original
+            g_dbus_proxy_call_sync(
+                    data->usb_moded, USB_MODE_STATE_SET,
+                    g_variant_new("(s)", data->orig_usb_mode),
+                    G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                    NULL);
+        }
+        quit_when_idle(data->main_loop);
+        manage_data_free(data);
     }
+}
 
-    data->task++;
+// A peer connection to a user manager gets its signals without Subscribe
+static void watch_user_managers(manage_data *data)
+{
+    holder_unit *holder;
+    guint i;
+
+    for (i = 0; data->holders != NULL && i < data->holders->len; i++) {
+        holder = g_ptr_array_index(data->holders, i);
+        if (holder->manager != data->systemd_manager &&
+                !g_signal_handler_find(
+                    holder->manager,
+                    G_SIGNAL_MATCH_FUNC | G_SIGNAL_MATCH_DATA, 0, 0, NULL,
+                    on_signal_from_systemd, data))
+            g_signal_connect(
+                    holder->manager, "g-signal",
+                    G_CALLBACK(on_signal_from_systemd), data);
+    }
+}
 
-    if (task.action == CREATE_MARKER || task.action == REMOVE_MARKER)
-        handle_next_unit_task(data);
+static void start_tasks(manage_data *data)
+{
+    guint count = 0, i;
+
+    while (data->tasks[count].action != END_OF_MANAGE_TASKS)
+        count++;
+
+    data->task_steps = g_new0(pipeline_step, count + 1);
+    data->failed_jobs = 0;
+    for (i = 0; i < count; i++) {
+        data->task_steps[i].name = get_task_name(data->tasks[i]);
+        data->task_steps[i].run = run_task;
+        data->task_steps[i].depends = data->tasks[i].depends;
+    }
+
+    data->signal_handler = g_signal_connect(
+            data->systemd_manager, "g-signal",
+            G_CALLBACK(on_signal_from_systemd), data);
+    watch_user_managers(data);
+    data->steps = pipeline_new(
+            get_phase_name(data), data->task_steps, tasks_finished, data);
+    pipeline_start(data->steps);
 }
 
 static void on_signal_from_logind(
@@ -380,11 +802,9 @@ static void on_signal_from_logind(
     if (id != data->uid)
         return;
 
+    trace_span("manage", "TerminateUser", data->terminate_started);
     g_signal_handler_disconnect(data->login_manager, data->signal_handler);
-    data->signal_handler = g_signal_connect(
-            data->systemd_manager, "g-signal",
-            G_CALLBACK(on_signal_from_systemd), data);
-    handle_next_unit_task(data);
+    start_tasks(data);
 }
 
 static void terminate_user(manage_data *data)
@@ -392,7 +812,7 @@ static void terminate_user(manage_data *data)
     data->uid = sailfish_access_control_systemuser_uid();
     if (data->uid == SAILFISH_UNDEFINED_UID) {
         fprintf(stderr, "Unable to detect system user\n");
-        g_main_loop_quit(data->main_loop);
+        quit_when_idle(data->main_loop);
         manage_data_free(data);
         return;
     }
@@ -400,6 +820,7 @@ static void terminate_user(manage_data *data)
     data->signal_handler = g_signal_connect(
             data->login_manager, "g-signal",
             G_CALLBACK(on_signal_from_logind), data);
+    data->terminate_started = trace_now();
 
     g_dbus_proxy_call(
             data->login_manager, "TerminateUser",
@@ -408,6 +829,47 @@ static void terminate_user(manage_data *data)
             NULL, NULL);
 }
 
+static void got_holders(
+        GPtrArray *units,
+        gboolean restartable,
+        gpointer user_data)
+{
+    manage_data *data = user_data;
+
+    trace_span("manage", "FindHolders", data->terminate_started);
+
+    if (!restartable) {
+        g_ptr_array_unref(units);
+        terminate_user(data);
+        return;
+    }
+
+    printf("Restarting %u units instead of the user session\n", units->len);
+    data->holders = units;
+    start_tasks(data);
+}
+
+/*
+ * Preparation always restarts the whole session. When moving home back,
+ * only the units that have the temporary home open are restarted if
+ * possible, otherwise the user is terminated as well.
+ */
+static void stop_user_session(manage_data *data)
+{
+    static const char * const directories[] = {
+        "/tmp" STR(HOME_DIR), STR(HOME_DIR), NULL
+    };
+
+    if (data->tasks == preparation_tasks) {
+        terminate_user(data);
+        return;
+    }
+
+    data->terminate_started = trace_now();
+    find_holders(data->systemd_manager, directories, TRUE,
+                 got_holders, data);
+}
+
 static void got_set_mode(
         GObject *proxy,
         GAsyncResult *res,
@@ -428,7 +890,7 @@ static void got_set_mode(
     }
 
     // Continue with the encryption
-    terminate_user(data);
+    stop_user_session(data);
 }
 
 static void got_mode_request(
@@ -446,7 +908,7 @@ static void got_mode_request(
         fprintf(stderr, "%s\n", error->message);
         g_error_free(error);
         // Continue with the encryption
-        terminate_user(data);
+        stop_user_session(data);
         return;
     }
     g_variant_get(result, "(s)", &mode);
@@ -463,129 +925,38 @@ static void got_mode_request(
     } else {
         g_free(mode);
         // Continue with the encryption
-        terminate_user(data);
+        stop_user_session(data);
     }
 }
 
-static void got_usb_moded(
-        GObject *proxy,
-        GAsyncResult *res,
-        gpointer user_data)
+static void got_clients(gpointer user_data)
 {
     manage_data *data = user_data;
-    GError *error = NULL;
 
-    data->usb_moded = g_dbus_proxy_new_finish(res, &error);
-    if (data->usb_moded == NULL) {
-        fprintf(stderr, "%s\n", error->message);
-        g_error_free(error);
-        // Continue with the encryption
-        terminate_user(data);
-    } else {
-        g_dbus_proxy_call(
-                data->usb_moded, USB_MODE_TARGET_STATE_GET,
-                NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
-                got_mode_request, user_data);
-    }
-}
-
-static void got_subscription(
-        GObject *proxy,
-        GAsyncResult *res,
-        gpointer user_data)
-{
-    manage_data *data = user_data;
-    GError *error = NULL;
-    GVariant *result;
-
-    result = g_dbus_proxy_call_finish((GDBusProxy *)proxy, res, &error);
-    if (result == NULL) {
-        fprintf(stderr, "%s\n", error->message);
-        g_main_loop_quit(data->main_loop);
+    if (clients_get_systemd_manager() == NULL ||
+            clients_get_login_manager() == NULL) {
+        fprintf(stderr, "Systemd or login manager is not available\n");
+        quit_when_idle(data->main_loop);
         manage_data_free(data);
-        g_error_free(error);
         return;
     }
-    g_variant_unref(result);
 
-    // Acquire USB daemon proxy to check its state
-    g_dbus_proxy_new(
-            data->connection, G_DBUS_PROXY_FLAGS_NONE, NULL,
-            "com.meego.usb_moded",
-            "/com/meego/usb_moded",
-            "com.meego.usb_moded",
-            NULL, got_usb_moded, user_data);
-}
+    data->connection = g_object_ref(clients_get_connection());
+    data->systemd_manager = g_object_ref(clients_get_systemd_manager());
+    data->login_manager = g_object_ref(clients_get_login_manager());
 
-static void got_login_manager(
-        GObject *proxy,
-        GAsyncResult *res,
-        gpointer user_data)
-{
-    manage_data *data = user_data;
-    GError *error = NULL;
-
-    data->login_manager = g_dbus_proxy_new_finish(res, &error);
-    if (data->login_manager == NULL) {
-        fprintf(stderr, "%s\n", error->message);
-        g_main_loop_quit(data->main_loop);
-        manage_data_free(data);
-        g_error_free(error);
+    // Check USB daemon state before terminating the session
+    if (clients_get_usb_moded() == NULL) {
+        // Continue with the encryption
+        stop_user_session(data);
         return;
     }
 
+    data->usb_moded = g_object_ref(clients_get_usb_moded());
     g_dbus_proxy_call(
-            data->systemd_manager, "Subscribe",
+            data->usb_moded, USB_MODE_TARGET_STATE_GET,
             NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
-            got_subscription, user_data);
-}
-
-static void got_systemd_manager(
-        GObject *proxy,
-        GAsyncResult *res,
-        gpointer user_data)
-{
-    manage_data *data = user_data;
-    GError *error = NULL;
-
-    data->systemd_manager = g_dbus_proxy_new_finish(res, &error);
-    if (data->systemd_manager == NULL) {
-        fprintf(stderr, "%s\n", error->message);
-        g_main_loop_quit(data->main_loop);
-        manage_data_free(data);
-        g_error_free(error);
-        return;
-    }
-
-    g_dbus_proxy_new(
-            data->connection, G_DBUS_PROXY_FLAGS_NONE, NULL,
-            "org.freedesktop.login1",
-            "/org/freedesktop/login1",
-            "org.freedesktop.login1.Manager",
-            NULL, got_login_manager, user_data);
-}
-
-static void got_bus(GObject *proxy, GAsyncResult *res, gpointer user_data)
-{
-    manage_data *data = user_data;
-    GError *error = NULL;
-
-    data->connection = g_bus_get_finish(res, &error);
-    if (data->connection == NULL) {
-        fprintf(stderr, "%s\n", error->message);
-        g_main_loop_quit(data->main_loop);
-        manage_data_free(data);
-        g_error_free(error);
-        return;
-    }
-
-    // Systemd proxy
-    g_dbus_proxy_new(
-            data->connection, G_DBUS_PROXY_FLAGS_NONE, NULL,
-            "org.freedesktop.systemd1",
-            "/org/freedesktop/systemd1",
-            "org.freedesktop.systemd1.Manager",
-            NULL, got_systemd_manager, user_data);
+            got_mode_request, user_data);
 }
 
 static inline void cleanup_home_dir()
@@ -598,7 +969,7 @@ static inline void cleanup_home_dir()
                 path, strerror(errno));
     } else {
         *(strrchr(path, '/')) = '\0';
-        while (strlen(path) > ((sizeof "/home/")-1)) {
+        while (strlen(path) > ((sizeof STR(HOME_DIR) "/")-1)) {
             errno = 0;
             if (rmdir(path) < 0) {
                 if (errno != ENOTEMPTY && errno != ENOENT) {
@@ -625,6 +996,7 @@ gboolean finalize(GMainLoop *main_loop, gboolean restore)
         private_data->main_loop = g_main_loop_ref(main_loop);
     }
 
+    private_data->started = trace_now();
     cleanup_home_dir();
 
     if (restore)
@@ -633,10 +1005,10 @@ gboolean finalize(GMainLoop *main_loop, gboolean restore)
         private_data->tasks = finalization_tasks;
 
     if (private_data->connection == NULL) {
-        g_bus_get(G_BUS_TYPE_SYSTEM, NULL, got_bus, private_data);
+        clients_wait(got_clients, private_data);
     } else {
         // Already prepared, skip initialisation
-        terminate_user(private_data);
+        stop_user_session(private_data);
     }
 
     return TRUE;
@@ -649,8 +1021,9 @@ void prepare(GMainLoop *main_loop)
     private_data = g_new0(manage_data, 1);
     private_data->main_loop = g_main_loop_ref(main_loop);
     private_data->tasks = preparation_tasks;
+    private_data->started = trace_now();
     printf("Preparing encrypted home.\n");
-    g_bus_get(G_BUS_TYPE_SYSTEM, NULL, got_bus, private_data);
+    clients_wait(got_clients, private_data);
 }
 
 // vim: expandtab:ts=4:sw=4
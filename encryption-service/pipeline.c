@@ -0,0 +1,193 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#include <glib.h>
+#include <stdio.h>
+#include "pipeline.h"
+#include "trace.h"
+
+struct _pipeline {
+    const char *name;
+    const pipeline_step *steps;
+    guint count;
+    pipeline_finished finished;
+    gpointer user_data;
+    guint32 started;
+    guint32 done;
+    guint running;
+    gboolean failed;
+    gboolean scheduling;
+    gboolean rescan;
+    gint64 begin_time;
+    gint64 start_time[PIPELINE_MAX_STEPS];
+    gint64 end_time[PIPELINE_MAX_STEPS];
+};
+
+pipeline *pipeline_new(
+        const char *name,
+        const pipeline_step *steps,
+        pipeline_finished finished,
+        gpointer user_data)
+{
+    pipeline *p = g_new0(pipeline, 1);
+
+    p->name = name;
+    p->steps = steps;
+    p->finished = finished;
+    p->user_data = user_data;
+
+    while (steps[p->count].name != NULL)
+        p->count++;
+    g_assert(p->count <= PIPELINE_MAX_STEPS);
+
+    return p;
+}
+
+void pipeline_free(pipeline *p)
+{
+    g_free(p);
+}
+
+static inline guint32 all_steps(pipeline *p)
+{
+    return p->count == 32 ? G_MAXUINT32 : STEP(p->count) - 1;
+}
+
+static void check_finished(pipeline *p)
+{
+    gboolean success;
+
+    if (p->running > 0)
+        return;
+
+    if (!p->failed && p->done != all_steps(p)) {
+        // Nothing runs and nothing can be started, dependencies are broken
+        fprintf(stderr, "%s: unsatisfiable step dependencies.\n", p->name);
+        p->failed = TRUE;
+    }
+
+    success = !p->failed;
+    trace_span(p->name, p->name, p->begin_time);
+    printf("%s: %s in %" G_GINT64_FORMAT " ms.\n", p->name,
+           success ? "finished" : "failed",
+           (trace_now() - p->begin_time) / 1000);
+
+    // May free the pipeline, do not touch it after this
+    p->finished(p, success, p->user_data);
+}
+
+static void schedule(pipeline *p)
+{
+    guint i;
+
+    // Steps that complete synchronously call back here from run
+    if (p->scheduling) {
+        p->rescan = TRUE;
+        return;
+    }
+
+    p->scheduling = TRUE;
+    do {
+        p->rescan = FALSE;
+        for (i = 0; i < p->count && !p->failed; i++) {
+            if (p->started & STEP(i))
+                continue;
+            if ((p->steps[i].depends & ~p->done) != 0)
+                continue;
+
+            p->started |= STEP(i);
+            p->running++;
+            p->start_time[i] = trace_now();
+            p->steps[i].run(p, i, p->user_data);
+        }
+    } while (p->rescan);
+    p->scheduling = FALSE;
+
+    check_finished(p);
+}
+
+void pipeline_start(pipeline *p)
+{
+    p->begin_time = trace_now();
+    schedule(p);
+}
+
+static void step_ended(pipeline *p, guint id)
+{
+    g_assert(id < p->count && (p->started & STEP(id)));
+    g_assert(p->running > 0);
+
+    p->end_time[id] = trace_now();
+    p->running--;
+    trace_span(p->name, p->steps[id].name, p->start_time[id]);
+}
+
+void pipeline_step_done(pipeline *p, guint id)
+{
+    step_ended(p, id);
+    p->done |= STEP(id);
+    printf("%s: %s took %" G_GINT64_FORMAT " ms.\n", p->name,
+           p->steps[id].name, pipeline_step_duration(p, id) / 1000);
+    schedule(p);
+}
+
+void pipeline_step_failed(pipeline *p, guint id)
+{
+    step_ended(p, id);
+    p->failed = TRUE;
+    fprintf(stderr, "%s: %s failed after %" G_GINT64_FORMAT " ms.\n",
+            p->name, p->steps[id].name,
+            pipeline_step_duration(p, id) / 1000);
+    schedule(p);
+}
+
+gboolean pipeline_step_running(pipeline *p, guint id)
+{
+    return (p->started & STEP(id)) && !(p->done & STEP(id)) &&
+        p->end_time[id] == 0;
+}
+
+// Duration in microseconds, or time spent so far for a running step
+gint64 pipeline_step_duration(pipeline *p, guint id)
+{
+    if (!(p->started & STEP(id)))
+        return 0;
+    if (p->end_time[id] == 0)
+        return trace_now() - p->start_time[id];
+    return p->end_time[id] - p->start_time[id];
+}
+
+// vim: expandtab:ts=4:sw=4
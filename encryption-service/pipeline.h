@@ -0,0 +1,77 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <glib.h>
+
+/*
+ * Small dependency graph executor. Each step is started as soon as
+ * all the steps it depends on are done, so independent steps overlap.
+ * Steps are asynchronous: run starts the step and the step reports back
+ * with pipeline_step_done() or pipeline_step_failed() when it completes.
+ */
+
+#define PIPELINE_MAX_STEPS 32
+#define STEP(id) (1U << (id))
+
+typedef struct _pipeline pipeline;
+
+typedef void (*pipeline_step_func)(pipeline *p, guint id, gpointer user_data);
+typedef void (*pipeline_finished)(pipeline *p, gboolean success,
+                                  gpointer user_data);
+
+typedef struct {
+    const char *name;
+    pipeline_step_func run;
+    guint32 depends;
+} pipeline_step;
+
+// Steps array is terminated by an entry with NULL name
+pipeline *pipeline_new(
+        const char *name,
+        const pipeline_step *steps,
+        pipeline_finished finished,
+        gpointer user_data);
+void pipeline_free(pipeline *p);
+void pipeline_start(pipeline *p);
+void pipeline_step_done(pipeline *p, guint id);
+void pipeline_step_failed(pipeline *p, guint id);
+gboolean pipeline_step_running(pipeline *p, guint id);
+gint64 pipeline_step_duration(pipeline *p, guint id);
+
+#endif // __PIPELINE_H
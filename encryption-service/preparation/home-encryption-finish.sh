@@ -15,10 +15,29 @@ for user in $USERS; do
     fi
 done
 
+# Moves staged home back entry by entry, fails if any one is not moved
+move_home() {
+    for entry in /tmp/home/.[!.]* /tmp/home/..?* /tmp/home/*; do
+        [ -e "$entry" ] || [ -L "$entry" ] || continue
+        mv "$entry" /home/ || return 1
+    done
+}
+
+# Staged home is only released once it is back on the /home partition,
+# otherwise it may be the only copy of home
+HOME_BACK=false
+if mount | grep -q " on /home type" && [ "$HOME_WIPED" = "" ]; then
+    HOME_BACK=true
+fi
+
 # Move home content back to /home partition if it is mounted
 if mount | grep -q " on /home type" && [ "$HOME_WIPED" != "" ]; then
     # /home was wiped, copy stuff back
-    mv /tmp/home/.[!.]* /tmp/home/* /home/
+    if move_home; then
+        HOME_BACK=true
+    else
+        echo "Moving home back failed, keeping the rest in /tmp/home" >&2
+    fi
 
     CONF_FILE="/var/lib/sailfish-device-encryption/home_copy.conf"
     if [ -f $CONF_FILE ] && grep -q "^/dev/" $CONF_FILE ; then
@@ -42,8 +61,31 @@ if mount | grep -q " on /home type" && [ "$HOME_WIPED" != "" ]; then
     fi
 fi
 
-# Clean up
-rm -rf /tmp/home/
+# Staged home is not needed anymore once /home is back, so the next
+# preparation may remove a staging volume that this clean up leaves behind
+if [ "$HOME_BACK" = true ]; then
+    touch /var/lib/sailfish-device-encryption/home-staging.done
+else
+    echo "Home is not back on /home, keeping the staged home in /tmp/home" >&2
+fi
+
+# Clean up, releasing the staging device of home-encryption-preparation.sh
+if [ "$HOME_BACK" = true ] && [ -f /tmp/home.staging ]; then
+    STAGING_DEVICE=$(cat /tmp/home.staging)
+    umount /tmp/home
+    case $STAGING_DEVICE in
+        /dev/zram*)
+            ZRAM=${STAGING_DEVICE#/dev/}
+            echo 1 > /sys/block/$ZRAM/reset
+            echo ${ZRAM#zram} > /sys/class/zram-control/hot_remove
+            ;;
+        *)
+            lvremove -q -y $STAGING_DEVICE
+            ;;
+    esac
+    rm -f /tmp/home.staging
+fi
+[ "$HOME_BACK" = true ] && rm -rf /tmp/home/
 
 # If encryption finished, remove marker file
 [ -s /etc/crypttab ] && rm -f /var/lib/sailfish-device-encryption/encrypt-home
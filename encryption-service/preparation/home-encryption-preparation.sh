@@ -21,35 +21,160 @@ if [ -f $CONF_FILE ] && grep -q "^/dev/" $CONF_FILE; then
     USE_SD=true
 fi
 
-# Calculate 1/3 of /tmp to keep it free even after copying
-EXTRA_SPACE=$(( $(df -k /tmp | grep -Eo '[0-9]+ +[0-9]+ +[0-9]+ +[0-9]+% +/tmp$' | cut -d' ' -f1) / 3 ))
-# globs below miss files that start with two dots
-SPACE_ON_TMP=$(df -k /tmp | grep -Eo '[0-9]+ +[0-9]+% +/tmp$' | cut -d' ' -f1)
-# calculation includes lost+found even though it's not copied to /tmp
-SPACE_NEEDED=$(du -sck /home/.[!.]* /home/* | grep -E $'\ttotal$' | cut -d$'\t' -f1)
+# Home is walked once, sizes are shared through the size cache. Home may
+# have changed since the last run, so the cache only lives for this one.
+SIZE_CACHE=/run/sailfish-device-encryption/home-size.cache
+mkdir -p /run/sailfish-device-encryption
+rm -f $SIZE_CACHE
+
+# Regenerable data like caches is left out, see home-copy-exclude.d
+home_copy() {
+    /usr/libexec/sailfish-home-copy \
+        --exclude-rules /usr/share/sailfish-device-encryption/home-copy-exclude.d \
+        --exclude-rules /etc/sailfish-device-encryption/home-copy-exclude.d "$@"
+}
+
+# Home is staged on a temporary logical volume if the volume group has
+# room for it, or compressed on a zram device if it does not fit to tmpfs.
+# The device is mounted on /tmp/home until home-encryption-finish.sh.
+STAGING_STATE=/tmp/home.staging
+STAGING_LV=home-staging
+# Written by home-encryption-finish.sh once home is back on /home
+STAGING_DONE=/var/lib/sailfish-device-encryption/home-staging.done
+
+lv_setup() {
+    command -v lvcreate > /dev/null || return 1
+    VG_FREE=$(vgs --noheadings --nosuffix --units k -o vg_free sailfish 2> /dev/null)
+    VG_FREE=$(echo $VG_FREE | cut -d . -f 1)
+    [ -n "$VG_FREE" ] && [ $VG_FREE -gt $1 ] || return 1
+    lvcreate -q -y -n $STAGING_LV -L ${1}k sailfish || return 1
+    rm -f $STAGING_DONE
+    if mkfs.ext4 -q -m 0 /dev/sailfish/$STAGING_LV \
+            && mount /dev/sailfish/$STAGING_LV /tmp/home; then
+        echo /dev/sailfish/$STAGING_LV > $STAGING_STATE
+        return 0
+    fi
+    # Created just now, there is nothing on it
+    lvremove -q -y sailfish/$STAGING_LV
+    return 1
+}
+
+# A volume left from an earlier boot holds the only copy of home if
+# encryption was interrupted before home-encryption-finish.sh moved home
+# back. It is removed only when that is recorded done and it is not in use.
+lv_remove_stale() {
+    command -v lvs > /dev/null || return 0
+    lvs sailfish/$STAGING_LV > /dev/null 2>&1 || return 0
+    if [ -f $STAGING_DONE ] \
+            && [ -z "$(lsblk -n -o MOUNTPOINT /dev/sailfish/$STAGING_LV)" ]; then
+        echo "Removing stale sailfish/$STAGING_LV"
+        lvremove -q -y sailfish/$STAGING_LV
+    else
+        echo "Keeping sailfish/$STAGING_LV, it may hold the only copy of home"
+    fi
+}
+
+zram_setup() {
+    modprobe zram 2> /dev/null
+    [ -e /sys/class/zram-control/hot_add ] || return 1
+    ZRAM=zram$(cat /sys/class/zram-control/hot_add) || return 1
+    echo zstd > /sys/block/$ZRAM/comp_algorithm 2> /dev/null \
+        || echo lz4 > /sys/block/$ZRAM/comp_algorithm 2> /dev/null
+    if echo ${1}K > /sys/block/$ZRAM/disksize \
+            && mkfs.ext4 -q -O ^has_journal -m 0 /dev/$ZRAM \
+            && mount /dev/$ZRAM /tmp/home; then
+        echo /dev/$ZRAM > $STAGING_STATE
+        return 0
+    fi
+    echo ${ZRAM#zram} > /sys/class/zram-control/hot_remove
+    return 1
+}
+
+# Empties /tmp/home, and falls back from a staging device to tmpfs
+staging_reset() {
+    if [ -f $STAGING_STATE ]; then
+        STAGING_DEVICE=$(cat $STAGING_STATE)
+        umount /tmp/home
+        case $STAGING_DEVICE in
+            /dev/zram*)
+                ZRAM=${STAGING_DEVICE#/dev/}
+                echo 1 > /sys/block/$ZRAM/reset
+                echo ${ZRAM#zram} > /sys/class/zram-control/hot_remove
+                ;;
+            *)
+                lvremove -q -y $STAGING_DEVICE
+                ;;
+        esac
+        rm -f $STAGING_STATE
+    fi
+    rm -rf /tmp/home
+    mkdir /tmp/home
+}
 
 USERS=$(getent group users | cut -d : -f 4 | tr , " ")
 
-USER_SPACE=0
+USER_HOMES=""
 for user in $USERS; do
-    USER_SPACE=$(( $USER_SPACE + $(du -sk $(getent passwd $user | cut -d : -f 6) | cut -d$'\t' -f1) ))
+    USER_HOMES="$USER_HOMES $(getent passwd $user | cut -d : -f 6)"
 done
 
+# Copies on flash need neither memory nor SD card, with room for
+# filesystem metadata like on zram
+if [ "$USE_SD" = false ]; then
+    SPACE_NEEDED=$(home_copy --measure --size-cache $SIZE_CACHE --exclude lost+found /home)
+    LV_SIZE=$(( $SPACE_NEEDED + $SPACE_NEEDED / 4 + 65536 ))
+    # Stale volume of an interrupted clean up, if it is safe to remove
+    lv_remove_stale
+fi
+
+# Otherwise plan what fits to /tmp while keeping memory for the rest of
+# the system, the copy stops with exit status 3 if memory still runs short
+WATCH_MEMORY=--watch-memory
+if [ "$USE_SD" = false ] && lv_setup $LV_SIZE; then
+    echo "Staging home on $(cat $STAGING_STATE)"
+    WATCH_MEMORY=""
+    PLAN=all
+elif [ "$USE_SD" = false ]; then
+    set -- $(home_copy --plan --zram --size-cache $SIZE_CACHE --exclude lost+found \
+        /tmp/home /home $USER_HOMES)
+    PLAN=${1:-none}
+    if [ "$2" = zram ]; then
+        if zram_setup $3; then
+            echo "Staging home compressed on $(cat $STAGING_STATE)"
+        else
+            PLAN=$(home_copy --plan --size-cache $SIZE_CACHE --exclude lost+found \
+                /tmp/home /home $USER_HOMES) || PLAN=none
+        fi
+    fi
+else
+    PLAN=none
+fi
+
 # Moving content from home partition to temporary location
-if [ $SPACE_ON_TMP -gt $(($SPACE_NEEDED + $EXTRA_SPACE)) ] && [ "$USE_SD" = false ]; then
+if [ "$PLAN" = all ]; then
     # move all stuff
     echo "Everything in /home fits to /tmp, copying all"
-    for dir in /home/.[!.]* /home/*; do
-        if [ "$(basename $dir)" != "lost+found" ]; then
-            cp --archive "$dir" "/tmp${dir}"
-        fi
-    done
-elif [ $SPACE_ON_TMP -gt $(( $USER_SPACE + $EXTRA_SPACE )) ] && [ "$USE_SD" = false ]; then
+    home_copy $WATCH_MEMORY --exclude lost+found /home /tmp/home
+    if [ $? -eq 3 ]; then
+        echo "Memory ran short, copying just user directories instead"
+        staging_reset
+        PLAN=users
+    fi
+fi
+if [ "$PLAN" = users ]; then
     echo "Copying just user directories"
-    for user in $USERS; do
-        cp --archive --parents $(getent passwd $user | cut -d : -f 6) /tmp/
+    for USER_HOME in $USER_HOMES; do
+        mkdir -p /tmp${USER_HOME%/*}
+        home_copy --watch-memory $USER_HOME /tmp${USER_HOME}
+        if [ $? -eq 3 ]; then
+            echo "Memory ran short, creating new home directories instead"
+            staging_reset
+            PLAN=none
+            break
+        fi
     done
-else
+fi
+if [ "$PLAN" = none ]; then
     echo "Creating new home directories."
     for user in $USERS; do
         USER_HOME=$(getent passwd $user | cut -d : -f 6)
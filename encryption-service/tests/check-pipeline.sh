@@ -0,0 +1,110 @@
+#!/bin/sh
+
+# Runs the encryption pipeline against a loop device with mock UDisks2,
+# systemd1, login1 and usb_moded on a private system bus and reports the
+# time taken by each phase. Needs root for the loop device and
+# cryptsetup, and the privileged group for the service access policy.
+#
+# Environment: CC, CFLAGS, LIBS and SOURCES to build the service with,
+# IMAGE_SIZE of the loop device, ERASE as overwriteType of
+# PrepareToEncrypt and KEEP_WORKDIR=1 to keep logs of a successful run.
+
+TESTDIR=$(cd "$(dirname "$0")" && pwd)
+SRCDIR=$(dirname "$TESTDIR")
+IMAGE_SIZE=${IMAGE_SIZE:-256M}
+ERASE=${ERASE:-none}
+CC=${CC:-cc}
+
+if [ "$(id -u)" != 0 ]; then
+    echo "check-pipeline must be run as root" >&2
+    exit 1
+fi
+
+if ! getent group privileged > /dev/null; then
+    echo "Group privileged is needed for the access policy" >&2
+    exit 1
+fi
+
+for tool in blkid cryptsetup dbus-daemon losetup mkfs.ext4 python3 wipefs; do
+    if ! command -v $tool > /dev/null; then
+        echo "$tool is needed" >&2
+        exit 1
+    fi
+done
+
+WORKDIR=$(mktemp -d /tmp/check-pipeline.XXXXXX)
+LOOP=
+BUS_PID=
+MOCK_PID=
+SERVICE_PID=
+RESULT=1
+
+cleanup() {
+    [ -n "$SERVICE_PID" ] && kill $SERVICE_PID 2> /dev/null
+    if [ -n "$MOCK_PID" ]; then
+        # Mock closes the LUKS mapping on exit
+        kill $MOCK_PID 2> /dev/null
+        wait $MOCK_PID
+    fi
+    [ -n "$BUS_PID" ] && kill $BUS_PID 2> /dev/null
+    [ -n "$LOOP" ] && losetup -d $LOOP
+    if [ $RESULT -eq 0 ] && [ "$KEEP_WORKDIR" != 1 ]; then
+        rm -rf "$WORKDIR"
+    else
+        echo "Logs are in $WORKDIR"
+    fi
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+truncate -s $IMAGE_SIZE "$WORKDIR/home.img"
+LOOP=$(losetup -f --show "$WORKDIR/home.img") || exit 1
+mkfs.ext4 -q $LOOP || exit 1
+mkdir -p "$WORKDIR/state" "$WORKDIR/units" "$WORKDIR/home"
+# Encryption is refused unless it was requested with the marker
+touch "$WORKDIR/state/encrypt-home"
+
+# Sources of the home copy service are next to the encryption service
+SOURCE_PATHS=
+for source in $SOURCES; do
+    if [ -f "$SRCDIR/$source" ]; then
+        SOURCE_PATHS="$SOURCE_PATHS $SRCDIR/$source"
+    else
+        SOURCE_PATHS="$SOURCE_PATHS $SRCDIR/../homecopy/$source"
+    fi
+done
+
+echo "Building the service for $LOOP"
+$CC -o "$WORKDIR/encryption-service" $CFLAGS \
+        -DDEVICE_TO_ENCRYPT=$LOOP \
+        -DSTATE_DIR="$WORKDIR/state" \
+        -DHOME_DIR="$WORKDIR/home" \
+        -DSYSTEMD_UNIT_DIR="$WORKDIR/units/" \
+        -DTRACE_FILE="$WORKDIR/trace.json" \
+        $SOURCE_PATHS $LIBS || exit 1
+
+dbus-daemon --config-file="$TESTDIR/system-bus.conf" --fork \
+        --print-address=3 --print-pid=4 \
+        3> "$WORKDIR/bus.address" 4> "$WORKDIR/bus.pid" || exit 1
+BUS_PID=$(cat "$WORKDIR/bus.pid")
+DBUS_SYSTEM_BUS_ADDRESS=$(cat "$WORKDIR/bus.address")
+export DBUS_SYSTEM_BUS_ADDRESS
+
+python3 "$TESTDIR/mock-services.py" --device $LOOP \
+        > "$WORKDIR/mock.log" 2>&1 &
+MOCK_PID=$!
+
+"$WORKDIR/encryption-service" > "$WORKDIR/service.log" 2>&1 &
+SERVICE_PID=$!
+
+python3 "$TESTDIR/pipeline-benchmark.py" --trace "$WORKDIR/trace.json" \
+        --erase $ERASE
+RESULT=$?
+
+# Service exits by itself after finalization
+if [ $RESULT -eq 0 ]; then
+    wait $SERVICE_PID
+    SERVICE_PID=
+fi
+
+exit $RESULT
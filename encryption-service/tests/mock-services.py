@@ -0,0 +1,480 @@
+#!/usr/bin/python3
+#
+# Mock UDisks2, systemd1, login1 and usb_moded for check-pipeline.
+#
+# UDisks2 serves one block device, usually a loop device, and formats it
+# for real with cryptsetup and mkfs so that the encryption pipeline does
+# the same work as on a device. The other services only answer the calls
+# the encryption service makes and complete jobs right away. Every call
+# is logged with its duration.
+
+import argparse
+import subprocess
+import sys
+import threading
+import time
+
+from gi.repository import Gio, GLib
+
+UDISKS_NAME = "org.freedesktop.UDisks2"
+UDISKS_PATH = "/org/freedesktop/UDisks2"
+UDISKS_IFACE = "org.freedesktop.UDisks2"
+PROPERTIES_IFACE = "org.freedesktop.DBus.Properties"
+
+UDISKS_XML = """
+<node>
+  <interface name="org.freedesktop.DBus.ObjectManager">
+    <method name="GetManagedObjects">
+      <arg name="objects" direction="out" type="a{oa{sa{sv}}}"/>
+    </method>
+    <signal name="InterfacesAdded">
+      <arg name="object" type="o"/>
+      <arg name="interfaces" type="a{sa{sv}}"/>
+    </signal>
+    <signal name="InterfacesRemoved">
+      <arg name="object" type="o"/>
+      <arg name="interfaces" type="as"/>
+    </signal>
+  </interface>
+  <interface name="org.freedesktop.UDisks2.Manager">
+    <method name="CanFormat">
+      <arg name="type" direction="in" type="s"/>
+      <arg name="available" direction="out" type="(bs)"/>
+    </method>
+    <method name="ResolveDevice">
+      <arg name="devspec" direction="in" type="a{sv}"/>
+      <arg name="options" direction="in" type="a{sv}"/>
+      <arg name="devices" direction="out" type="ao"/>
+    </method>
+    <property name="Version" type="s" access="read"/>
+  </interface>
+  <interface name="org.freedesktop.UDisks2.Block">
+    <method name="Format">
+      <arg name="type" direction="in" type="s"/>
+      <arg name="options" direction="in" type="a{sv}"/>
+    </method>
+    <method name="Rescan">
+      <arg name="options" direction="in" type="a{sv}"/>
+    </method>
+    <property name="Device" type="ay" access="read"/>
+    <property name="PreferredDevice" type="ay" access="read"/>
+    <property name="Size" type="t" access="read"/>
+    <property name="IdUsage" type="s" access="read"/>
+    <property name="IdType" type="s" access="read"/>
+    <property name="IdUUID" type="s" access="read"/>
+    <property name="CryptoBackingDevice" type="o" access="read"/>
+  </interface>
+  <interface name="org.freedesktop.UDisks2.Filesystem">
+    <method name="Unmount">
+      <arg name="options" direction="in" type="a{sv}"/>
+    </method>
+    <property name="MountPoints" type="aay" access="read"/>
+  </interface>
+  <interface name="org.freedesktop.UDisks2.Encrypted">
+    <property name="CleartextDevice" type="o" access="read"/>
+  </interface>
+</node>
+"""
+
+SYSTEMD_XML = """
+<node>
+  <interface name="org.freedesktop.systemd1.Manager">
+    <method name="Subscribe"/>
+    <method name="Reload"/>
+    <method name="StartUnit">
+      <arg name="name" direction="in" type="s"/>
+      <arg name="mode" direction="in" type="s"/>
+      <arg name="job" direction="out" type="o"/>
+    </method>
+    <method name="StopUnit">
+      <arg name="name" direction="in" type="s"/>
+      <arg name="mode" direction="in" type="s"/>
+      <arg name="job" direction="out" type="o"/>
+    </method>
+    <method name="EnableUnitFiles">
+      <arg name="files" direction="in" type="as"/>
+      <arg name="runtime" direction="in" type="b"/>
+      <arg name="force" direction="in" type="b"/>
+      <arg name="carries_install_info" direction="out" type="b"/>
+      <arg name="changes" direction="out" type="a(sss)"/>
+    </method>
+    <method name="MaskUnitFiles">
+      <arg name="files" direction="in" type="as"/>
+      <arg name="runtime" direction="in" type="b"/>
+      <arg name="force" direction="in" type="b"/>
+      <arg name="changes" direction="out" type="a(sss)"/>
+    </method>
+    <method name="UnmaskUnitFiles">
+      <arg name="files" direction="in" type="as"/>
+      <arg name="runtime" direction="in" type="b"/>
+      <arg name="changes" direction="out" type="a(sss)"/>
+    </method>
+    <method name="GetUnitByPID">
+      <arg name="pid" direction="in" type="u"/>
+      <arg name="unit" direction="out" type="o"/>
+    </method>
+    <signal name="JobRemoved">
+      <arg name="id" type="u"/>
+      <arg name="job" type="o"/>
+      <arg name="unit" type="s"/>
+      <arg name="result" type="s"/>
+    </signal>
+  </interface>
+</node>
+"""
+
+LOGIN_XML = """
+<node>
+  <interface name="org.freedesktop.login1.Manager">
+    <method name="TerminateUser">
+      <arg name="uid" direction="in" type="u"/>
+    </method>
+    <signal name="UserRemoved">
+      <arg name="uid" type="u"/>
+      <arg name="path" type="o"/>
+    </signal>
+  </interface>
+</node>
+"""
+
+USB_MODED_XML = """
+<node>
+  <interface name="com.meego.usb_moded">
+    <method name="get_target_state">
+      <arg name="mode" direction="out" type="s"/>
+    </method>
+    <method name="set_mode">
+      <arg name="mode" direction="in" type="s"/>
+      <arg name="mode" direction="out" type="s"/>
+    </method>
+  </interface>
+</node>
+"""
+
+
+def log(fmt, *args):
+    print("%.3f %s" % (time.monotonic(), fmt % args), flush=True)
+
+
+def object_path_for(device):
+    # As udisks does, /dev/loop0 -> block_devices/loop0
+    name = device.rsplit("/", 1)[-1]
+    escaped = "".join(
+            c if c.isalnum() else "_%02x" % ord(c) for c in name)
+    return UDISKS_PATH + "/block_devices/" + escaped
+
+
+def bytestring(value):
+    return GLib.Variant("ay", value.encode() + b"\0")
+
+
+def probe(device, tag):
+    # Empty when blkid finds nothing
+    return subprocess.run(
+            ["blkid", "-p", "-s", tag, "-o", "value", device],
+            stdout=subprocess.PIPE, universal_newlines=True).stdout.strip()
+
+
+def run(*command, stdin=None):
+    log("run %s", " ".join(command))
+    result = subprocess.run(
+            command, input=stdin, stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE, universal_newlines=True)
+    if result.returncode != 0:
+        raise RuntimeError("%s failed: %s" % (command[0],
+                           result.stderr.strip()))
+    return result.stdout.strip()
+
+
+class Service:
+    def __init__(self, connection, name, path, xml):
+        self.connection = connection
+        self.path = path
+        self.info = Gio.DBusNodeInfo.new_for_xml(xml)
+        self.registrations = []
+        Gio.bus_own_name_on_connection(
+                connection, name, Gio.BusNameOwnerFlags.NONE, None, None)
+
+    def register(self, path, names):
+        for name in names:
+            self.registrations.append(self.connection.register_object(
+                    path, self.info.lookup_interface(name),
+                    self.method_call, None, None))
+
+    def emit(self, path, iface, signal, parameters):
+        self.connection.emit_signal(None, path, iface, signal, parameters)
+
+    def method_call(self, connection, sender, path, iface, method,
+                    parameters, invocation):
+        start = time.monotonic()
+        try:
+            result = self.handle(path, iface, method, parameters,
+                                 invocation)
+        except Exception as error:
+            log("%s.%s failed: %s", iface, method, error)
+            invocation.return_dbus_error(
+                    "org.freedesktop.DBus.Error.Failed", str(error))
+            return
+        if result is not False:
+            invocation.return_value(result)
+            log("%s.%s took %.1f ms", iface.rsplit(".", 1)[-1], method,
+                (time.monotonic() - start) * 1000)
+
+
+class UDisks(Service):
+    def __init__(self, connection, device):
+        Service.__init__(self, connection, UDISKS_NAME, UDISKS_PATH,
+                         UDISKS_XML)
+        self.device = device
+        self.objects = {}
+        self.mapping = None
+        self.register(UDISKS_PATH, ["org.freedesktop.DBus.ObjectManager"])
+        self.add_object(UDISKS_PATH + "/Manager", {
+            UDISKS_IFACE + ".Manager": {
+                "Version": GLib.Variant("s", "2.8.4"),
+            },
+        })
+        self.block_path = object_path_for(device)
+        self.add_object(self.block_path, self.block_interfaces(device))
+
+    def block_interfaces(self, device, crypto_backing="/"):
+        return {
+            UDISKS_IFACE + ".Block": {
+                "Device": bytestring(device),
+                "PreferredDevice": bytestring(device),
+                "Size": GLib.Variant("t", int(run(
+                    "blockdev", "--getsize64", device))),
+                "IdUsage": GLib.Variant("s", "filesystem"),
+                "IdType": GLib.Variant("s", probe(device, "TYPE")),
+                "IdUUID": GLib.Variant("s", probe(device, "UUID")),
+                "CryptoBackingDevice": GLib.Variant("o", crypto_backing),
+            },
+            UDISKS_IFACE + ".Filesystem": {
+                "MountPoints": GLib.Variant("aay", []),
+            },
+        }
+
+    def add_object(self, path, interfaces):
+        self.objects[path] = interfaces
+        self.register(path, interfaces.keys())
+        self.emit(UDISKS_PATH, "org.freedesktop.DBus.ObjectManager",
+                  "InterfacesAdded",
+                  GLib.Variant("(oa{sa{sv}})", (path, interfaces)))
+
+    def set_property(self, path, iface, name, value):
+        self.objects[path][iface][name] = value
+        self.emit(path, PROPERTIES_IFACE, "PropertiesChanged",
+                  GLib.Variant("(sa{sv}as)", (iface, {name: value}, [])))
+
+    def handle(self, path, iface, method, parameters, invocation):
+        if iface == PROPERTIES_IFACE:
+            return self.properties(path, method, parameters)
+        if method == "GetManagedObjects":
+            return GLib.Variant("(a{oa{sa{sv}}})", (self.objects,))
+        if method == "CanFormat":
+            binary = "mkfs." + parameters[0]
+            found = GLib.find_program_in_path(binary) is not None
+            return GLib.Variant("((bs))", ((found, "" if found else binary),))
+        if method == "ResolveDevice":
+            devspec = parameters[0]
+            found = [self.block_path] if devspec.get("path") in (
+                    self.device, self.block_path) else []
+            return GLib.Variant("(ao)", (found,))
+        if method == "Rescan":
+            run("udevadm", "settle")
+            return None
+        if method == "Unmount":
+            self.set_property(path, iface, "MountPoints",
+                              GLib.Variant("aay", []))
+            return None
+        if method == "Format":
+            return self.format(path, parameters, invocation)
+        raise RuntimeError("Unknown method %s" % method)
+
+    def properties(self, path, method, parameters):
+        properties = self.objects[path][parameters[0]]
+        if method == "Get":
+            return GLib.Variant("(v)", (properties[parameters[1]],))
+        if method == "GetAll":
+            return GLib.Variant("(a{sv})", (properties,))
+        raise RuntimeError("Properties are read only")
+
+    def format(self, path, parameters, invocation):
+        fstype, options = parameters
+        start = time.monotonic()
+
+        def formatted(error):
+            if error is not None:
+                log("Block.Format %s failed: %s", fstype, error)
+            else:
+                log("Block.Format %s took %.1f ms", fstype,
+                    (time.monotonic() - start) * 1000)
+            if not options.get("no-block", False):
+                if error is None:
+                    invocation.return_value(None)
+                else:
+                    invocation.return_dbus_error(
+                            "org.freedesktop.UDisks2.Error.Failed",
+                            str(error))
+            return GLib.SOURCE_REMOVE
+
+        def work():
+            error = None
+            try:
+                self.format_device(fstype, options)
+            except Exception as e:
+                error = e
+            GLib.idle_add(formatted, error)
+
+        # With no-block the call returns when the job is started
+        if options.get("no-block", False):
+            invocation.return_value(None)
+        threading.Thread(target=work, daemon=True).start()
+        return False
+
+    def format_device(self, fstype, options):
+        passphrase = options.get("encrypt.passphrase")
+
+        self.close_mapping()
+        run("wipefs", "-a", self.device)
+        if options.get("erase") == "zero":
+            # dd ends with ENOSPC at the end of the device
+            subprocess.run(["dd", "if=/dev/zero", "of=" + self.device,
+                            "bs=1M", "oflag=direct"],
+                           stderr=subprocess.DEVNULL)
+        if fstype == "empty":
+            return
+
+        if passphrase is None:
+            run("mkfs." + fstype, "-q", self.device)
+            GLib.idle_add(self.set_property, self.block_path,
+                          UDISKS_IFACE + ".Block", "IdUUID",
+                          GLib.Variant("s", probe(self.device, "UUID")))
+            return
+
+        run("cryptsetup", "luksFormat", "--batch-mode",
+            "--type", options.get("encrypt.type", "luks1"),
+            "--key-file=-", self.device, stdin=passphrase)
+        uuid = run("cryptsetup", "luksUUID", self.device)
+        self.mapping = "luks-" + uuid
+        run("cryptsetup", "open", "--key-file=-", self.device,
+            self.mapping, stdin=passphrase)
+        cleartext = "/dev/mapper/" + self.mapping
+        run("mkfs." + fstype, "-q", cleartext)
+        GLib.idle_add(self.publish_cleartext, cleartext, uuid)
+
+    def publish_cleartext(self, cleartext, uuid):
+        # Same order as udisks: object, CleartextDevice and then the
+        # filesystem UUID once it has been probed
+        path = UDISKS_PATH + "/block_devices/dm_2d0"
+        self.set_property(self.block_path, UDISKS_IFACE + ".Block",
+                          "IdUUID", GLib.Variant("s", uuid))
+        self.set_property(self.block_path, UDISKS_IFACE + ".Block",
+                          "IdType", GLib.Variant("s", "crypto_LUKS"))
+        if UDISKS_IFACE + ".Encrypted" not in self.objects[self.block_path]:
+            self.objects[self.block_path][UDISKS_IFACE + ".Encrypted"] = {
+                "CleartextDevice": GLib.Variant("o", "/"),
+            }
+            self.register(self.block_path, [UDISKS_IFACE + ".Encrypted"])
+            self.emit(UDISKS_PATH, "org.freedesktop.DBus.ObjectManager",
+                      "InterfacesAdded", GLib.Variant("(oa{sa{sv}})", (
+                          self.block_path, {
+                              UDISKS_IFACE + ".Encrypted": self.objects[
+                                  self.block_path][
+                                      UDISKS_IFACE + ".Encrypted"],
+                          })))
+        if path not in self.objects:
+            self.add_object(path, self.block_interfaces(
+                    cleartext, self.block_path))
+        self.set_property(self.block_path, UDISKS_IFACE + ".Encrypted",
+                          "CleartextDevice", GLib.Variant("o", path))
+        self.set_property(path, UDISKS_IFACE + ".Block", "IdUUID",
+                          GLib.Variant("s", probe(cleartext, "UUID")))
+        return GLib.SOURCE_REMOVE
+
+    def close_mapping(self):
+        if self.mapping is not None:
+            run("cryptsetup", "close", self.mapping)
+            self.mapping = None
+
+
+class Systemd(Service):
+    def __init__(self, connection):
+        Service.__init__(self, connection, "org.freedesktop.systemd1",
+                         "/org/freedesktop/systemd1", SYSTEMD_XML)
+        self.jobs = 0
+        self.register(self.path, ["org.freedesktop.systemd1.Manager"])
+
+    def job(self, unit):
+        self.jobs += 1
+        path = "%s/job/%u" % (self.path, self.jobs)
+        # Reply goes out first, the job ends right after it
+        GLib.idle_add(self.emit, self.path,
+                      "org.freedesktop.systemd1.Manager", "JobRemoved",
+                      GLib.Variant("(uoss)", (self.jobs, path, unit, "done")))
+        return GLib.Variant("(o)", (path,))
+
+    def handle(self, path, iface, method, parameters, invocation):
+        if method in ("Subscribe", "Reload"):
+            return None
+        if method in ("StartUnit", "StopUnit"):
+            return self.job(parameters[0])
+        if method == "EnableUnitFiles":
+            return GLib.Variant("(ba(sss))", (False, []))
+        if method in ("MaskUnitFiles", "UnmaskUnitFiles"):
+            return GLib.Variant("(a(sss))", ([],))
+        if method == "GetUnitByPID":
+            invocation.return_dbus_error(
+                    "org.freedesktop.systemd1.NoUnitForPID",
+                    "PID %u does not belong to any loaded unit."
+                    % parameters[0])
+            return False
+        raise RuntimeError("Unknown method %s" % method)
+
+
+class Login(Service):
+    def __init__(self, connection):
+        Service.__init__(self, connection, "org.freedesktop.login1",
+                         "/org/freedesktop/login1", LOGIN_XML)
+        self.register(self.path, ["org.freedesktop.login1.Manager"])
+
+    def handle(self, path, iface, method, parameters, invocation):
+        uid = parameters[0]
+        GLib.idle_add(self.emit, self.path, "org.freedesktop.login1.Manager",
+                      "UserRemoved", GLib.Variant("(uo)", (
+                          uid, "%s/user/_%u" % (self.path, uid))))
+        return None
+
+
+class UsbModed(Service):
+    def __init__(self, connection):
+        Service.__init__(self, connection, "com.meego.usb_moded",
+                         "/com/meego/usb_moded", USB_MODED_XML)
+        self.mode = "mtp_mode"
+        self.register(self.path, ["com.meego.usb_moded"])
+
+    def handle(self, path, iface, method, parameters, invocation):
+        if method == "set_mode":
+            self.mode = parameters[0]
+        return GLib.Variant("(s)", (self.mode,))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--device", required=True,
+                        help="block device served by UDisks2")
+    args = parser.parse_args()
+
+    connection = Gio.bus_get_sync(Gio.BusType.SYSTEM, None)
+    loop = GLib.MainLoop()
+    udisks = UDisks(connection, args.device)
+    services = [Systemd(connection), Login(connection), UsbModed(connection)]
+    GLib.unix_signal_add(GLib.PRIORITY_DEFAULT, 15, loop.quit)
+    GLib.unix_signal_add(GLib.PRIORITY_DEFAULT, 2, loop.quit)
+    log("Serving %s", args.device)
+    loop.run()
+    udisks.close_mapping()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
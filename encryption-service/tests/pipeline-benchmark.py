@@ -0,0 +1,140 @@
+#!/usr/bin/python3
+#
+# Drives the encryption service through PrepareToEncrypt, BeginEncryption
+# and FinalizeEncryption like the UI does and reports per-phase timings
+# from the trace the service writes when it exits.
+
+import argparse
+import grp
+import json
+import os
+import sys
+import time
+
+from gi.repository import Gio, GLib
+
+SERVICE_NAME = "org.sailfishos.EncryptionService"
+SERVICE_PATH = "/org/sailfishos/EncryptionService"
+SERVICE_IFACE = "org.sailfishos.EncryptionService"
+
+MOCK_NAMES = ["org.freedesktop.UDisks2", "org.freedesktop.systemd1",
+              "org.freedesktop.login1", "com.meego.usb_moded"]
+
+
+class Driver:
+    def __init__(self, timeout):
+        self.timeout = timeout
+        self.loop = GLib.MainLoop()
+        self.connection = Gio.bus_get_sync(Gio.BusType.SYSTEM, None)
+        self.finished = None
+        self.connection.signal_subscribe(
+                SERVICE_NAME, SERVICE_IFACE, "EncryptionFinished",
+                SERVICE_PATH, None, Gio.DBusSignalFlags.NONE,
+                self.on_finished)
+
+    def on_finished(self, connection, sender, path, iface, signal,
+                    parameters):
+        self.finished = parameters.unpack()
+        self.loop.quit()
+
+    def call(self, method, parameters=None):
+        print("%s" % method, flush=True)
+        return self.connection.call_sync(
+                SERVICE_NAME, SERVICE_PATH, SERVICE_IFACE, method,
+                parameters, None, Gio.DBusCallFlags.NONE, -1, None)
+
+    def has_owner(self, name):
+        return self.connection.call_sync(
+                "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                "org.freedesktop.DBus", "NameHasOwner",
+                GLib.Variant("(s)", (name,)), None,
+                Gio.DBusCallFlags.NONE, -1, None).unpack()[0]
+
+    def wait(self, condition, what):
+        deadline = time.monotonic() + self.timeout
+        context = self.loop.get_context()
+        while not condition():
+            if time.monotonic() > deadline:
+                raise TimeoutError("Timed out waiting for " + what)
+            GLib.timeout_add(50, self.loop.quit)
+            self.loop.run()
+            while context.pending():
+                context.iteration(False)
+
+    def prepared(self):
+        events = self.call("GetTrace").unpack()[0]
+        return any(category == "manage" and name == "preparation"
+                   for category, name, start, duration in events)
+
+    def run(self, passphrase, erase):
+        self.wait(lambda: all(self.has_owner(name)
+                              for name in MOCK_NAMES + [SERVICE_NAME]),
+                  "services")
+        self.call("PrepareToEncrypt", GLib.Variant("(ss)",
+                                                   (passphrase, erase)))
+        self.wait(self.prepared, "preparation")
+        self.call("BeginEncryption")
+        self.wait(lambda: self.finished is not None, "EncryptionFinished")
+        success, error = self.finished
+        if not success:
+            raise RuntimeError("Encryption failed: " + error)
+        self.call("FinalizeEncryption")
+        # Service writes the trace and exits when finalization is done
+        self.wait(lambda: not self.has_owner(SERVICE_NAME), "finalization")
+
+
+def read_trace(path):
+    with open(path) as trace:
+        events = json.load(trace)["traceEvents"]
+
+    spans = {}
+    for event in events:
+        key = event.get("id", id(event))
+        span = spans.setdefault(key, {
+            "cat": event["cat"], "name": event["name"],
+            "start": event["ts"], "end": None,
+        })
+        if event["ph"] == "e":
+            span["end"] = event["ts"]
+        elif event["ph"] == "b":
+            span["start"] = event["ts"]
+    return sorted(spans.values(), key=lambda span: span["start"])
+
+
+def report(spans):
+    origin = spans[0]["start"] if spans else 0
+
+    print("\n%-44s %10s %10s" % ("Phase", "Start ms", "Took ms"))
+    for span in spans:
+        took = "-" if span["end"] is None else "%.1f" % (
+                (span["end"] - span["start"]) / 1000)
+        print("%-44s %10.1f %10s" % (
+              (span["cat"] + ": " + span["name"])[:44],
+              (span["start"] - origin) / 1000, took))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--trace", required=True,
+                        help="trace file the service was built with")
+    parser.add_argument("--erase", default="none",
+                        choices=["none", "zero", "random"])
+    parser.add_argument("--passphrase", default="benchmark")
+    parser.add_argument("--timeout", type=float, default=600)
+    args = parser.parse_args()
+
+    # Service allows only the privileged group
+    os.setgroups([grp.getgrnam("privileged").gr_gid])
+
+    try:
+        Driver(args.timeout).run(args.passphrase, args.erase)
+    except (GLib.Error, RuntimeError, TimeoutError) as error:
+        print(error, file=sys.stderr)
+        return 1
+
+    report(read_trace(args.trace))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,212 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#include <glib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "trace.h"
+
+#ifndef TRACE_FILE
+#define TRACE_FILE /var/log/sailfish-device-encryption-trace.json
+#endif
+
+// Daemon runs for long, the oldest events are dropped beyond this
+#define TRACE_MAX_EVENTS 1024
+
+#define QUOTE(s) #s
+#define STR(s) QUOTE(s)
+
+typedef struct {
+    const char *category;
+    gchar *name;
+    gint64 start;
+    gint64 duration;
+} trace_event;
+
+// Ring buffer of events, the oldest one is at first once it is full
+static GArray *events = NULL;
+static guint first = 0;
+static guint dropped = 0;
+static gint64 wallclock_offset = 0;
+
+static void trace_event_clear(gpointer event)
+{
+    g_free(((trace_event *)event)->name);
+}
+
+static trace_event *event_at(guint i)
+{
+    return &g_array_index(events, trace_event, (first + i) % events->len);
+}
+
+static void record(const char *category, const char *name,
+                   gint64 start, gint64 duration)
+{
+    trace_event event;
+
+    if (events == NULL) {
+        events = g_array_sized_new(FALSE, FALSE, sizeof(trace_event),
+                                   TRACE_MAX_EVENTS);
+        g_array_set_clear_func(events, trace_event_clear);
+        wallclock_offset = g_get_real_time() - g_get_monotonic_time();
+    }
+
+    event.category = category;
+    event.name = g_strdup(name);
+    event.start = start;
+    event.duration = duration;
+
+    if (events->len < TRACE_MAX_EVENTS) {
+        g_array_append_val(events, event);
+    } else {
+        trace_event_clear(&g_array_index(events, trace_event, first));
+        g_array_index(events, trace_event, first) = event;
+        first = (first + 1) % TRACE_MAX_EVENTS;
+        dropped++;
+    }
+}
+
+gint64 trace_now(void)
+{
+    return g_get_monotonic_time();
+}
+
+// Records a phase that started at start and ends now
+void trace_span(const char *category, const char *name, gint64 start)
+{
+    record(category, name, start, trace_now() - start);
+}
+
+void trace_instant(const char *category, const char *name)
+{
+    record(category, name, trace_now(), -1);
+}
+
+static void append_string(GString *json, const char *str)
+{
+    g_string_append_c(json, '"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            g_string_append_c(json, '\\');
+        if ((guchar)*str < 0x20)
+            g_string_append_printf(json, "\\u%04x", *str);
+        else
+            g_string_append_c(json, *str);
+    }
+    g_string_append_c(json, '"');
+}
+
+/*
+ * Spans from concurrent steps overlap, so they are written as async
+ * begin/end pairs rather than complete events which must nest.
+ */
+static void append_event(GString *json, const trace_event *event,
+                         guint id, char phase, gint64 timestamp)
+{
+    if (json->str[json->len - 1] != '[')
+        g_string_append(json, ",\n");
+    g_string_append(json, "{\"name\":");
+    append_string(json, event->name);
+    g_string_append(json, ",\"cat\":");
+    append_string(json, event->category);
+    g_string_append_printf(json,
+            ",\"ph\":\"%c\",\"ts\":%" G_GINT64_FORMAT
+            ",\"pid\":%d,\"tid\":%d", phase, timestamp, getpid(), getpid());
+    if (phase == 'i')
+        g_string_append(json, ",\"s\":\"p\"}");
+    else
+        g_string_append_printf(json, ",\"id\":%u}", id);
+}
+
+gboolean trace_write(void)
+{
+    GError *error = NULL;
+    GString *json;
+    trace_event *event;
+    gboolean ret;
+    guint i;
+
+    if (events == NULL)
+        return TRUE;
+
+    json = g_string_new("{\"traceEvents\":[");
+    for (i = 0; i < events->len; i++) {
+        event = event_at(i);
+        if (event->duration < 0) {
+            append_event(json, event, i, 'i', event->start);
+        } else {
+            append_event(json, event, i, 'b', event->start);
+            append_event(json, event, i, 'e',
+                         event->start + event->duration);
+        }
+    }
+    g_string_append_printf(json,
+            "],\n\"displayTimeUnit\":\"ms\","
+            "\"otherData\":{\"wallclockOffset\":%" G_GINT64_FORMAT
+            ",\"droppedEvents\":%u}}\n",
+            wallclock_offset, dropped);
+
+    ret = g_file_set_contents(STR(TRACE_FILE), json->str, json->len, &error);
+    if (!ret) {
+        fprintf(stderr, "Could not write trace: %s\n", error->message);
+        g_error_free(error);
+    }
+
+    g_string_free(json, TRUE);
+    return ret;
+}
+
+/*
+ * Returns a(ssxx) of category, name, monotonic start time and duration
+ * in microseconds. Duration is -1 for instant events.
+ */
+GVariant *trace_get_events(void)
+{
+    GVariantBuilder builder;
+    trace_event *event;
+    guint i;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ssxx)"));
+    for (i = 0; events != NULL && i < events->len; i++) {
+        event = event_at(i);
+        g_variant_builder_add(
+                &builder, "(ssxx)", event->category, event->name,
+                event->start, event->duration);
+    }
+    return g_variant_builder_end(&builder);
+}
+
+// vim: expandtab:ts=4:sw=4
@@ -52,15 +52,27 @@ Page {
         RestorationService {}
     }
 
+    // Restarted last as it ends this application too
+    readonly property string lipstickUnit: "lipstick.service"
+    readonly property string ownUnit: "home-restore-ui.service"
+    property int pendingRestarts
+    property double copiedTime
+
     DBusInterface {
-        id: lipstick
-        bus: DBus.SystemBus
-        service: "org.nemomobile.lipstick"
-        path: "/shutdown"
-        iface: "org.nemomobile.lipstick"
-
-        function setShutdown() {
-            lipstick.call("setShutdownMode", ["reboot"])
+        id: systemd
+        bus: DBus.SessionBus
+        service: "org.freedesktop.systemd1"
+        path: "/org/freedesktop/systemd1"
+        iface: "org.freedesktop.systemd1.Manager"
+
+        function tryRestart(unit) {
+            typedCall("TryRestartUnit",
+                      [{ "type": "s", "value": unit }, { "type": "s", "value": "replace" }],
+                      page.restartQueued,
+                      function(error, message) {
+                          console.warn("Could not restart", unit, message)
+                          page.restartQueued()
+                      })
         }
     }
 
@@ -72,29 +84,56 @@ Page {
         body: qsTrId("settings_encryption-la-restore-fail-body")
     }
 
-    Timer {
-        id: quitTimer
-        interval: 5000
-        running: false
-        onTriggered: {
-            lipstick.setShutdown()
+    function restartQueued() {
+        if (--pendingRestarts > 0) {
+            return
         }
+        console.log("Restore handed off in", Date.now() - copiedTime, "ms")
+        systemd.tryRestart(lipstickUnit)
+        Qt.quit()
     }
 
-    Timer {
-        id: restorationStarter
-        interval: 10000
-        running: true
-        repeat: false
-        onTriggered: {
-            page.restorationService = restorationServiceComponent.createObject(page)
-            page.restorationService.restoreHome()
-            page.restorationService.copied.connect(function(success) {
-                if(!success) {
-                    notification.publish()
-                }
-                quitTimer.running = true
-            })
+    // Restored data is picked up by restarting the user services that read
+    // home before it was restored instead of the whole user session
+    function restartStaleUnits(units) {
+        var staleUnits = units.filter(function(unit) {
+            return unit !== ownUnit && unit !== lipstickUnit
+        })
+
+        console.log("Restarting", staleUnits, "and", lipstickUnit)
+        // One more for the call below, lipstick goes when all are queued
+        pendingRestarts = staleUnits.length + 1
+        for (var i = 0; i < staleUnits.length; i++) {
+            systemd.tryRestart(staleUnits[i])
+        }
+        restartQueued()
+    }
+
+    function restoreDone(success) {
+        copiedTime = Date.now()
+        if (!success) {
+            notification.publish()
+        }
+        // Home copy service finds them from the processes holding home
+        restorationService.getStaleUnits(restartStaleUnits)
+    }
+
+    Component.onCompleted: {
+        restorationService = restorationServiceComponent.createObject(page)
+        restorationService.copied.connect(restoreDone)
+        if (restorationService.status === DBusInterface.Available) {
+            restorationService.restoreHome()
+        }
+    }
+
+    // Starts as soon as the home copy service is activated
+    Connections {
+        target: page.restorationService
+        onStatusChanged: {
+            if (page.restorationService.status === DBusInterface.Available
+                    && !page.restorationService.started) {
+                page.restorationService.restoreHome()
+            }
         }
     }
 
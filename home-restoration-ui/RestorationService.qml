@@ -57,16 +57,43 @@ DBusInterface {
         Component.onCompleted: call("Introspect")
     }
 
+    property bool started
+
     function restoreHome() {
         console.log("Start restoreHome")
+        started = true
         call("restoreHome", [])
     }
 
+    // Copy ends with copied(false)
+    function cancelCopy() {
+        call("cancelCopy", [])
+    }
+
+    // User units that have home open, callback gets an empty list on errors
+    function getStaleUnits(callback) {
+        typedCall("getStaleUnits", [], callback, function(error, message) {
+            console.warn("Could not get stale units:", message)
+            callback([])
+        })
+    }
+
     signal copied(bool success)
 
+    // Updated while copying, remainingSeconds is -1 when not known
+    property real progress
+    property real bytesPerSecond
+    property int remainingSeconds: -1
+
     function copyDone(value) {
         console.log("SD copied:", value)
         copied(value)
     }
 
+    function copyProgress(filesDone, filesTotal, bytesDone, bytesTotal, rate, eta) {
+        progress = bytesTotal > 0 ? Math.min(bytesDone / bytesTotal, 1.0) : 0
+        bytesPerSecond = rate
+        remainingSeconds = eta
+    }
+
 }
@@ -0,0 +1,110 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#include <errno.h>
+#include <glib.h>
+#include <openssl/evp.h>
+#include <unistd.h>
+#include "checksum.h"
+
+#define ZEROS_SIZE (64 * 1024)
+
+checksum *checksum_new(void)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    return (checksum *)ctx;
+}
+
+void checksum_update(checksum *c, const void *data, size_t length)
+{
+    EVP_DigestUpdate((EVP_MD_CTX *)c, data, length);
+}
+
+void checksum_update_zeros(checksum *c, guint64 length)
+{
+    static const guchar zeros[ZEROS_SIZE];
+    size_t chunk;
+
+    while (length > 0) {
+        chunk = MIN(length, ZEROS_SIZE);
+        checksum_update(c, zeros, chunk);
+        length -= chunk;
+    }
+}
+
+void checksum_finish(checksum *c, char result[CHECKSUM_SIZE])
+{
+    EVP_MD_CTX *ctx = (EVP_MD_CTX *)c;
+    guchar digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    unsigned int i;
+
+    EVP_DigestFinal_ex(ctx, digest, &length);
+    EVP_MD_CTX_free(ctx);
+
+    for (i = 0; i < length && i * 2 + 2 < CHECKSUM_SIZE; i++)
+        g_snprintf(result + i * 2, 3, "%02x", digest[i]);
+    result[i * 2] = '\0';
+}
+
+gboolean checksum_fd(
+        int fd,
+        gchar *buffer,
+        gsize size,
+        char result[CHECKSUM_SIZE])
+{
+    checksum *c = checksum_new();
+    ssize_t length;
+    int errnum;
+
+    while ((length = read(fd, buffer, size)) != 0) {
+        if (length > 0) {
+            checksum_update(c, buffer, length);
+        } else if (errno != EINTR) {
+            errnum = errno;
+            checksum_finish(c, result);
+            errno = errnum;
+            return FALSE;
+        }
+    }
+
+    checksum_finish(c, result);
+    return TRUE;
+}
+
+// vim: expandtab:ts=4:sw=4
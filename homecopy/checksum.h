@@ -0,0 +1,71 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#ifndef __CHECKSUM_H
+#define __CHECKSUM_H
+
+#include <glib.h>
+
+/*
+ * SHA-256 of file data for manifests and verification. OpenSSL picks
+ * the fastest implementation for the CPU, which uses the SHA extensions
+ * of ARMv8 and x86 when they are present.
+ */
+
+// Hex digest and terminating null
+#define CHECKSUM_SIZE 65
+
+typedef struct _checksum checksum;
+
+checksum *checksum_new(void);
+void checksum_update(checksum *c, const void *data, size_t length);
+// Like checksum_update() with length bytes of zeros, for holes of files
+void checksum_update_zeros(checksum *c, guint64 length);
+// Writes the digest to result and frees the checksum
+void checksum_finish(checksum *c, char result[CHECKSUM_SIZE]);
+/*
+ * Reads fd to the end with buffer of size bytes. Returns FALSE and sets
+ * errno if reading fails.
+ */
+gboolean checksum_fd(
+        int fd,
+        gchar *buffer,
+        gsize size,
+        char result[CHECKSUM_SIZE]);
+
+#endif // __CHECKSUM_H
+
+// vim: expandtab:ts=4:sw=4
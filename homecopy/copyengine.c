@@ -0,0 +1,1614 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include <linux/magic.h>
+#include "checksum.h"
+#include "copyengine.h"
+#include "manifest.h"
+#include "sizecache.h"
+#include "staging.h"
+#include "verify.h"
+
+#define MIN_THREADS 2
+#define MAX_THREADS 8
+// Also the window of pages that are written back at a time
+#define CHUNK_SIZE (8 * 1024 * 1024)
+#define BUFFER_SIZE (128 * 1024)
+// Unit of space accounting, the block size of ext4 and tmpfs pages
+#define SPACE_BLOCK_SIZE 4096
+// Requested paths keep a background copy at normal priority this long
+#define PRIORITY_BOOST_TIME (30 * G_USEC_PER_SEC)
+#define REQUEST_POLL_TIMEOUT 200
+#define MEMORY_CHECK_INTERVAL (G_USEC_PER_SEC / 2)
+
+// Not in the C library headers
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_NORMAL ((IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 4)
+#define IOPRIO_IDLE (IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT)
+
+// Ordered from the cheapest, a file falls back to the next one
+typedef enum {
+    COPY_FILE_RANGE,
+    COPY_SENDFILE,
+    COPY_READ_WRITE
+} copy_method;
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+} inode_key;
+
+// Directory to measure, relative to the source
+typedef struct {
+    gchar *path;
+    gboolean deferred;
+    // Size of its top level entry
+    copy_size *entry;
+} size_node;
+
+typedef struct {
+    const copy_options *options;
+    int source_fd;
+    GThreadPool *pool;
+    // Files with several links that were counted, guarded by lock
+    GHashTable *inodes;
+    copy_scan *scan;
+    GMutex lock;
+    GCond cond;
+    guint pending;
+} size_context;
+
+// First path of a file with several links
+typedef struct {
+    inode_key key;
+    gchar *target;
+    // Relative to the top of the tree
+    gchar *path;
+} link_entry;
+
+typedef struct {
+    const copy_options *options;
+    GThreadPool *pool;
+    manifest *manifest;
+    manifest *expected;
+    // Entries of files with several links by inode
+    GHashTable *links;
+    const char *target;
+    // Requested relative paths, copied before others
+    GPtrArray *wanted;
+    gint64 boost_until;
+    progress_tracker progress;
+    GMutex lock;
+    GCond cond;
+    gboolean finished;
+    copy_stats stats;
+    gint method;
+    // Target is written back as it is copied
+    gboolean writeback;
+    guint64 reserve;
+    gint stopped;
+} copy_context;
+
+typedef struct _dir_node dir_node;
+
+struct _dir_node {
+    dir_node *parent;
+    gchar *source;
+    gchar *target;
+    // Relative to the top of the tree
+    gchar *path;
+    struct stat st;
+    // Own scan and subdirectories that are not done yet
+    gint pending;
+    gboolean apply_metadata;
+    // Inside a directory that matches options->defer
+    gboolean deferred;
+};
+
+static void report(
+        copy_context *ctx,
+        const char *directory,
+        const char *name,
+        const char *operation,
+        int errnum)
+{
+    gchar *path = name ? g_build_filename(directory, name, NULL)
+                       : g_strdup(directory);
+
+    g_mutex_lock(&ctx->lock);
+    ctx->stats.errors++;
+    if (ctx->options->error)
+        ctx->options->error(path, operation, errnum, ctx->options->user_data);
+    else
+        fprintf(stderr, "%s: %s failed: %s\n", path, operation,
+                strerror(errnum));
+    g_mutex_unlock(&ctx->lock);
+    g_free(path);
+}
+
+static void add_progress(copy_context *ctx, guint64 files, guint64 bytes)
+{
+    if (ctx->options->progress == NULL)
+        return;
+
+    g_mutex_lock(&ctx->lock);
+    progress_update(&ctx->progress, files, bytes);
+    g_mutex_unlock(&ctx->lock);
+}
+
+static guint inode_hash(gconstpointer key)
+{
+    const inode_key *inode = key;
+
+    return (guint)inode->ino ^ (guint)(inode->ino >> 32) ^ (guint)inode->dev;
+}
+
+static gboolean inode_equal(gconstpointer a, gconstpointer b)
+{
+    const inode_key *first = a;
+    const inode_key *second = b;
+
+    return first->ino == second->ino && first->dev == second->dev;
+}
+
+static void link_entry_free(gpointer data)
+{
+    link_entry *entry = data;
+
+    g_free(entry->target);
+    g_free(entry->path);
+    g_free(entry);
+}
+
+static gboolean matches_defer(const copy_options *options, const char *path)
+{
+    const char * const *pattern;
+
+    for (pattern = options->defer; pattern && *pattern; pattern++) {
+        if (g_pattern_match_simple(*pattern, path))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+gboolean copy_deferred(const copy_options *options, const char *path)
+{
+    gchar *parent = g_strdup(path);
+    gboolean deferred = FALSE;
+    gchar *separator;
+
+    do {
+        deferred = matches_defer(options, parent);
+        separator = strrchr(parent, '/');
+        if (separator != NULL)
+            *separator = '\0';
+    } while (!deferred && separator != NULL);
+
+    g_free(parent);
+    return deferred;
+}
+
+// Background copy runs at idle priority unless a path was requested lately
+static void set_io_priority(copy_context *ctx)
+{
+    gboolean boosted;
+
+    if (!ctx->options->background)
+        return;
+
+    g_mutex_lock(&ctx->lock);
+    boosted = g_get_monotonic_time() < ctx->boost_until;
+    g_mutex_unlock(&ctx->lock);
+    // Applies to the calling thread only
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+            boosted ? IOPRIO_NORMAL : IOPRIO_IDLE);
+}
+
+// Holes of sparse files take no space and are not copied
+static guint64 data_size(const struct stat *st)
+{
+    return MIN((guint64)st->st_size, (guint64)st->st_blocks * 512);
+}
+
+// Target filesystem may not support all metadata, that is not an error
+static gboolean unsupported(int errnum)
+{
+    return errnum == ENOTSUP || errnum == EOPNOTSUPP;
+}
+
+static ssize_t list_xattrs(int fd, const char *path, char *list, size_t size)
+{
+    return fd >= 0 ? flistxattr(fd, list, size)
+                   : llistxattr(path, list, size);
+}
+
+static ssize_t get_xattr(
+        int fd,
+        const char *path,
+        const char *name,
+        void *value,
+        size_t size)
+{
+    return fd >= 0 ? fgetxattr(fd, name, value, size)
+                   : lgetxattr(path, name, value, size);
+}
+
+static int set_xattr(
+        int fd,
+        const char *path,
+        const char *name,
+        const void *value,
+        size_t size)
+{
+    return fd >= 0 ? fsetxattr(fd, name, value, size, 0)
+                   : lsetxattr(path, name, value, size, 0);
+}
+
+/*
+ * Copies all extended attributes. Either file descriptors or paths are
+ * used, paths are needed for symlinks and special files. Access ACLs and
+ * default ACLs are system.posix_acl_* attributes so they come along.
+ */
+static gboolean copy_xattrs(
+        copy_context *ctx,
+        int source_fd,
+        const char *source,
+        int target_fd,
+        const char *target)
+{
+    gchar *list;
+    gchar *name;
+    gchar *value;
+    ssize_t size;
+    ssize_t value_size;
+    gboolean success = TRUE;
+
+    size = list_xattrs(source_fd, source, NULL, 0);
+    if (size <= 0) {
+        if (size < 0 && !unsupported(errno)) {
+            report(ctx, source, NULL, "listxattr", errno);
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    list = g_malloc(size);
+    size = list_xattrs(source_fd, source, list, size);
+    if (size < 0) {
+        report(ctx, source, NULL, "listxattr", errno);
+        size = 0;
+        success = FALSE;
+    }
+
+    for (name = list; name < list + size; name += strlen(name) + 1) {
+        value_size = get_xattr(source_fd, source, name, NULL, 0);
+        if (value_size < 0) {
+            report(ctx, source, NULL, "getxattr", errno);
+            success = FALSE;
+            continue;
+        }
+
+        value = g_malloc(value_size + 1);
+        value_size = get_xattr(source_fd, source, name, value, value_size);
+        if (value_size < 0) {
+            report(ctx, source, NULL, "getxattr", errno);
+            success = FALSE;
+        } else if (set_xattr(target_fd, target, name, value, value_size) < 0
+                   && !unsupported(errno)) {
+            report(ctx, source, NULL, "setxattr", errno);
+            success = FALSE;
+        }
+        g_free(value);
+    }
+    g_free(list);
+    return success;
+}
+
+// Mode is set after ownership because chown clears setuid and setgid bits
+static gboolean copy_metadata(
+        copy_context *ctx,
+        int source_fd,
+        int target_fd,
+        const struct stat *st,
+        const char *path)
+{
+    const struct timespec times[2] = { st->st_atim, st->st_mtim };
+    gboolean success = TRUE;
+
+    if (fchown(target_fd, st->st_uid, st->st_gid) < 0 && !unsupported(errno)) {
+        report(ctx, path, NULL, "chown", errno);
+        success = FALSE;
+    }
+    if (fchmod(target_fd, st->st_mode & 07777) < 0 && !unsupported(errno)) {
+        report(ctx, path, NULL, "chmod", errno);
+        success = FALSE;
+    }
+    if (!copy_xattrs(ctx, source_fd, NULL, target_fd, NULL))
+        success = FALSE;
+    if (futimens(target_fd, times) < 0) {
+        report(ctx, path, NULL, "utimens", errno);
+        success = FALSE;
+    }
+    return success;
+}
+
+// Same for symlinks and special files which can not be opened
+static void copy_metadata_at(
+        copy_context *ctx,
+        dir_node *node,
+        int target_dir,
+        const char *name,
+        const struct stat *st)
+{
+    const struct timespec times[2] = { st->st_atim, st->st_mtim };
+    gchar *source = g_build_filename(node->source, name, NULL);
+    gchar *target = g_build_filename(node->target, name, NULL);
+
+    if (fchownat(target_dir, name, st->st_uid, st->st_gid,
+                 AT_SYMLINK_NOFOLLOW) < 0 && !unsupported(errno))
+        report(ctx, source, NULL, "chown", errno);
+    if (!S_ISLNK(st->st_mode)
+            && fchmodat(target_dir, name, st->st_mode & 07777, 0) < 0
+            && !unsupported(errno))
+        report(ctx, source, NULL, "chmod", errno);
+    copy_xattrs(ctx, -1, source, -1, target);
+    if (utimensat(target_dir, name, times, AT_SYMLINK_NOFOLLOW) < 0)
+        report(ctx, source, NULL, "utimens", errno);
+
+    g_free(source);
+    g_free(target);
+}
+
+static gboolean can_fall_back(int errnum)
+{
+    return errnum == EXDEV || errnum == ENOSYS || errnum == EINVAL
+            || errnum == EOPNOTSUPP || errnum == ENOTSUP;
+}
+
+void copy_release_pages(int in, int out, copy_pages *pages, gboolean last)
+{
+    off_t length = pages->position - pages->writeback;
+
+    if (length < CHUNK_SIZE && !(last && length > 0))
+        return;
+
+    if (in >= 0)
+        posix_fadvise(in, pages->writeback, length, POSIX_FADV_DONTNEED);
+    if (out >= 0) {
+        // Waits for the earlier window while the new one is written
+        if (pages->writeback > pages->released) {
+            sync_file_range(out, pages->released,
+                            pages->writeback - pages->released,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                            | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(out, pages->released,
+                          pages->writeback - pages->released,
+                          POSIX_FADV_DONTNEED);
+        }
+        sync_file_range(out, pages->writeback, length, SYNC_FILE_RANGE_WRITE);
+    }
+    pages->released = pages->writeback;
+    pages->writeback = pages->position;
+}
+
+// Pages of tmpfs and ramfs are the data itself
+static gboolean in_memory(const char *path)
+{
+    struct statfs fs;
+
+    return statfs(path, &fs) == 0
+            && (fs.f_type == TMPFS_MAGIC || fs.f_type == RAMFS_MAGIC);
+}
+
+static ssize_t read_write(
+        int in,
+        int out,
+        gchar **buffer,
+        size_t size,
+        checksum *hash)
+{
+    ssize_t length;
+    ssize_t written;
+    ssize_t done = 0;
+
+    if (*buffer == NULL)
+        *buffer = g_malloc(BUFFER_SIZE);
+
+    length = read(in, *buffer, MIN(size, BUFFER_SIZE));
+    if (length > 0 && hash != NULL)
+        checksum_update(hash, *buffer, length);
+    while (length > 0 && done < length) {
+        written = write(out, *buffer + done, length - done);
+        if (written < 0 && errno != EINTR)
+            return -1;
+        if (written > 0)
+            done += written;
+    }
+    return length;
+}
+
+/*
+ * Copies up to size bytes or until end of file. Both copy_file_range and
+ * sendfile move the file offsets, so a file can fall back to a slower
+ * method in the middle. Methods that are missing altogether are not tried
+ * again for other files. Data passes through the buffer when it is
+ * checksummed.
+ */
+static gboolean copy_range(
+        copy_context *ctx,
+        int in,
+        int out,
+        guint64 size,
+        guint64 *bytes,
+        copy_pages *pages,
+        checksum *hash)
+{
+    copy_method method = hash ? COPY_READ_WRITE
+                              : g_atomic_int_get(&ctx->method);
+    gchar *buffer = NULL;
+    gboolean success = FALSE;
+    size_t chunk;
+    ssize_t length;
+
+    for (;;) {
+        chunk = MIN(size, CHUNK_SIZE);
+        if (g_atomic_int_get(&ctx->stopped)) {
+            errno = ENOMEM;
+            break;
+        } else if (chunk == 0)
+            length = 0;
+        else if (method == COPY_FILE_RANGE)
+            length = copy_file_range(in, NULL, out, NULL, chunk, 0);
+        else if (method == COPY_SENDFILE)
+            length = sendfile(out, in, NULL, chunk);
+        else
+            length = read_write(in, out, &buffer, chunk, hash);
+
+        if (length == 0) {
+            success = TRUE;
+            break;
+        } else if (length > 0) {
+            size -= length;
+            *bytes += length;
+            add_progress(ctx, 0, length);
+            pages->position += length;
+            copy_release_pages(in, ctx->writeback ? out : -1, pages, FALSE);
+        } else if (errno == EINTR) {
+            continue;
+        } else if (method != COPY_READ_WRITE && can_fall_back(errno)) {
+            if (errno == ENOSYS || errno == EXDEV)
+                g_atomic_int_set(&ctx->method, method + 1);
+            method++;
+        } else {
+            break;
+        }
+    }
+
+    g_free(buffer);
+    return success;
+}
+
+// Fewer blocks than the size needs means that the file has holes
+static gboolean is_sparse(const struct stat *st)
+{
+    return data_size(st) < (guint64)st->st_size;
+}
+
+/*
+ * Copies only the data extents of a sparse file, so its holes stay holes
+ * in the target. Holes are hashed as zeros like they read. Returns FALSE
+ * with errno set to EINVAL if the filesystem can not tell the holes.
+ */
+static gboolean copy_sparse(
+        copy_context *ctx,
+        int in,
+        int out,
+        const struct stat *st,
+        guint64 *bytes,
+        copy_pages *pages,
+        checksum *hash)
+{
+    off_t position = 0;
+    off_t data;
+    off_t hole;
+
+    for (;;) {
+        data = lseek(in, position, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            break;
+        hole = data < 0 ? -1 : lseek(in, data, SEEK_HOLE);
+        if (hole < 0)
+            return FALSE;
+
+        if (hash != NULL)
+            checksum_update_zeros(hash, data - position);
+        pages->position = data;
+        if (lseek(in, data, SEEK_SET) < 0 || lseek(out, data, SEEK_SET) < 0
+                || !copy_range(ctx, in, out, hole - data, bytes, pages, hash))
+            return FALSE;
+        position = hole;
+    }
+
+    if (hash != NULL && st->st_size > position)
+        checksum_update_zeros(hash, st->st_size - position);
+    return ftruncate(out, st->st_size) == 0;
+}
+
+static gboolean copy_data(
+        copy_context *ctx,
+        int in,
+        int out,
+        const struct stat *st,
+        guint64 *bytes,
+        checksum *hash)
+{
+    copy_pages pages = { 0 };
+    gboolean success;
+    int errnum;
+
+    success = is_sparse(st) && copy_sparse(ctx, in, out, st, bytes, &pages,
+                                           hash);
+    // Nothing is written before holes are found
+    if (!success && (!is_sparse(st)
+                     || (errno == EINVAL && lseek(in, 0, SEEK_CUR) == 0)))
+        success = copy_range(ctx, in, out, G_MAXUINT64, bytes, &pages, hash);
+    errnum = errno;
+    copy_release_pages(in, ctx->writeback ? out : -1, &pages, TRUE);
+    errno = errnum;
+    return success;
+}
+
+// Like cp --force, an existing target that can not be opened is replaced
+static int create_file(int target_dir, const char *name)
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
+    int fd = openat(target_dir, name, flags, 0600);
+
+    if (fd < 0 && errno != ENOENT && unlinkat(target_dir, name, 0) == 0)
+        fd = openat(target_dir, name, flags | O_EXCL, 0600);
+    return fd;
+}
+
+/*
+ * Paths of a file with several links are linked to the copy of the first
+ * path, so links that span directories stay links in the target. Returns
+ * FALSE if path is the first one or the target filesystem has no links,
+ * then the file is copied.
+ */
+static gboolean link_file(
+        copy_context *ctx,
+        dir_node *node,
+        int target_dir,
+        const char *name,
+        const char *relative,
+        const struct stat *st,
+        copy_stats *stats)
+{
+    inode_key key = { st->st_dev, st->st_ino };
+    struct stat existing;
+    struct stat target;
+    link_entry *first;
+    gchar *checksum;
+
+    g_mutex_lock(&ctx->lock);
+    first = g_hash_table_lookup(ctx->links, &key);
+    if (first == NULL) {
+        first = g_new0(link_entry, 1);
+        first->key = key;
+        first->target = g_build_filename(node->target, name, NULL);
+        first->path = g_strdup(relative);
+        g_hash_table_insert(ctx->links, &first->key, first);
+    }
+    g_mutex_unlock(&ctx->lock);
+
+    // First copy may have failed or not be created yet
+    if (!strcmp(first->path, relative) || stat(first->target, &target) < 0)
+        return FALSE;
+
+    if (fstatat(target_dir, name, &existing, AT_SYMLINK_NOFOLLOW) == 0) {
+        if (existing.st_dev == target.st_dev
+                && existing.st_ino == target.st_ino)
+            goto linked;
+        if (unlinkat(target_dir, name, 0) < 0) {
+            report(ctx, node->source, name, "unlink", errno);
+            return TRUE;
+        }
+    }
+
+    if (linkat(AT_FDCWD, first->target, target_dir, name, 0) < 0) {
+        if (errno == EPERM || errno == EMLINK || unsupported(errno))
+            return FALSE;
+        report(ctx, node->source, name, "link", errno);
+        return TRUE;
+    }
+
+linked:
+    stats->files++;
+    add_progress(ctx, 1, 0);
+    // Entry of the first path is there unless it is still being copied
+    if (ctx->manifest != NULL) {
+        checksum = manifest_lookup(ctx->manifest, first->path, st);
+        if (checksum != NULL)
+            manifest_add(ctx->manifest, relative, st, &target, checksum);
+        g_free(checksum);
+    }
+    return TRUE;
+}
+
+static void copy_file(
+        copy_context *ctx,
+        dir_node *node,
+        int source_dir,
+        int target_dir,
+        const char *name,
+        const struct stat *st,
+        copy_stats *stats)
+{
+    char result[CHECKSUM_SIZE];
+    checksum *hash = NULL;
+    struct stat target;
+    gboolean success;
+    gchar *relative;
+    gchar *path;
+    int in;
+    int out;
+
+    set_io_priority(ctx);
+    relative = g_build_filename(node->path, name, NULL);
+    if (st->st_nlink > 1
+            && link_file(ctx, node, target_dir, name, relative, st, stats)) {
+        g_free(relative);
+        return;
+    }
+
+    if (ctx->manifest != NULL) {
+        if (fstatat(target_dir, name, &target, AT_SYMLINK_NOFOLLOW) == 0
+                && S_ISREG(target.st_mode)
+                && manifest_unchanged(ctx->manifest, relative, st, &target)) {
+            stats->skipped++;
+            add_progress(ctx, 1, data_size(st));
+            g_free(relative);
+            return;
+        }
+    }
+    if (ctx->manifest != NULL || ctx->expected != NULL)
+        hash = checksum_new();
+
+    in = openat(source_dir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in < 0) {
+        report(ctx, node->source, name, "open", errno);
+        goto out;
+    }
+
+    out = create_file(target_dir, name);
+    if (out < 0) {
+        report(ctx, node->source, name, "create", errno);
+        close(in);
+        goto out;
+    }
+
+    path = g_build_filename(node->source, name, NULL);
+    success = copy_data(ctx, in, out, st, &stats->bytes, hash);
+    if (!success)
+        report(ctx, path, NULL, "copy", errno);
+    else
+        stats->files++;
+    add_progress(ctx, 1, 0);
+    if (!copy_metadata(ctx, in, out, st, path))
+        success = FALSE;
+
+    if (hash != NULL) {
+        checksum_finish(hash, result);
+        hash = NULL;
+        // Source differs from what an earlier copy of it read
+        if (success && ctx->expected != NULL
+                && !verify_expected(ctx->expected, relative, st, result)) {
+            report(ctx, path, NULL, "verify", EBADMSG);
+            success = FALSE;
+        }
+        // Only a file that is complete with its metadata can be skipped later
+        if (success && ctx->manifest != NULL && fstat(out, &target) == 0)
+            manifest_add(ctx->manifest, relative, st, &target, result);
+    }
+
+    if (close(out) < 0)
+        report(ctx, path, NULL, "close", errno);
+    close(in);
+    g_free(path);
+
+out:
+    if (hash != NULL)
+        checksum_finish(hash, result);
+    g_free(relative);
+}
+
+static void copy_symlink(
+        copy_context *ctx,
+        dir_node *node,
+        int source_dir,
+        int target_dir,
+        const char *name,
+        const struct stat *st,
+        copy_stats *stats)
+{
+    char link[PATH_MAX];
+    ssize_t length;
+    int ret;
+
+    length = readlinkat(source_dir, name, link, sizeof(link) - 1);
+    if (length < 0) {
+        report(ctx, node->source, name, "readlink", errno);
+        return;
+    }
+    link[length] = '\0';
+
+    ret = symlinkat(link, target_dir, name);
+    if (ret < 0 && errno == EEXIST && unlinkat(target_dir, name, 0) == 0)
+        ret = symlinkat(link, target_dir, name);
+    if (ret < 0) {
+        report(ctx, node->source, name, "symlink", errno);
+        return;
+    }
+
+    stats->files++;
+    add_progress(ctx, 1, 0);
+    copy_metadata_at(ctx, node, target_dir, name, st);
+}
+
+static void copy_special(
+        copy_context *ctx,
+        dir_node *node,
+        int target_dir,
+        const char *name,
+        const struct stat *st,
+        copy_stats *stats)
+{
+    int ret = mknodat(target_dir, name, st->st_mode, st->st_rdev);
+
+    if (ret < 0 && errno == EEXIST && unlinkat(target_dir, name, 0) == 0)
+        ret = mknodat(target_dir, name, st->st_mode, st->st_rdev);
+    if (ret < 0) {
+        report(ctx, node->source, name, "mknod", errno);
+        return;
+    }
+
+    stats->files++;
+    add_progress(ctx, 1, 0);
+    copy_metadata_at(ctx, node, target_dir, name, st);
+}
+
+static gboolean make_directory(int target_dir, const char *name)
+{
+    struct stat st;
+
+    if (mkdirat(target_dir, name, 0700) == 0)
+        return TRUE;
+    if (errno != EEXIST)
+        return FALSE;
+    if (fstatat(target_dir, name, &st, AT_SYMLINK_NOFOLLOW) == 0
+            && S_ISDIR(st.st_mode))
+        return TRUE;
+    return unlinkat(target_dir, name, 0) == 0
+            && mkdirat(target_dir, name, 0700) == 0;
+}
+
+static void measure_entry(
+        int dir_fd,
+        const char *name,
+        const struct stat *st,
+        copy_size *size);
+
+/*
+ * Bytes left out are counted for the rule, in the deferred part only for
+ * entries of deferred directories to count them once.
+ */
+static gboolean excluded(
+        copy_context *ctx,
+        dir_node *node,
+        int dir_fd,
+        const char *name,
+        const struct stat *st)
+{
+    copy_size size = { 0 };
+    gchar *path;
+    gint rule;
+
+    if (node->parent == NULL && ctx->options->exclude != NULL
+            && g_strv_contains(ctx->options->exclude, name))
+        return TRUE;
+    if (ctx->options->rules == NULL)
+        return FALSE;
+
+    path = g_build_filename(node->path, name, NULL);
+    rule = exclusion_match(ctx->options->rules, path);
+    if (rule >= 0 && (ctx->options->part != COPY_PART_DEFERRED
+                      || node->deferred)) {
+        measure_entry(dir_fd, name, st, &size);
+        exclusion_add_saved(ctx->options->rules, rule, size.bytes);
+    }
+    g_free(path);
+    return rule >= 0;
+}
+
+static void apply_directory_metadata(copy_context *ctx, dir_node *node)
+{
+    int source_fd;
+    int target_fd;
+
+    source_fd = open(node->source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    target_fd = open(node->target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (source_fd < 0 || target_fd < 0)
+        report(ctx, node->source, NULL, "open", errno);
+    else
+        copy_metadata(ctx, source_fd, target_fd, &node->st, node->source);
+
+    if (source_fd >= 0)
+        close(source_fd);
+    if (target_fd >= 0)
+        close(target_fd);
+}
+
+static void free_node(dir_node *node)
+{
+    g_free(node->source);
+    g_free(node->target);
+    g_free(node->path);
+    g_free(node);
+}
+
+// Directory is complete when its own scan and all subdirectories are
+static void release_node(copy_context *ctx, dir_node *node)
+{
+    dir_node *parent;
+
+    while (node != NULL && g_atomic_int_dec_and_test(&node->pending)) {
+        if (node->apply_metadata)
+            apply_directory_metadata(ctx, node);
+
+        parent = node->parent;
+        free_node(node);
+
+        if (parent == NULL) {
+            g_mutex_lock(&ctx->lock);
+            ctx->finished = TRUE;
+            g_cond_signal(&ctx->cond);
+            g_mutex_unlock(&ctx->lock);
+        }
+        node = parent;
+    }
+}
+
+/*
+ * Directories outside deferred ones are traversed for the deferred part
+ * only to find them, their metadata is left as the first part made it.
+ */
+static dir_node *new_node(
+        copy_context *ctx,
+        dir_node *parent,
+        const char *name,
+        const char *source,
+        const char *target,
+        const struct stat *st)
+{
+    dir_node *node = g_new0(dir_node, 1);
+
+    node->parent = parent;
+    node->source = g_strdup(source);
+    node->target = g_strdup(target);
+    node->path = parent ? g_build_filename(parent->path, name, NULL)
+                        : g_strdup("");
+    node->st = *st;
+    node->pending = 1;
+    node->deferred = parent != NULL && (parent->deferred
+            || matches_defer(ctx->options, node->path));
+    node->apply_metadata = node->deferred
+            || ctx->options->part != COPY_PART_DEFERRED;
+    return node;
+}
+
+static gboolean is_wanted(copy_context *ctx, dir_node *node)
+{
+    gsize length = strlen(node->path);
+    const char *path;
+    gboolean wanted = FALSE;
+    guint i;
+
+    g_mutex_lock(&ctx->lock);
+    for (i = 0; i < ctx->wanted->len && !wanted; i++) {
+        path = g_ptr_array_index(ctx->wanted, i);
+        // Requested path is in the directory or the directory in it
+        wanted = g_str_has_prefix(path, node->path)
+                ? path[length] == '\0' || path[length] == '/'
+                : g_str_has_prefix(node->path, path)
+                  && node->path[strlen(path)] == '/';
+    }
+    g_mutex_unlock(&ctx->lock);
+    return wanted;
+}
+
+static gint compare_nodes(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    copy_context *ctx = user_data;
+
+    return is_wanted(ctx, (dir_node *)b) - is_wanted(ctx, (dir_node *)a);
+}
+
+/*
+ * Paths are relative to the top of the tree or absolute in the target.
+ * Queued directories are sorted again to have the requested ones first.
+ */
+static void add_request(copy_context *ctx, const char *path)
+{
+    gsize length = strlen(ctx->target);
+
+    if (g_str_has_prefix(path, ctx->target) && path[length] == '/')
+        path += length + 1;
+    else if (path[0] == '/')
+        return;
+
+    printf("Copying %s first\n", path);
+    g_mutex_lock(&ctx->lock);
+    g_ptr_array_add(ctx->wanted, g_strdup(path));
+    ctx->boost_until = g_get_monotonic_time() + PRIORITY_BOOST_TIME;
+    g_mutex_unlock(&ctx->lock);
+    g_thread_pool_set_sort_function(ctx->pool, compare_nodes, ctx);
+}
+
+static gboolean is_finished(copy_context *ctx)
+{
+    gboolean finished;
+
+    g_mutex_lock(&ctx->lock);
+    finished = ctx->finished;
+    g_mutex_unlock(&ctx->lock);
+    return finished;
+}
+
+// Requests are lines of paths, until the copy is finished
+static gpointer read_requests(gpointer user_data)
+{
+    copy_context *ctx = user_data;
+    struct pollfd fds = { ctx->options->request_fd, POLLIN, 0 };
+    GString *requests = g_string_new(NULL);
+    char buffer[PATH_MAX];
+    gchar *newline;
+    ssize_t length;
+
+    while (!is_finished(ctx)) {
+        if (poll(&fds, 1, REQUEST_POLL_TIMEOUT) <= 0)
+            continue;
+        length = read(fds.fd, buffer, sizeof(buffer));
+        if (length < 0 && errno == EINTR)
+            continue;
+        if (length <= 0)
+            break;
+
+        g_string_append_len(requests, buffer, length);
+        while ((newline = strchr(requests->str, '\n')) != NULL) {
+            *newline = '\0';
+            if (requests->str[0] != '\0')
+                add_request(ctx, requests->str);
+            g_string_erase(requests, 0, newline - requests->str + 1);
+        }
+    }
+
+    g_string_free(requests, TRUE);
+    return NULL;
+}
+
+static void scan_directory(gpointer data, gpointer user_data)
+{
+    dir_node *node = data;
+    copy_context *ctx = user_data;
+    copy_part part = ctx->options->part;
+    copy_stats stats = { 0 };
+    struct dirent *entry;
+    struct stat st;
+    dir_node *child;
+    gchar *source;
+    gchar *target;
+    DIR *dir;
+    int source_dir;
+    int target_dir;
+
+    set_io_priority(ctx);
+    source_dir = open(node->source,
+                      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    target_dir = open(node->target,
+                      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    dir = source_dir >= 0 ? fdopendir(source_dir) : NULL;
+    if (dir == NULL || target_dir < 0) {
+        report(ctx, node->source, NULL, "open", errno);
+        if (dir == NULL && source_dir >= 0)
+            close(source_dir);
+        goto out;
+    }
+
+    stats.directories++;
+    while ((entry = readdir(dir)) != NULL) {
+        if (g_atomic_int_get(&ctx->stopped))
+            break;
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+
+        if (fstatat(source_dir, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            report(ctx, node->source, entry->d_name, "stat", errno);
+            continue;
+        }
+        if (excluded(ctx, node, source_dir, entry->d_name, &st))
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            source = g_build_filename(node->source, entry->d_name, NULL);
+            target = g_build_filename(node->target, entry->d_name, NULL);
+            child = new_node(ctx, node, entry->d_name, source, target, &st);
+            g_free(source);
+            g_free(target);
+            if (part == COPY_PART_FIRST && child->deferred) {
+                free_node(child);
+                continue;
+            }
+            if (!make_directory(target_dir, entry->d_name)) {
+                report(ctx, node->source, entry->d_name, "mkdir", errno);
+                free_node(child);
+                continue;
+            }
+            g_atomic_int_inc(&node->pending);
+            g_thread_pool_push(ctx->pool, child, NULL);
+        } else if (part == COPY_PART_DEFERRED && !node->deferred) {
+            continue;
+        } else if (S_ISREG(st.st_mode)) {
+            copy_file(ctx, node, source_dir, target_dir, entry->d_name, &st,
+                      &stats);
+        } else if (S_ISLNK(st.st_mode)) {
+            copy_symlink(ctx, node, source_dir, target_dir, entry->d_name,
+                         &st, &stats);
+        } else {
+            copy_special(ctx, node, target_dir, entry->d_name, &st, &stats);
+        }
+    }
+
+out:
+    if (dir != NULL)
+        closedir(dir);
+    if (target_dir >= 0)
+        close(target_dir);
+
+    g_mutex_lock(&ctx->lock);
+    ctx->stats.files += stats.files;
+    ctx->stats.directories += stats.directories;
+    ctx->stats.bytes += stats.bytes;
+    ctx->stats.skipped += stats.skipped;
+    g_mutex_unlock(&ctx->lock);
+
+    release_node(ctx, node);
+}
+
+/*
+ * Files that were copied earlier but are gone from the source are removed
+ * from the target too. That is done only after a complete copy, because
+ * a directory that could not be read would look empty.
+ */
+static void close_manifest(copy_context *ctx, const char *target)
+{
+    gboolean complete = ctx->stats.errors == 0
+            && ctx->options->part == COPY_PART_ALL;
+    GPtrArray *unseen;
+    gchar *path;
+    guint i;
+
+    if (complete) {
+        unseen = manifest_take_unseen(ctx->manifest);
+        for (i = 0; i < unseen->len; i++) {
+            path = g_build_filename(target, g_ptr_array_index(unseen, i), NULL);
+            if (unlink(path) < 0 && errno != ENOENT)
+                report(ctx, path, NULL, "unlink", errno);
+            g_free(path);
+        }
+        g_ptr_array_unref(unseen);
+    }
+
+    manifest_close(ctx->manifest, complete);
+    ctx->manifest = NULL;
+}
+
+/*
+ * Accounts like copy_tree() copies: each inode once, holes of sparse
+ * files left out and data rounded up to whole blocks.
+ */
+static void measure_directory(
+        int dir_fd,
+        const char *path,
+        gboolean deferred,
+        const copy_options *options,
+        GHashTable *inodes,
+        copy_size *size)
+{
+    DIR *dir = fdopendir(dir_fd);
+    struct dirent *entry;
+    gboolean child_deferred;
+    inode_key *key;
+    struct stat st;
+    gchar *child;
+    int fd;
+
+    if (dir == NULL) {
+        close(dir_fd);
+        return;
+    }
+
+    size->space += SPACE_BLOCK_SIZE;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")
+                || (path[0] == '\0' && options->exclude
+                    && g_strv_contains(options->exclude, entry->d_name)))
+            continue;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+
+        child = path[0] ? g_build_filename(path, entry->d_name, NULL)
+                        : g_strdup(entry->d_name);
+        if (exclusion_match(options->rules, child) >= 0) {
+            g_free(child);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            child_deferred = deferred || matches_defer(options, child);
+            fd = options->part == COPY_PART_FIRST && child_deferred ? -1
+                    : openat(dirfd(dir), entry->d_name,
+                             O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0)
+                measure_directory(fd, child, child_deferred, options, inodes,
+                                  size);
+            g_free(child);
+            continue;
+        }
+        g_free(child);
+
+        if (options->part == COPY_PART_DEFERRED && !deferred)
+            continue;
+        size->files++;
+        if (!S_ISREG(st.st_mode))
+            continue;
+        if (st.st_nlink > 1) {
+            key = g_new(inode_key, 1);
+            key->dev = st.st_dev;
+            key->ino = st.st_ino;
+            if (!g_hash_table_add(inodes, key))
+                continue;
+        }
+        size->bytes += data_size(&st);
+        size->space += (data_size(&st) + SPACE_BLOCK_SIZE - 1)
+                / SPACE_BLOCK_SIZE * SPACE_BLOCK_SIZE;
+    }
+    closedir(dir);
+}
+
+// Size of an entry with everything below it
+static void measure_entry(
+        int dir_fd,
+        const char *name,
+        const struct stat *st,
+        copy_size *size)
+{
+    copy_options all = { 0 };
+    GHashTable *inodes;
+    int fd;
+
+    if (!S_ISDIR(st->st_mode)) {
+        size->files++;
+        if (S_ISREG(st->st_mode))
+            size->bytes += data_size(st);
+        return;
+    }
+
+    fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    inodes = g_hash_table_new_full(inode_hash, inode_equal, g_free, NULL);
+    measure_directory(fd, "", FALSE, &all, inodes, size);
+    g_hash_table_unref(inodes);
+}
+
+static guint thread_count(const copy_options *options)
+{
+    if (options->threads > 0)
+        return options->threads;
+    return CLAMP(g_get_num_processors(), MIN_THREADS, MAX_THREADS);
+}
+
+static void add_size(copy_size *to, const copy_size *size)
+{
+    to->files += size->files;
+    to->bytes += size->bytes;
+    to->space += size->space;
+}
+
+// Size of the top level entry of name, created on first use
+static copy_size *entry_size(size_context *ctx, const char *name)
+{
+    copy_size *size;
+
+    g_mutex_lock(&ctx->lock);
+    size = g_hash_table_lookup(ctx->scan->entries, name);
+    if (size == NULL) {
+        size = g_new0(copy_size, 1);
+        g_hash_table_insert(ctx->scan->entries, g_strdup(name), size);
+    }
+    g_mutex_unlock(&ctx->lock);
+    return size;
+}
+
+static void push_size_node(
+        size_context *ctx,
+        gchar *path,
+        gboolean deferred,
+        copy_size *entry)
+{
+    size_node *node = g_new(size_node, 1);
+
+    node->path = path;
+    node->deferred = deferred;
+    node->entry = entry;
+    g_mutex_lock(&ctx->lock);
+    ctx->pending++;
+    g_mutex_unlock(&ctx->lock);
+    g_thread_pool_push(ctx->pool, node, NULL);
+}
+
+// Measures files of one directory, subdirectories are queued to the pool
+static void size_directory(gpointer data, gpointer user_data)
+{
+    size_node *node = data;
+    size_context *ctx = user_data;
+    const copy_options *options = ctx->options;
+    copy_size size = { 0 };
+    copy_size file;
+    struct dirent *entry;
+    copy_size *entry_total;
+    gboolean child_deferred;
+    inode_key *key;
+    gboolean added;
+    struct stat st;
+    DIR *dir = NULL;
+    gchar *child;
+    int fd;
+
+    fd = node->path[0] ? openat(ctx->source_fd, node->path,
+                                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+                       : dup(ctx->source_fd);
+    if (fd >= 0)
+        dir = fdopendir(fd);
+    if (dir == NULL) {
+        if (fd >= 0)
+            close(fd);
+        goto out;
+    }
+    // Seek to the start in case of a dup of the source
+    rewinddir(dir);
+
+    size.space += SPACE_BLOCK_SIZE;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")
+                || (node->path[0] == '\0' && options->exclude
+                    && g_strv_contains(options->exclude, entry->d_name)))
+            continue;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+
+        child = node->path[0] ? g_build_filename(node->path, entry->d_name,
+                                                 NULL)
+                              : g_strdup(entry->d_name);
+        if (exclusion_match(options->rules, child) >= 0) {
+            g_free(child);
+            continue;
+        }
+        entry_total = node->entry ? node->entry
+                : entry_size(ctx, entry->d_name);
+
+        if (S_ISDIR(st.st_mode)) {
+            child_deferred = node->deferred || matches_defer(options, child);
+            if (options->part == COPY_PART_FIRST && child_deferred)
+                g_free(child);
+            else
+                push_size_node(ctx, child, child_deferred, entry_total);
+            continue;
+        }
+        g_free(child);
+
+        if (options->part == COPY_PART_DEFERRED && !node->deferred)
+            continue;
+        memset(&file, 0, sizeof(file));
+        file.files = 1;
+        if (S_ISREG(st.st_mode)) {
+            added = TRUE;
+            if (st.st_nlink > 1) {
+                key = g_new(inode_key, 1);
+                key->dev = st.st_dev;
+                key->ino = st.st_ino;
+                g_mutex_lock(&ctx->lock);
+                added = g_hash_table_add(ctx->inodes, key);
+                g_mutex_unlock(&ctx->lock);
+            }
+            if (added) {
+                file.bytes = data_size(&st);
+                file.space = (data_size(&st) + SPACE_BLOCK_SIZE - 1)
+                        / SPACE_BLOCK_SIZE * SPACE_BLOCK_SIZE;
+            }
+        }
+
+        // Files at the top are entries of their own
+        if (node->entry == NULL) {
+            g_mutex_lock(&ctx->lock);
+            add_size(entry_total, &file);
+            add_size(&ctx->scan->total, &file);
+            g_mutex_unlock(&ctx->lock);
+        } else {
+            add_size(&size, &file);
+        }
+    }
+    closedir(dir);
+
+out:
+    g_mutex_lock(&ctx->lock);
+    if (node->entry != NULL)
+        add_size(node->entry, &size);
+    add_size(&ctx->scan->total, &size);
+    if (--ctx->pending == 0)
+        g_cond_signal(&ctx->cond);
+    g_mutex_unlock(&ctx->lock);
+    g_free(node->path);
+    g_free(node);
+}
+
+void copy_scan_tree(
+        const char *source,
+        const copy_options *options,
+        copy_scan *scan)
+{
+    size_context ctx = { 0 };
+    gchar *key = NULL;
+
+    memset(scan, 0, sizeof(*scan));
+    scan->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                          g_free);
+    if (options->size_cache != NULL) {
+        key = size_cache_key(source, options);
+        if (size_cache_load(options->size_cache, key, scan)) {
+            g_free(key);
+            return;
+        }
+    }
+
+    ctx.options = options;
+    ctx.scan = scan;
+    ctx.source_fd = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ctx.source_fd < 0) {
+        g_free(key);
+        return;
+    }
+    ctx.inodes = g_hash_table_new_full(inode_hash, inode_equal, g_free, NULL);
+    g_mutex_init(&ctx.lock);
+    g_cond_init(&ctx.cond);
+    ctx.pool = g_thread_pool_new(size_directory, &ctx, thread_count(options),
+                                 FALSE, NULL);
+
+    if (ctx.pool != NULL) {
+        push_size_node(&ctx, g_strdup(""), FALSE, NULL);
+        g_mutex_lock(&ctx.lock);
+        while (ctx.pending > 0)
+            g_cond_wait(&ctx.cond, &ctx.lock);
+        g_mutex_unlock(&ctx.lock);
+        g_thread_pool_free(ctx.pool, FALSE, TRUE);
+        if (key != NULL)
+            size_cache_save(options->size_cache, key, source, scan);
+    }
+
+    g_cond_clear(&ctx.cond);
+    g_mutex_clear(&ctx.lock);
+    g_hash_table_unref(ctx.inodes);
+    close(ctx.source_fd);
+    g_free(key);
+}
+
+void copy_scan_clear(copy_scan *scan)
+{
+    if (scan->entries != NULL)
+        g_hash_table_unref(scan->entries);
+    scan->entries = NULL;
+}
+
+void copy_measure(
+        const char *source,
+        const copy_options *options,
+        copy_size *size)
+{
+    copy_scan scan;
+
+    copy_scan_tree(source, options, &scan);
+    *size = scan.total;
+    copy_scan_clear(&scan);
+}
+
+// Copy stops before memory gets short for the rest of the system
+static void check_memory(copy_context *ctx)
+{
+    memory_status status;
+
+    if (g_atomic_int_get(&ctx->stopped) || !memory_status_read(&status)
+            || !staging_critical(&status, ctx->reserve))
+        return;
+
+    fprintf(stderr, "Stopping, %" G_GUINT64_FORMAT " MiB of memory available "
+            "and %.1f%% of time stalled on memory\n", status.available >> 20,
+            status.full_avg10);
+    g_atomic_int_set(&ctx->stopped, TRUE);
+    report(ctx, ctx->target, NULL, "copy", ENOMEM);
+}
+
+gboolean copy_tree(
+        const char *source,
+        const char *target,
+        const copy_options *options,
+        copy_stats *stats)
+{
+    copy_context ctx = { 0 };
+    GError *error = NULL;
+    memory_status memory;
+    struct stat st;
+    GThread *requests = NULL;
+    copy_size size = { 0 };
+    dir_node *root;
+    gboolean created;
+
+    ctx.options = options;
+    ctx.target = target;
+    ctx.wanted = g_ptr_array_new_with_free_func(g_free);
+    ctx.links = g_hash_table_new_full(inode_hash, inode_equal, NULL,
+                                      link_entry_free);
+    g_mutex_init(&ctx.lock);
+    g_cond_init(&ctx.cond);
+
+    if (stat(source, &st) < 0) {
+        report(&ctx, source, NULL, "stat", errno);
+        goto out;
+    } else if (!S_ISDIR(st.st_mode)) {
+        report(&ctx, source, NULL, "stat", ENOTDIR);
+        goto out;
+    }
+
+    // Target that exists already, like a mount point, keeps its metadata
+    created = mkdir(target, 0700) == 0;
+    if (!created && errno != EEXIST) {
+        report(&ctx, target, NULL, "mkdir", errno);
+        goto out;
+    }
+    ctx.writeback = !in_memory(target);
+    if (options->watch_memory && memory_status_read(&memory))
+        ctx.reserve = staging_reserve(&memory);
+
+    if (options->manifest != NULL) {
+        ctx.manifest = manifest_open(options->manifest);
+        if (ctx.manifest == NULL) {
+            report(&ctx, options->manifest, NULL, "open", errno);
+            goto out;
+        }
+    }
+    if (options->expect != NULL) {
+        ctx.expected = manifest_load(options->expect);
+        if (ctx.expected == NULL) {
+            report(&ctx, options->expect, NULL, "open", errno);
+            goto out;
+        }
+    }
+
+    if (options->progress != NULL)
+        copy_measure(source, options, &size);
+    progress_init(&ctx.progress, options->progress, options->user_data,
+                  size.files, size.bytes);
+
+    ctx.pool = g_thread_pool_new(scan_directory, &ctx, thread_count(options),
+                                 FALSE, &error);
+    if (ctx.pool == NULL) {
+        report(&ctx, source, NULL, "thread pool", EAGAIN);
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        goto out;
+    }
+
+    root = new_node(&ctx, NULL, NULL, source, target, &st);
+    root->apply_metadata = created;
+    g_thread_pool_push(ctx.pool, root, NULL);
+    if (options->request_fd > 0)
+        requests = g_thread_new("requests", read_requests, &ctx);
+
+    g_mutex_lock(&ctx.lock);
+    while (!ctx.finished) {
+        if (!options->watch_memory) {
+            g_cond_wait(&ctx.cond, &ctx.lock);
+        } else if (!g_cond_wait_until(&ctx.cond, &ctx.lock,
+                                      g_get_monotonic_time()
+                                      + MEMORY_CHECK_INTERVAL)) {
+            g_mutex_unlock(&ctx.lock);
+            check_memory(&ctx);
+            g_mutex_lock(&ctx.lock);
+        }
+    }
+    g_mutex_unlock(&ctx.lock);
+    ctx.stats.stopped = ctx.stopped;
+    if (requests != NULL)
+        g_thread_join(requests);
+    g_thread_pool_free(ctx.pool, FALSE, TRUE);
+    progress_finish(&ctx.progress);
+
+    // Failed copy is not worth reading back
+    if (options->verify && ctx.manifest != NULL && ctx.stats.errors == 0)
+        verify_tree(target, ctx.manifest, options, &ctx.stats);
+
+out:
+    if (ctx.expected != NULL)
+        manifest_close(ctx.expected, FALSE);
+    if (ctx.manifest != NULL)
+        close_manifest(&ctx, target);
+    if (stats != NULL)
+        *stats = ctx.stats;
+    g_hash_table_unref(ctx.links);
+    g_ptr_array_unref(ctx.wanted);
+    g_cond_clear(&ctx.cond);
+    g_mutex_clear(&ctx.lock);
+    return ctx.stats.errors == 0;
+}
+
+// vim: expandtab:ts=4:sw=4
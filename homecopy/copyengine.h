@@ -0,0 +1,202 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#ifndef __COPY_ENGINE_H
+#define __COPY_ENGINE_H
+
+#include <glib.h>
+#include <sys/types.h>
+#include "exclusion.h"
+#include "progress.h"
+
+/*
+ * Copies the contents of a directory tree with a pool of worker threads.
+ * Each directory is scanned by one worker and its subdirectories are
+ * queued for the others. File data is copied in the kernel when possible
+ * and ownership, mode, extended attributes (including ACLs) and
+ * timestamps are preserved. Directory metadata is applied once all of
+ * its contents are copied. Holes of sparse files are kept and paths of a
+ * file with several links are linked to one copy, also across
+ * directories. Copied data does not stay in the page cache, see
+ * copy_release_pages(), so that a copy does not push out the data of
+ * tmpfs or other processes.
+ *
+ * With a manifest, the copy is incremental. Files that were completed by
+ * an earlier copy with the same manifest and have not changed since are
+ * skipped, and files that were removed from the source are removed from
+ * the target after a complete copy of all parts. With verify set, the
+ * files are read back after the copy and compared with the manifest, see
+ * verify.h. With an expected manifest of an earlier copy, like the one
+ * that made the source, source files are compared with it while they are
+ * copied.
+ *
+ * A tree can be copied in two parts, first without the directories that
+ * match the defer patterns and then only those. The deferred part can run
+ * in the background while the first part is in use. Paths requested
+ * through request_fd are copied before the rest of the queue. Links
+ * between the parts are not kept, the deferred part copies them as
+ * separate files.
+ *
+ * Failures do not stop the copy. Each one is passed to the error
+ * callback, which is called from the worker threads but never
+ * concurrently, and counted in the stats. The same goes for the
+ * progress callback, which is rate limited. Totals for progress are
+ * measured before copying.
+ */
+
+typedef enum {
+    COPY_PART_ALL,
+    // Tree without the deferred directories
+    COPY_PART_FIRST,
+    // Only the deferred directories
+    COPY_PART_DEFERRED
+} copy_part;
+
+typedef void (*copy_error_func)(
+        const char *path,
+        const char *operation,
+        int errnum,
+        gpointer user_data);
+
+typedef struct {
+    // Worker threads, 0 picks by the number of processors
+    guint threads;
+    // Names skipped at the top of the source tree, NULL terminated
+    const char * const *exclude;
+    // Rules for regenerable data to leave out or NULL, see exclusion.h
+    exclusion *rules;
+    // Manifest file of completed files or NULL, see manifest.h
+    const char *manifest;
+    // Manifest of the copy that made the source or NULL
+    const char *expect;
+    // Read the copy back, needs a manifest
+    gboolean verify;
+    // Patterns of relative paths of directories to copy separately
+    const char * const *defer;
+    copy_part part;
+    // Idle I/O priority, raised for a while when a path is requested
+    gboolean background;
+    // Requested paths are read from this as lines, 0 for none
+    int request_fd;
+    // Stop when memory gets short while staging in tmpfs, see staging.h
+    gboolean watch_memory;
+    // File of sizes measured earlier or NULL, see sizecache.h
+    const char *size_cache;
+    // Bytes per volume of an archive, 0 picks by its filesystem, see
+    // volumes.h
+    guint64 volume_size;
+    copy_error_func error;
+    copy_progress_func progress;
+    gpointer user_data;
+} copy_options;
+
+typedef struct {
+    guint64 files;
+    guint64 directories;
+    guint64 bytes;
+    // Files that were already copied
+    guint64 skipped;
+    // Files that were read back and matched
+    guint64 verified;
+    guint errors;
+    // Stopped to leave memory for the rest of the system
+    gboolean stopped;
+} copy_stats;
+
+typedef struct {
+    // Files other than directories
+    guint64 files;
+    // Data in regular files
+    guint64 bytes;
+    // Space taken in the target, in bytes of whole 4 KiB blocks
+    guint64 space;
+} copy_size;
+
+// Blocks until the tree is copied, returns TRUE if there were no errors
+gboolean copy_tree(
+        const char *source,
+        const char *target,
+        const copy_options *options,
+        copy_stats *stats);
+
+typedef struct {
+    copy_size total;
+    // Names of the entries at the top of the tree to their copy_size,
+    // like the home directories of users in /home
+    GHashTable *entries;
+} copy_scan;
+
+/*
+ * Measures what copy_tree() writes with options. A file with several
+ * links is counted once and holes of sparse files are not counted.
+ * Bytes left out by exclusion rules are not counted as saved here.
+ *
+ * The tree is walked once by options->threads, and the result is saved
+ * to and reused from options->size_cache. A file linked from several top
+ * level entries counts only in one of them.
+ */
+void copy_scan_tree(
+        const char *source,
+        const copy_options *options,
+        copy_scan *scan);
+void copy_scan_clear(copy_scan *scan);
+// Total of copy_scan_tree()
+void copy_measure(
+        const char *source,
+        const copy_options *options,
+        copy_size *size);
+/*
+ * Page cache window of a file that is being copied. Pages of the source
+ * are dropped once copied. Pages of the target are written back a window
+ * at a time and dropped when the next window is full, so each file being
+ * copied keeps at most two windows in the page cache. The target is not
+ * written back if out is -1, like for tmpfs where pages can not be
+ * dropped. Called with last set when the file is done.
+ */
+typedef struct {
+    // Offset up to which the file is copied
+    off_t position;
+    off_t released;
+    off_t writeback;
+} copy_pages;
+
+void copy_release_pages(int in, int out, copy_pages *pages, gboolean last);
+// TRUE if path or one of its parents matches options->defer
+gboolean copy_deferred(const copy_options *options, const char *path);
+
+#endif // __COPY_ENGINE_H
+
+// vim: expandtab:ts=4:sw=4
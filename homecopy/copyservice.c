@@ -38,12 +38,12 @@
 #include <glib.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <dbusaccess_policy.h>
-#include <dbusaccess_peer.h>
+#include "access.h"
+#include "clients.h"
+#include "copyservice.h"
+#include "holders.h"
 #include "homecopy.h"
 
-#define QUIT_TIMEOUT 60
-#define ACCESS_DENIED_ERROR "org.freedesktop.DBus.Error.AccessDenied"
 #define BUS_NAME "org.sailfishos.HomeCopyService"
 #define COPY_FAILED_ERROR BUS_NAME ".Failed"
 #define COPY_FAIL_CODE 1
@@ -52,14 +52,31 @@
 #define COPY_HOME_METHOD "copyHome"
 #define RESTORE_HOME_METHOD "restoreHome"
 #define SET_COPY_LOCATION_METHOD "setCopyDevice"
+#define CANCEL_COPY_METHOD "cancelCopy"
+#define GET_COPY_STATUS_METHOD "getCopyStatus"
+#define PRIORITIZE_RESTORE_METHOD "prioritizeRestore"
+#define GET_STALE_UNITS_METHOD "getStaleUnits"
 #define COPY_DONE_SIGNAL "copyDone"
+#define DEFERRED_RESTORE_DONE_SIGNAL "deferredRestoreDone"
+#define COPY_PROGRESS_SIGNAL "copyProgress"
 #define PRIVILEGED_ONLY_POLICY "1;group(privileged) = allow;"
 
+/*
+ * Bus and session infrastructure keeps the session itself running, a
+ * restart of any of these takes the session down with it.
+ */
+static const char * const never_restarted_units[] = {
+    "dbus.service",
+    "dbus.socket",
+    "dbus-broker.service",
+    "systemd-exit.service",
+    "home-restore-ui.service",
+    NULL
+};
+
 G_DEFINE_QUARK(copy-error-quark, copy_error)
 #define COPY_ERROR (copy_error_quark())
 
-static gboolean is_allowed(GDBusConnection *connection, const gchar *sender);
-
 static const gchar introspection_xml[] =
     "<node>"
     "<interface name=\"" SD_COPY_IFACE "\">"
@@ -70,18 +87,46 @@ static const gchar introspection_xml[] =
     "<method name=\"" SET_COPY_LOCATION_METHOD "\">"
     "<arg name=\"devpath\" direction=\"in\" type=\"s\"></arg>"
     "</method>"
+    "<method name=\"" CANCEL_COPY_METHOD "\">"
+    "</method>"
+    "<method name=\"" GET_COPY_STATUS_METHOD "\">"
+    "<arg name=\"copying\" direction=\"out\" type=\"b\"></arg>"
+    "<arg name=\"filesDone\" direction=\"out\" type=\"t\"></arg>"
+    "<arg name=\"filesTotal\" direction=\"out\" type=\"t\"></arg>"
+    "<arg name=\"bytesDone\" direction=\"out\" type=\"t\"></arg>"
+    "<arg name=\"bytesTotal\" direction=\"out\" type=\"t\"></arg>"
+    "<arg name=\"bytesPerSecond\" direction=\"out\" type=\"t\"></arg>"
+    "<arg name=\"secondsLeft\" direction=\"out\" type=\"x\"></arg>"
+    "</method>"
+    "<method name=\"" PRIORITIZE_RESTORE_METHOD "\">"
+    "<arg name=\"path\" direction=\"in\" type=\"s\"></arg>"
+    "</method>"
+    "<method name=\"" GET_STALE_UNITS_METHOD "\">"
+    "<arg name=\"units\" direction=\"out\" type=\"as\"></arg>"
+    "</method>"
     "<signal name=\"" COPY_DONE_SIGNAL "\">"
     "<arg name=\"success\" type=\"b\" />"
     "</signal>"
+    "<signal name=\"" DEFERRED_RESTORE_DONE_SIGNAL "\">"
+    "<arg name=\"success\" type=\"b\" />"
+    "</signal>"
+    "<signal name=\"" COPY_PROGRESS_SIGNAL "\">"
+    "<arg name=\"filesDone\" type=\"t\" />"
+    "<arg name=\"filesTotal\" type=\"t\" />"
+    "<arg name=\"bytesDone\" type=\"t\" />"
+    "<arg name=\"bytesTotal\" type=\"t\" />"
+    "<arg name=\"bytesPerSecond\" type=\"t\" />"
+    "<arg name=\"secondsLeft\" type=\"x\" />"
+    "</signal>"
     "</interface>"
     "</node>";
 
 static struct {
-    DAPolicy *policy;
     GDBusConnection *connection;
     GDBusNodeInfo *introspection_data;
     GDBusInterfaceVTable *iface_vtable;
     GMainLoop *main_loop;
+    guint owner_id;
 } data;
 
 static void on_bus_acquired(GDBusConnection *connection,
@@ -91,6 +136,7 @@ static void on_bus_acquired(GDBusConnection *connection,
     GError *error = NULL;
     guint iface_id;
     data.connection = connection;
+    access_init(connection, PRIVILEGED_ONLY_POLICY);
     iface_id = g_dbus_connection_register_object(
             data.connection, SD_COPY_PATH,
             g_dbus_node_info_lookup_interface(data.introspection_data, SD_COPY_IFACE),
@@ -104,28 +150,25 @@ static void on_bus_acquired(GDBusConnection *connection,
   }
 }
 
+void signal_deferred_result(copy_result res);
+void signal_copy_progress(const copy_progress *progress, gpointer user_data);
+
 static void on_name_acquired(GDBusConnection *connection,
                              const gchar     *name,
                              gpointer         user_data)
 {
     printf("Acquired dbus name %s\n", name);
+    // Restoration of deferred directories continues after a reboot
+    restore_deferred_home(data.main_loop, signal_deferred_result,
+                          signal_copy_progress);
 }
 
 static void on_name_lost(GDBusConnection *connection,
                          const gchar     *name,
                          gpointer         user_data)
 {
+    // Encryption service runs in the same process, keep it running
     fprintf(stderr, "Failed to own name %s \n", name);
-    exit(EXIT_FAILURE);
-}
-
-static gboolean quit_if_idle(gpointer user_data)
-{
-    if (get_copy_state() !=  COPYING) {
-        g_main_loop_quit(data.main_loop);
-        return FALSE;
-    }
-    return TRUE;
 }
 
 void signal_copy_result(copy_result res)
@@ -143,22 +186,137 @@ void signal_copy_result(copy_result res)
     }
 }
 
-static void handle_method_call(GDBusConnection       *connection,
-                               const gchar           *sender,
-                               const gchar           *object_path,
-                               const gchar           *interface_name,
-                               const gchar           *method_name,
-                               GVariant              *parameters,
-                               GDBusMethodInvocation *invocation,
-                               gpointer               user_data)
+void signal_deferred_result(copy_result res)
 {
+    GError *error = NULL;
+    if (!g_dbus_connection_emit_signal(data.connection,
+                                       NULL, SD_COPY_PATH,
+                                       SD_COPY_IFACE,
+                                       DEFERRED_RESTORE_DONE_SIGNAL,
+                                       g_variant_new("(b)", res == COPY_SUCCESS),
+                                       &error)) {
+        fprintf(stderr, "Failed to emit signal: %s \n", error->message);
+        g_error_free(error);
+    }
+}
+
+// Rate limited by the copy engine already
+void signal_copy_progress(const copy_progress *progress, gpointer user_data)
+{
+    GError *error = NULL;
+    if (!g_dbus_connection_emit_signal(data.connection,
+                                       NULL, SD_COPY_PATH,
+                                       SD_COPY_IFACE, COPY_PROGRESS_SIGNAL,
+                                       g_variant_new("(tttttx)",
+                                                     progress->files_done,
+                                                     progress->files_total,
+                                                     progress->bytes_done,
+                                                     progress->bytes_total,
+                                                     progress->bytes_per_second,
+                                                     progress->eta),
+                                       &error)) {
+        fprintf(stderr, "Failed to emit signal: %s \n", error->message);
+        g_error_free(error);
+    }
+}
+
+static void return_copy_status(GDBusMethodInvocation *invocation)
+{
+    copy_progress progress;
+    copy_state state = get_copy_progress(&progress);
+
+    g_dbus_method_invocation_return_value(
+            invocation, g_variant_new("(btttttx)", state == COPYING,
+                                      progress.files_done,
+                                      progress.files_total,
+                                      progress.bytes_done,
+                                      progress.bytes_total,
+                                      progress.bytes_per_second,
+                                      progress.eta));
+}
+
+static void got_stale_units(
+        GPtrArray *units,
+        gboolean restartable,
+        gpointer user_data)
+{
+    GDBusMethodInvocation *invocation = user_data;
+    GVariantBuilder builder;
+    holder_unit *unit;
+    guint i;
+
+    // Only units of the user session are for the caller to restart,
+    // units in scopes are skipped as they can not be restarted anyway
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("as"));
+    for (i = 0; i < units->len; i++) {
+        unit = g_ptr_array_index(units, i);
+        if (unit->manager != clients_get_systemd_manager() &&
+                !g_strv_contains(never_restarted_units, unit->name))
+            g_variant_builder_add(&builder, "s", unit->name);
+    }
+    g_ptr_array_unref(units);
+
+    g_dbus_method_invocation_return_value(
+            invocation, g_variant_new("(as)", &builder));
+}
+
+static void find_stale_units(gpointer user_data)
+{
+    // Restore writes to home only, opened and mapped files there are stale
+    static const char * const directories[] = { "/home", NULL };
+    GDBusMethodInvocation *invocation = user_data;
+    GDBusProxy *systemd_manager = clients_get_systemd_manager();
+
+    if (systemd_manager == NULL) {
+        g_dbus_method_invocation_return_dbus_error(invocation,
+                                                   COPY_FAILED_ERROR,
+                                                   "No systemd connection");
+        return;
+    }
+
+    find_holders(systemd_manager, directories, FALSE,
+                 got_stale_units, invocation);
+}
+
+static void handle_allowed_call(GDBusMethodInvocation *invocation,
+                                gpointer               user_data)
+{
+    const gchar *method_name = g_dbus_method_invocation_get_method_name(invocation);
+    GVariant *parameters = g_dbus_method_invocation_get_parameters(invocation);
     GVariantIter iter;
+    const gchar *path;
     gchar *copy_path;
     GError *error = NULL;
 
-    if (!is_allowed(connection, sender)) {
-        g_dbus_method_invocation_return_dbus_error(
-                invocation, ACCESS_DENIED_ERROR, "Access denied");
+    // These are answered also while copying
+    if (strcmp(method_name, GET_COPY_STATUS_METHOD) == 0) {
+        return_copy_status(invocation);
+        return;
+    } else if (strcmp(method_name, CANCEL_COPY_METHOD) == 0) {
+        if (cancel_copy()) {
+            g_dbus_method_invocation_return_value(invocation, NULL);
+        } else {
+            g_set_error_literal(&error, COPY_ERROR, COPY_FAIL_CODE,
+                                "No copy operation to cancel");
+            g_dbus_method_invocation_return_gerror(invocation, error);
+            g_error_free(error);
+        }
+        return;
+    } else if (strcmp(method_name, PRIORITIZE_RESTORE_METHOD) == 0) {
+        g_variant_iter_init(&iter, parameters);
+        g_variant_iter_next(&iter, "&s", &path);
+        if (prioritize_restore(path)) {
+            g_dbus_method_invocation_return_value(invocation, NULL);
+        } else {
+            g_set_error_literal(&error, COPY_ERROR, COPY_FAIL_CODE,
+                                "No deferred restoration for the path");
+            g_dbus_method_invocation_return_gerror(invocation, error);
+            g_error_free(error);
+        }
+        return;
+    } else if (strcmp(method_name, GET_STALE_UNITS_METHOD) == 0) {
+        // Deferred restoration is already running when this is asked
+        clients_wait(find_stale_units, invocation);
         return;
     }
 
@@ -170,14 +328,20 @@ static void handle_method_call(GDBusConnection       *connection,
         return;
     }
 
+    // Copy and restore report their result with copyDone
     if (strcmp(method_name, COPY_HOME_METHOD) == 0) {
-        copy_home(data.main_loop, signal_copy_result);
+        copy_home(data.main_loop, signal_copy_result, signal_copy_progress);
+        g_dbus_method_invocation_return_value(invocation, NULL);
     } else if (strcmp(method_name, RESTORE_HOME_METHOD) == 0) {
-        restore_home(data.main_loop, signal_copy_result);
+        restore_home(data.main_loop, signal_copy_result,
+                     signal_deferred_result, signal_copy_progress);
+        g_dbus_method_invocation_return_value(invocation, NULL);
     } else if (strcmp(method_name, SET_COPY_LOCATION_METHOD) == 0) {
         g_variant_iter_init(&iter, parameters);
         g_variant_iter_next(&iter, "s", &copy_path);
-        if (!set_copy_location(copy_path)) {
+        if (set_copy_location(copy_path)) {
+            g_dbus_method_invocation_return_value(invocation, NULL);
+        } else {
             g_set_error_literal(
                 &error, COPY_ERROR, COPY_FAIL_CODE,
                 "Setting copy location failed");
@@ -192,49 +356,41 @@ static void handle_method_call(GDBusConnection       *connection,
     }
 }
 
-static gboolean is_allowed(GDBusConnection *connection, const gchar *sender)
+static void handle_method_call(GDBusConnection       *connection,
+                               const gchar           *sender,
+                               const gchar           *object_path,
+                               const gchar           *interface_name,
+                               const gchar           *method_name,
+                               GVariant              *parameters,
+                               GDBusMethodInvocation *invocation,
+                               gpointer               user_data)
 {
-    DAPeer *peer;
-    data.policy = da_policy_new(PRIVILEGED_ONLY_POLICY);
-
-    peer = da_peer_get(DA_BUS_SYSTEM, sender);
-    if (peer == NULL)
-        return FALSE;
-
-    if (da_policy_check(
-            data.policy, &peer->cred, 0, NULL,
-            DA_ACCESS_DENY) == DA_ACCESS_DENY) {
-        return FALSE;
-    }
-
-    return TRUE;
+    access_check(invocation, handle_allowed_call, NULL);
 }
 
-int main(int argc, char **argv)
+void init_copy_service(GMainLoop *main_loop)
 {
-    setlinebuf(stdout);
-    data.main_loop = g_main_loop_new(NULL, FALSE);
+    data.main_loop = main_loop;
     data.introspection_data = g_dbus_node_info_new_for_xml(introspection_xml, NULL);
-    data.policy = da_policy_new(PRIVILEGED_ONLY_POLICY);
     g_assert(data.introspection_data != NULL);
 
     data.iface_vtable = g_new0(GDBusInterfaceVTable, 1);
     data.iface_vtable->method_call = handle_method_call;
 
-    guint owner_id = g_bus_own_name(G_BUS_TYPE_SYSTEM,
-                                    BUS_NAME,
-                                    G_BUS_NAME_OWNER_FLAGS_REPLACE,
-                                    on_bus_acquired,
-                                    on_name_acquired,
-                                    on_name_lost,
-                                    NULL,
-                                    NULL);
-
-    g_timeout_add_seconds(QUIT_TIMEOUT, quit_if_idle, NULL);
-    g_main_loop_run(data.main_loop);
-    g_bus_unown_name(owner_id);
+    data.owner_id = g_bus_own_name(G_BUS_TYPE_SYSTEM,
+                                   BUS_NAME,
+                                   G_BUS_NAME_OWNER_FLAGS_REPLACE,
+                                   on_bus_acquired,
+                                   on_name_acquired,
+                                   on_name_lost,
+                                   NULL,
+                                   NULL);
+}
+
+void cleanup_copy_service(void)
+{
+    g_bus_unown_name(data.owner_id);
     g_dbus_node_info_unref(data.introspection_data);
     g_free(data.iface_vtable);
-    return EXIT_SUCCESS;
 }
 
@@ -0,0 +1,355 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#include <getopt.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "copyengine.h"
+#include "homearchive.h"
+#include "staging.h"
+
+/*
+ * Command line front end of the copy engine for the home preparation,
+ * copy and restore scripts. Exits with 0 only if everything was copied.
+ */
+
+// Copying stopped to keep memory for the rest of the system
+#define EXIT_STOPPED 3
+
+typedef enum {
+    MODE_COPY,
+    MODE_ARCHIVE,
+    MODE_EXTRACT,
+    MODE_MEASURE,
+    MODE_PLAN
+} copy_mode;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [--archive [--volume-size MIB] | --extract] "
+            "[--exclude NAME]... "
+            "[--exclude-rules DIR]... "
+            "[--threads COUNT] [--manifest FILE [--verify]] [--expect FILE] "
+            "[--watch-memory] [--size-cache FILE] "
+            "[--defer PATTERN]... [--first | --deferred [--background] "
+            "[--request-fd FD]] [--progress-fd FD] SOURCE TARGET\n"
+            "Copies contents of SOURCE directory into TARGET directory.\n"
+            "Rules in DIR/*.conf leave out regenerable data, like caches.\n"
+            "With a manifest, copies only what changed since the last copy.\n"
+            "With --verify, reads the copy back and compares it with the\n"
+            "manifest. With --expect, compares SOURCE with the manifest of\n"
+            "the copy that made it.\n"
+            "With --archive, writes SOURCE into TARGET archive and with\n"
+            "--extract, extracts SOURCE archive into TARGET directory.\n"
+            "Archives are split into volumes TARGET.000, TARGET.001 and so\n"
+            "on of MIB each, by default only on FAT.\n"
+            "Directories matching a --defer pattern are copied last. With\n"
+            "--first, copies all but them and with --deferred, only them.\n"
+            "With --background, copies at idle I/O priority, except paths\n"
+            "read as lines from the request FD, which are copied first.\n"
+            "Progress is written to FD as lines of files done, files total,\n"
+            "bytes done, bytes total, bytes per second and seconds left.\n"
+            "With --watch-memory, stops copying with exit status 3 when the\n"
+            "system gets short of memory.\n"
+            "\n"
+            "Usage: %s --measure [--exclude NAME]... [--exclude-rules DIR]... "
+            "[--defer PATTERN]... "
+            "[--first | --deferred] [--size-cache FILE] SOURCE\n"
+            "Prints the space in KiB that a copy of SOURCE takes.\n"
+            "Sizes are kept in FILE for a while and reused by the next\n"
+            "measure of SOURCE with the same options, like for progress.\n"
+            "\n"
+            "Usage: %s --plan [--zram] [--exclude NAME]... "
+            "[--exclude-rules DIR]... [--size-cache FILE] "
+            "TARGET HOME USER_HOME...\n"
+            "Prints all, users or none, whether all of HOME, only USER_HOMEs\n"
+            "or nothing fits to TARGET without running out of memory.\n"
+            "With --zram, prints also zram and the device size in KiB if\n"
+            "more fits to a compressed zram device than to TARGET.\n",
+            name, name, name);
+}
+
+static void print_error(
+        const char *path,
+        const char *operation,
+        int errnum,
+        gpointer user_data)
+{
+    fprintf(stderr, "%s: %s failed: %s\n", path, operation, strerror(errnum));
+}
+
+static void print_progress(const copy_progress *progress, gpointer user_data)
+{
+    int fd = GPOINTER_TO_INT(user_data);
+
+    dprintf(fd, "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+            " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT
+            "\n", progress->files_done, progress->files_total,
+            progress->bytes_done, progress->bytes_total,
+            progress->bytes_per_second, progress->eta);
+}
+
+// Homes of users in HOME come from its scan, others are measured apart
+static guint64 user_size(
+        const char *home,
+        const char *user_home,
+        const copy_options *options,
+        const copy_scan *scan)
+{
+    gchar *parent = g_path_get_dirname(user_home);
+    gchar *name = g_path_get_basename(user_home);
+    gchar *canonical = g_canonicalize_filename(home, "/");
+    copy_size *entry;
+    copy_size size = { 0 };
+
+    if (!strcmp(parent, canonical)) {
+        entry = g_hash_table_lookup(scan->entries, name);
+        if (entry != NULL)
+            size = *entry;
+    } else {
+        copy_measure(user_home, options, &size);
+    }
+
+    g_free(canonical);
+    g_free(name);
+    g_free(parent);
+    return size.space;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "exclude", required_argument, NULL, 'e' },
+        { "exclude-rules", required_argument, NULL, 'R' },
+        { "threads", required_argument, NULL, 't' },
+        { "manifest", required_argument, NULL, 'm' },
+        { "verify", no_argument, NULL, 'v' },
+        { "expect", required_argument, NULL, 'E' },
+        { "archive", no_argument, NULL, 'a' },
+        { "extract", no_argument, NULL, 'x' },
+        { "volume-size", required_argument, NULL, 'V' },
+        { "measure", no_argument, NULL, 's' },
+        { "plan", no_argument, NULL, 'P' },
+        { "watch-memory", no_argument, NULL, 'w' },
+        { "zram", no_argument, NULL, 'z' },
+        { "size-cache", required_argument, NULL, 'C' },
+        { "defer", required_argument, NULL, 'D' },
+        { "first", no_argument, NULL, 'f' },
+        { "deferred", no_argument, NULL, 'd' },
+        { "background", no_argument, NULL, 'b' },
+        { "request-fd", required_argument, NULL, 'r' },
+        { "progress-fd", required_argument, NULL, 'p' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    GPtrArray *exclude = g_ptr_array_new();
+    GPtrArray *defer = g_ptr_array_new();
+    GPtrArray *rules = g_ptr_array_new();
+    copy_options options = { 0 };
+    copy_mode mode = MODE_COPY;
+    copy_stats stats = { 0 };
+    copy_size size;
+    copy_scan scan;
+    guint64 all_size;
+    guint64 users_size = 0;
+    gint64 started;
+    gboolean success;
+    staging_plan plan;
+    staging_plan zram_plan;
+    gboolean zram = FALSE;
+    int opt;
+    int i;
+
+    while ((opt = getopt_long(argc, argv, "e:R:t:m:vE:axV:sPwzC:D:fdbr:p:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'e':
+                g_ptr_array_add(exclude, optarg);
+                break;
+            case 'R':
+                g_ptr_array_add(rules, optarg);
+                break;
+            case 't':
+                options.threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'V':
+                options.volume_size = strtoull(optarg, NULL, 10)
+                        * 1024 * 1024;
+                break;
+            case 'm':
+                options.manifest = optarg;
+                break;
+            case 'v':
+                options.verify = TRUE;
+                break;
+            case 'E':
+                options.expect = optarg;
+                break;
+            case 'a':
+                mode = MODE_ARCHIVE;
+                break;
+            case 'x':
+                mode = MODE_EXTRACT;
+                break;
+            case 's':
+                mode = MODE_MEASURE;
+                break;
+            case 'P':
+                mode = MODE_PLAN;
+                break;
+            case 'w':
+                options.watch_memory = TRUE;
+                break;
+            case 'z':
+                zram = TRUE;
+                break;
+            case 'C':
+                options.size_cache = optarg;
+                break;
+            case 'D':
+                g_ptr_array_add(defer, optarg);
+                break;
+            case 'f':
+                options.part = COPY_PART_FIRST;
+                break;
+            case 'd':
+                options.part = COPY_PART_DEFERRED;
+                break;
+            case 'b':
+                options.background = TRUE;
+                break;
+            case 'r':
+                options.request_fd = atoi(optarg);
+                break;
+            case 'p':
+                options.progress = print_progress;
+                options.user_data = GINT_TO_POINTER(atoi(optarg));
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ((mode == MODE_PLAN ? argc - optind < 2
+                : argc - optind != (mode == MODE_MEASURE ? 1 : 2))
+            || (options.verify && !options.manifest)
+            || (options.part != COPY_PART_ALL && defer->len == 0)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    g_ptr_array_add(exclude, NULL);
+    options.exclude = (const char * const *)exclude->pdata;
+    if (defer->len > 0) {
+        g_ptr_array_add(defer, NULL);
+        options.defer = (const char * const *)defer->pdata;
+    }
+    g_ptr_array_add(rules, NULL);
+    options.rules = exclusion_load((const char * const *)rules->pdata);
+    g_ptr_array_free(rules, TRUE);
+    options.error = print_error;
+
+    // Same accounting as copying, for the space checks of the scripts
+    if (mode == MODE_MEASURE) {
+        copy_measure(argv[optind], &options, &size);
+        printf("%" G_GUINT64_FORMAT "\n", size.space / 1024);
+        g_ptr_array_free(exclude, TRUE);
+        g_ptr_array_free(defer, TRUE);
+        exclusion_free(options.rules);
+        return EXIT_SUCCESS;
+    }
+
+    // Sizes of all of home and of user homes against memory and TARGET
+    if (mode == MODE_PLAN) {
+        copy_scan_tree(argv[optind + 1], &options, &scan);
+        all_size = scan.total.space;
+        for (i = optind + 2; i < argc; i++)
+            users_size += user_size(argv[optind + 1], argv[i], &options, &scan);
+        copy_scan_clear(&scan);
+        plan = staging_choose(argv[optind], 1.0, all_size, users_size);
+        zram_plan = plan == STAGING_ALL || !zram ? plan
+                : staging_choose(NULL,
+                                 staging_sample_ratio(argv[optind + 1],
+                                                      &options),
+                                 all_size, users_size);
+        // Plans are ordered from the richest
+        if (zram_plan < plan)
+            printf("%s zram %" G_GUINT64_FORMAT "\n",
+                   staging_plan_name(zram_plan),
+                   staging_device_size(zram_plan == STAGING_ALL ? all_size
+                                       : users_size) / 1024);
+        else
+            printf("%s\n", staging_plan_name(plan));
+        g_ptr_array_free(exclude, TRUE);
+        g_ptr_array_free(defer, TRUE);
+        exclusion_free(options.rules);
+        return EXIT_SUCCESS;
+    }
+
+    printf("Copying %s to %s\n", argv[optind], argv[optind + 1]);
+    started = g_get_monotonic_time();
+    if (mode == MODE_ARCHIVE)
+        success = archive_tree(argv[optind], argv[optind + 1], &options,
+                               &stats);
+    else if (mode == MODE_EXTRACT)
+        success = extract_archive(argv[optind], argv[optind + 1], &options,
+                                  &stats);
+    else
+        success = copy_tree(argv[optind], argv[optind + 1], &options, &stats);
+    printf("Copied %" G_GUINT64_FORMAT " files, %" G_GUINT64_FORMAT
+           " directories and %" G_GUINT64_FORMAT " bytes in %" G_GINT64_FORMAT
+           " ms, %" G_GUINT64_FORMAT " files were up to date, %" G_GUINT64_FORMAT
+           " files were verified, %u errors\n",
+           stats.files, stats.directories, stats.bytes,
+           (g_get_monotonic_time() - started) / 1000, stats.skipped,
+           stats.verified, stats.errors);
+    exclusion_report(options.rules, stdout);
+
+    g_ptr_array_free(exclude, TRUE);
+    g_ptr_array_free(defer, TRUE);
+    exclusion_free(options.rules);
+    if (stats.stopped)
+        return EXIT_STOPPED;
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// vim: expandtab:ts=4:sw=4
@@ -0,0 +1,251 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#include <dirent.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "exclusion.h"
+
+typedef struct {
+    gchar *text;
+    // Points into text, after the ! of includes
+    const gchar *pattern;
+    gboolean include;
+    guint64 saved;
+} exclusion_rule;
+
+struct _exclusion {
+    GPtrArray *rules;
+    GMutex lock;
+};
+
+static void rule_free(gpointer data)
+{
+    exclusion_rule *rule = data;
+
+    g_free(rule->text);
+    g_free(rule);
+}
+
+static void load_file(exclusion *rules, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    exclusion_rule *rule;
+    char *line = NULL;
+    size_t size = 0;
+    char *text;
+
+    if (file == NULL) {
+        fprintf(stderr, "%s: open failed: %m\n", path);
+        return;
+    }
+
+    while (getline(&line, &size, file) != -1) {
+        text = g_strstrip(line);
+        if (*text == '\0' || *text == '#')
+            continue;
+        rule = g_new0(exclusion_rule, 1);
+        rule->text = g_strdup(text);
+        rule->include = *text == '!';
+        rule->pattern = rule->include ? rule->text + 1 : rule->text;
+        g_ptr_array_add(rules->rules, rule);
+    }
+
+    free(line);
+    fclose(file);
+}
+
+// Later directories replace files of the same name
+static void find_files(GHashTable *files, const char *directory)
+{
+    struct dirent *entry;
+    DIR *dir = opendir(directory);
+
+    if (dir == NULL)
+        return;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || !g_str_has_suffix(entry->d_name, ".conf"))
+            continue;
+        g_hash_table_insert(files, g_strdup(entry->d_name),
+                            g_build_filename(directory, entry->d_name, NULL));
+    }
+    closedir(dir);
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+exclusion *exclusion_load(const char * const *directories)
+{
+    GHashTable *files = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, g_free);
+    GPtrArray *names = g_ptr_array_new();
+    exclusion *rules = g_new0(exclusion, 1);
+    GHashTableIter iter;
+    gpointer name;
+    guint i;
+
+    rules->rules = g_ptr_array_new_with_free_func(rule_free);
+    g_mutex_init(&rules->lock);
+
+    for (; directories != NULL && *directories != NULL; directories++)
+        find_files(files, *directories);
+
+    g_hash_table_iter_init(&iter, files);
+    while (g_hash_table_iter_next(&iter, &name, NULL))
+        g_ptr_array_add(names, name);
+    g_ptr_array_sort(names, compare_names);
+    for (i = 0; i < names->len; i++)
+        load_file(rules, g_hash_table_lookup(files, names->pdata[i]));
+
+    g_ptr_array_free(names, TRUE);
+    g_hash_table_unref(files);
+
+    if (rules->rules->len == 0) {
+        exclusion_free(rules);
+        return NULL;
+    }
+    return rules;
+}
+
+void exclusion_free(exclusion *rules)
+{
+    if (rules == NULL)
+        return;
+    g_ptr_array_unref(rules->rules);
+    g_mutex_clear(&rules->lock);
+    g_free(rules);
+}
+
+/*
+ * Like g_pattern_match_simple(), except that a "*" which is a whole
+ * component of the pattern matches exactly one component of the path.
+ */
+static gboolean pattern_match(const char *pattern, const char *p, const char *s)
+{
+    const char *star;
+    const char *end;
+
+    for (; *p != '\0'; p++, s++) {
+        if (*p == '*') {
+            star = p;
+            while (p[1] == '*')
+                p++;
+            if (star > pattern && star[-1] == '/'
+                    && (p[1] == '/' || p[1] == '\0')) {
+                end = strchr(s, '/');
+                if (end == NULL)
+                    end = s + strlen(s);
+                return end > s && pattern_match(pattern, p + 1, end);
+            }
+            for (;; s++) {
+                if (pattern_match(pattern, p + 1, s))
+                    return TRUE;
+                if (*s == '\0')
+                    return FALSE;
+            }
+        }
+        if (*s == '\0' || (*p != '?' && *p != *s))
+            return FALSE;
+    }
+    return *s == '\0';
+}
+
+gint exclusion_match(const exclusion *rules, const char *path)
+{
+    exclusion_rule *rule;
+    gchar *absolute;
+    gint match = -1;
+    gint i;
+
+    if (rules == NULL)
+        return -1;
+
+    absolute = g_strconcat("/", path, NULL);
+    for (i = rules->rules->len - 1; i >= 0; i--) {
+        rule = g_ptr_array_index(rules->rules, i);
+        if (pattern_match(rule->pattern, rule->pattern, absolute)) {
+            match = rule->include ? -1 : i;
+            break;
+        }
+    }
+    g_free(absolute);
+    return match;
+}
+
+void exclusion_add_saved(exclusion *rules, gint rule, guint64 bytes)
+{
+    g_mutex_lock(&rules->lock);
+    ((exclusion_rule *)g_ptr_array_index(rules->rules, rule))->saved += bytes;
+    g_mutex_unlock(&rules->lock);
+}
+
+void exclusion_report(const exclusion *rules, FILE *out)
+{
+    exclusion_rule *rule;
+    guint i;
+
+    if (rules == NULL)
+        return;
+
+    for (i = 0; i < rules->rules->len; i++) {
+        rule = g_ptr_array_index(rules->rules, i);
+        if (!rule->include)
+            fprintf(out, "Excluding %s saved %" G_GUINT64_FORMAT " bytes\n",
+                    rule->text, rule->saved);
+    }
+}
+
+void exclusion_checksum(const exclusion *rules, GChecksum *checksum)
+{
+    exclusion_rule *rule;
+    guint i;
+
+    if (rules == NULL)
+        return;
+    for (i = 0; i < rules->rules->len; i++) {
+        rule = g_ptr_array_index(rules->rules, i);
+        g_checksum_update(checksum, (const guchar *)rule->text,
+                          strlen(rule->text) + 1);
+    }
+}
+
+// vim: expandtab:ts=4:sw=4
@@ -0,0 +1,77 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#ifndef __EXCLUSION_H
+#define __EXCLUSION_H
+
+#include <glib.h>
+#include <stdio.h>
+
+/*
+ * Rules for data that is not worth copying because it is regenerated,
+ * like caches. Rules are read from *.conf files of drop-in directories,
+ * one pattern per line, and a file overrides one with the same name in
+ * an earlier directory. Files are applied in the order of their names.
+ * Empty lines and lines starting with # are ignored.
+ *
+ * Patterns are matched like g_pattern_match_simple() against the path
+ * relative to the copied directory with a leading /. As "*" also
+ * matches "/", a pattern starting with it matches at any depth. A "*"
+ * that makes up a whole component, between two slashes or after the
+ * last one, matches exactly one component instead. A pattern starting
+ * with ! includes what an earlier rule excludes. The last matching rule
+ * wins, and nothing below an excluded directory is looked at.
+ *
+ * Bytes left out are counted per rule. Counting is safe to do from
+ * several threads.
+ */
+
+typedef struct _exclusion exclusion;
+
+// Missing directories are skipped, returns NULL if there are no rules
+exclusion *exclusion_load(const char * const *directories);
+void exclusion_free(exclusion *rules);
+// Index of the rule that excludes the relative path or -1
+gint exclusion_match(const exclusion *rules, const char *path);
+void exclusion_add_saved(exclusion *rules, gint rule, guint64 bytes);
+// Prints the bytes saved by each exclusion rule
+void exclusion_report(const exclusion *rules, FILE *out);
+// Adds the rules to checksum, to tell apart results of different rules
+void exclusion_checksum(const exclusion *rules, GChecksum *checksum);
+
+#endif // __EXCLUSION_H
+
+// vim: expandtab:ts=4:sw=4
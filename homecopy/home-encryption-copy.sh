@@ -2,31 +2,60 @@
 echo Start home-encryption-copy.sh
 
 CONF_FILE="/var/lib/sailfish-device-encryption/home_copy.conf"
-COPY_MARKER_FILE="/tmp/.sailfish_copy_done"
+
+# Home is walked once, sizes are shared through the size cache. Home may
+# have changed since the last run, so the cache only lives for this one.
+SIZE_CACHE=/run/sailfish-device-encryption/home-size.cache
+mkdir -p /run/sailfish-device-encryption
+rm -f $SIZE_CACHE
+
+# Progress goes to the home copy service when it runs this. Regenerable
+# data like caches is left out, see home-copy-exclude.d.
+home_copy() {
+    /usr/libexec/sailfish-home-copy \
+        --exclude-rules /usr/share/sailfish-device-encryption/home-copy-exclude.d \
+        --exclude-rules /etc/sailfish-device-encryption/home-copy-exclude.d \
+        ${COPY_PROGRESS_FD:+--progress-fd "$COPY_PROGRESS_FD"} \
+        --size-cache $SIZE_CACHE "$@"
+}
 
 if  ! [ -f "$CONF_FILE" ]; then
     echo "No device given"
-    echo 1 > $COPY_MARKER_FILE
     exit 1
 fi
 
 DEV=$(cat $CONF_FILE)
 MNTPNT=$(echo -e $(lsblk -n -o MOUNTPOINT "$DEV"))
+MANIFEST="$MNTPNT/tmp/home.manifest"
+ARCHIVE="$MNTPNT/tmp/home.tar.zst"
 EXIT_STATUS=0
 
+# Filesystems without Unix ownership and modes get an archive. On vfat
+# it is split into volumes home.tar.zst.000, .001 and so on below 4 GiB.
+case $(lsblk -n -o FSTYPE "$DEV") in
+    vfat|exfat) USE_ARCHIVE=true ;;
+    *) USE_ARCHIVE=false ;;
+esac
+
 if [ ! -w "$MNTPNT" ] || ! echo "$MNTPNT" | grep -qE "^/run/media/"; then
     echo "${MNTPNT} incorrect, home can't be copied"
-    echo 1 > $COPY_MARKER_FILE
     exit 1
-elif [ -d "$MNTPNT/tmp/home/" ]; then
+elif [ "$USE_ARCHIVE" = true ]; then
+    rm -rf "$MNTPNT"/tmp/home/ "$MANIFEST" "$ARCHIVE" "$ARCHIVE".[0-9][0-9][0-9]
+elif [ -d "$MNTPNT/tmp/home/" ] && [ ! -f "$MANIFEST" ]; then
     rm -rf "$MNTPNT"/tmp/home/
 fi
+rm -f "$ARCHIVE".partial "$ARCHIVE".[0-9][0-9][0-9].partial
 
 WRITELOCATION=$MNTPNT/tmp
 mkdir -p "$WRITELOCATION"/home
 
-SPACE_NEEDED=$(du -sck /home/.[!.]* /home/* | grep -E $'\ttotal$' | cut -d$'\t' -f1)
+# Measured like the copy is made, links and holes of files take no space
+SPACE_NEEDED=$(home_copy --measure --exclude lost+found /home)
 SPACE_AVAILABLE=$(df -k "$WRITELOCATION" | grep '[0-9]%' | tr -s " " | cut -d' ' -f4)
+# An earlier copy is resumed, only what changed is copied again
+SPACE_COPIED=$(/usr/libexec/sailfish-home-copy --measure "$WRITELOCATION"/home)
+SPACE_AVAILABLE=$(( $SPACE_AVAILABLE + $SPACE_COPIED ))
 
 if [ "$SPACE_NEEDED" -gt "$SPACE_AVAILABLE" ]; then
     echo "Not enough space!"
@@ -35,18 +64,23 @@ fi
 
 if [ "$EXIT_STATUS" -eq "0" ]; then
     echo "Copying user data to $WRITELOCATION"
-    for dir in /home/.[!.]* /home/*; do
-        if [ $(basename "$dir") != "lost+found" ]; then
-            echo "copy $dir to $WRITELOCATION${dir}"
-            if ! cp --archive "$dir" "$WRITELOCATION${dir}"; then
-                echo "cp failed for ${dir} : $?"
-                EXIT_STATUS=1
-            fi
-        fi
-    done
+    # The copy is read back from the card and checked against the manifest
+    if [ "$USE_ARCHIVE" = true ]; then
+        rmdir "$WRITELOCATION"/home
+        # Directories restored last are archived last, see home-restore.sh
+        home_copy --exclude lost+found \
+            --defer '*/Pictures' --defer '*/Videos' --defer '*/Music' \
+            --defer '*/android_storage' \
+            --manifest "$MANIFEST" --verify --archive /home "$ARCHIVE"
+    else
+        home_copy --exclude lost+found \
+            --manifest "$MANIFEST" --verify /home "$WRITELOCATION"/home
+    fi
+    if [ "$?" -ne "0" ]; then
+        echo "Copying home failed"
+        EXIT_STATUS=1
+    fi
     echo Home copied, exit status: $EXIT_STATUS
 fi
 
-echo $EXIT_STATUS > $COPY_MARKER_FILE
-
 exit $EXIT_STATUS
@@ -1,11 +1,30 @@
 #!/bin/sh
 echo Start restoration
 
-COPY_MARKER_FILE="/tmp/.sailfish_copy_done"
 COPY_SUCCESS=false
 
+# Progress goes to the home copy service when it runs this. Media
+# directories are restored after the rest, the copy script archives them
+# last with the same patterns.
+home_copy() {
+    /usr/libexec/sailfish-home-copy \
+        --defer '*/Pictures' --defer '*/Videos' --defer '*/Music' \
+        --defer '*/android_storage' \
+        ${COPY_PROGRESS_FD:+--progress-fd "$COPY_PROGRESS_FD"} "$@"
+}
+
 # ---- RESTORATION FROM SD CARD ------
 CONF_FILE="/var/lib/sailfish-device-encryption/home_copy.conf"
+DEFERRED_FILE="/var/lib/sailfish-device-encryption/home_restore_deferred"
+# Second run restores the deferred directories in the background and
+# the home copy service passes paths that are needed first
+if [ "$1" = "--deferred" ]; then
+    CONF_FILE=$DEFERRED_FILE
+    set -- --deferred --background \
+        ${COPY_REQUEST_FD:+--request-fd "$COPY_REQUEST_FD"}
+else
+    set -- --first
+fi
 if [ -f $CONF_FILE ] && grep -q "^/dev/" $CONF_FILE ; then
     SD_DEVICE=$(cat $CONF_FILE)
     COPY_SUCCESS=true
@@ -14,28 +33,51 @@ if [ -f $CONF_FILE ] && grep -q "^/dev/" $CONF_FILE ; then
     fi
     MNTPNT=$(echo -e $(lsblk -n -o MOUNTPOINT $SD_DEVICE))
     SDHOME=$MNTPNT/tmp/home
-    for dir in $SDHOME/.[!.]* $SDHOME/*; do
-        echo "copy ${dir}"
-        # a new quota is created for the encrypted filesystem
-        if [[ ${dir#"$SDHOME"} == "/aquota.user" ]]; then
-            continue
-        elif ! cp -af $dir /home; then
-            >&2 echo "Warning: ${dir} was not restored succesfully. Data is kept in $SDHOME"
-            COPY_SUCCESS=false
-        fi
-    done
-    if [ "$COPY_SUCCESS" = true ]; then
-        rm -rf $SDHOME
-        echo 0 > $COPY_MARKER_FILE
+    ARCHIVE=$MNTPNT/tmp/home.tar.zst
+    # Restoring again after an interruption skips files already restored
+    RESTORE_MANIFEST=$MNTPNT/tmp/home-restore.manifest
+    EXPECT_MANIFEST=$MNTPNT/tmp/home.manifest
+    # Without the manifest of the copy the card data can not be checked,
+    # so home is restored but the card data is kept
+    KEEP_CARD_DATA=false
+    if [ -f "$EXPECT_MANIFEST" ]; then
+        set -- "$@" --expect "$EXPECT_MANIFEST"
+    else
+        >&2 echo "Warning: $EXPECT_MANIFEST is missing, restored data is not checked"
+        KEEP_CARD_DATA=true
+    fi
+    # Data read from the card must match what was copied to it, and the
+    # restored home is read back before the copy on the card is removed.
+    # A new quota is created for the encrypted filesystem.
+    # Archive on vfat is split into volumes, the first one is renamed last
+    if [ -f "$ARCHIVE" ] || [ -f "$ARCHIVE.000" ]; then
+        SDHOME=$ARCHIVE
+        home_copy "$@" --exclude aquota.user \
+            --manifest "$RESTORE_MANIFEST" --verify --extract "$ARCHIVE" /home
+    else
+        home_copy "$@" --exclude aquota.user \
+            --manifest "$RESTORE_MANIFEST" --verify "$SDHOME" /home
+    fi
+    if [ "$?" -ne "0" ]; then
+        >&2 echo "Warning: home was not restored succesfully. Data is kept in $SDHOME"
+        COPY_SUCCESS=false
+    fi
+    if [ "$COPY_SUCCESS" = true ] && [ "$1" = "--first" ]; then
+        echo "$SD_DEVICE" > $DEFERRED_FILE
+    elif [ "$COPY_SUCCESS" = true ] && [ "$KEEP_CARD_DATA" = true ]; then
+        echo "Data is kept in $SDHOME"
+    elif [ "$COPY_SUCCESS" = true ]; then
+        rm -rf "$SDHOME" "$SDHOME".[0-9][0-9][0-9] "$EXPECT_MANIFEST" \
+            "$RESTORE_MANIFEST"
+    elif [ "$1" = "--deferred" ] && [ -b "$SD_DEVICE" ]; then
+        # Tried again on next boot, already restored files are skipped
+        CONF_FILE=
     fi
 fi
 
 # ---- SD RESTORATION FINISHED ------
-rm -f $CONF_FILE
-if [ "$COPY_SUCCESS" != true ]; then
-    echo 1 > $COPY_MARKER_FILE
-fi
-
-sleep 10
+[ -z "$CONF_FILE" ] || rm -f $CONF_FILE
 
-systemctl restart user@100000
+# Nothing is restarted here, the restoration UI restarts the user services
+# that the home copy service finds holding home
+[ "$COPY_SUCCESS" = true ]
@@ -0,0 +1,700 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "checksum.h"
+#include "homearchive.h"
+#include "manifest.h"
+#include "verify.h"
+#include "volumes.h"
+
+#define BLOCK_SIZE (1024 * 1024)
+#define BUFFER_SIZE (128 * 1024)
+
+#define EXTRACT_FLAGS (ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM \
+        | ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_XATTR | ARCHIVE_EXTRACT_ACL \
+        | ARCHIVE_EXTRACT_SECURE_NODOTDOT | ARCHIVE_EXTRACT_SECURE_SYMLINKS)
+
+static void report(
+        const copy_options *options,
+        copy_stats *stats,
+        struct archive *a,
+        const char *path,
+        const char *operation)
+{
+    int errnum = archive_errno(a) > 0 ? archive_errno(a) : EIO;
+
+    stats->errors++;
+    fprintf(stderr, "%s: %s\n", path, archive_error_string(a));
+    if (options->error)
+        options->error(path, operation, errnum, options->user_data);
+}
+
+static void report_errno(
+        const copy_options *options,
+        copy_stats *stats,
+        const char *path,
+        const char *operation,
+        int errnum)
+{
+    stats->errors++;
+    if (options->error)
+        options->error(path, operation, errnum, options->user_data);
+    else
+        fprintf(stderr, "%s: %s failed: %s\n", path, operation,
+                strerror(errnum));
+}
+
+static gboolean excluded(const copy_options *options, const char *path)
+{
+    return options->exclude != NULL && strchr(path, '/') == NULL
+            && g_strv_contains(options->exclude, path);
+}
+
+static void set_threads(struct archive *out, const copy_options *options)
+{
+    guint threads = options->threads ? options->threads
+                                     : g_get_num_processors();
+    gchar *value = g_strdup_printf("%u", threads);
+
+    // Older libarchive compresses on one thread only
+    if (archive_write_set_filter_option(out, "zstd", "threads", value)
+            != ARCHIVE_OK)
+        printf("Compressing on one thread: %s\n", archive_error_string(out));
+    g_free(value);
+}
+
+static gboolean write_data(
+        struct archive *disk,
+        struct archive *out,
+        struct archive_entry *entry,
+        const copy_options *options,
+        copy_stats *stats,
+        progress_tracker *progress,
+        gchar *buffer,
+        checksum *hash)
+{
+    ssize_t length;
+
+    while ((length = archive_read_data(disk, buffer, BUFFER_SIZE)) > 0) {
+        if (hash != NULL)
+            checksum_update(hash, buffer, length);
+        if (archive_write_data(out, buffer, length) < 0) {
+            report(options, stats, out, archive_entry_pathname(entry),
+                   "write");
+            return FALSE;
+        }
+        stats->bytes += length;
+        progress_update(progress, 0, length);
+    }
+
+    if (length < 0) {
+        report(options, stats, disk, archive_entry_sourcepath(entry), "read");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Archived files get manifest entries with the same time stamps for
+ * source and copy, as extraction restores the source time stamps.
+ */
+static void write_file(
+        struct archive *disk,
+        struct archive *out,
+        struct archive_entry *entry,
+        const copy_options *options,
+        copy_stats *stats,
+        progress_tracker *progress,
+        gchar *buffer,
+        manifest *m)
+{
+    char result[CHECKSUM_SIZE];
+    checksum *hash = m ? checksum_new() : NULL;
+    gboolean success;
+
+    success = write_data(disk, out, entry, options, stats, progress, buffer,
+                         hash);
+    if (hash != NULL) {
+        checksum_finish(hash, result);
+        if (success)
+            manifest_add(m, archive_entry_pathname(entry),
+                         archive_entry_stat(entry), archive_entry_stat(entry),
+                         result);
+    }
+}
+
+typedef struct {
+    const copy_options *options;
+    struct archive *out;
+    struct archive_entry_linkresolver *links;
+    manifest *manifest;
+    progress_tracker progress;
+    copy_stats result;
+    gchar *buffer;
+    const char *archive;
+    // Current volume or -1 if the archive is not split, see volumes.h
+    gint volume;
+    guint64 volume_size;
+    // Archive is written back as it grows, see copy_release_pages()
+    int fd;
+    copy_pages pages;
+} archive_writer;
+
+static gboolean close_volume(archive_writer *w)
+{
+    gchar *path;
+    int ret;
+
+    if (w->fd < 0)
+        return TRUE;
+
+    copy_release_pages(-1, w->fd, &w->pages, TRUE);
+    ret = close(w->fd);
+    w->fd = -1;
+    if (ret < 0) {
+        path = volume_path(w->archive, w->volume, TRUE);
+        report_errno(w->options, &w->result, path, "close", errno);
+        g_free(path);
+    }
+    return ret == 0;
+}
+
+static gboolean open_volume(archive_writer *w)
+{
+    gchar *path = volume_path(w->archive, w->volume, TRUE);
+
+    memset(&w->pages, 0, sizeof(w->pages));
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0)
+        report_errno(w->options, &w->result, path, "open", errno);
+    g_free(path);
+    return w->fd >= 0;
+}
+
+// Blocks of the stream, continued on the next volume when one is full
+static la_ssize_t write_volumes(
+        struct archive *out,
+        void *data,
+        const void *buffer,
+        size_t length)
+{
+    archive_writer *w = data;
+    const char *block = buffer;
+    size_t size;
+    ssize_t written;
+
+    while (length > 0) {
+        if (w->volume_size > 0 && (guint64)w->pages.position >= w->volume_size) {
+            if (!close_volume(w))
+                return -1;
+            w->volume++;
+            if (!open_volume(w))
+                return -1;
+        }
+        size = length;
+        if (w->volume_size > 0)
+            size = MIN(size, w->volume_size - w->pages.position);
+        written = write(w->fd, block, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0) {
+            archive_set_error(out, errno, "Write failed: %s", strerror(errno));
+            return -1;
+        }
+        block += written;
+        length -= written;
+        w->pages.position += written;
+    }
+    return block - (const char *)buffer;
+}
+
+// Source is read by libarchive, the cache is shared by all descriptors
+static void drop_pages(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// Bytes left out are counted once, like in copy_tree()
+static gboolean excluded_by_rule(
+        archive_writer *w,
+        struct archive_entry *entry,
+        const char *path,
+        gboolean count)
+{
+    gint rule = exclusion_match(w->options->rules, path);
+    copy_options all = { 0 };
+    copy_size size = { 0 };
+
+    if (rule < 0 || !count)
+        return rule >= 0;
+
+    if (archive_entry_filetype(entry) == AE_IFDIR)
+        copy_measure(archive_entry_sourcepath(entry), &all, &size);
+    else if (archive_entry_filetype(entry) == AE_IFREG)
+        size.bytes = archive_entry_size(entry);
+    exclusion_add_saved(w->options->rules, rule, size.bytes);
+    return TRUE;
+}
+
+/*
+ * Appends the entries of a part of the tree. Returns FALSE if the
+ * archive can not be written further.
+ */
+static gboolean write_tree(
+        archive_writer *w,
+        const char *source,
+        copy_part part)
+{
+    struct archive *disk = archive_read_disk_new();
+    struct archive_entry *entry = archive_entry_new();
+    const copy_options *options = w->options;
+    struct archive_entry *spare;
+    gboolean success = TRUE;
+    gboolean deferred;
+    const char *path;
+    int ret;
+
+    archive_read_disk_set_symlink_physical(disk);
+    if (archive_read_disk_open(disk, source) != ARCHIVE_OK) {
+        report(options, &w->result, disk, source, "open");
+        success = FALSE;
+        goto out;
+    }
+
+    for (;;) {
+        archive_entry_clear(entry);
+        ret = archive_read_next_header2(disk, entry);
+        if (ret == ARCHIVE_EOF) {
+            break;
+        } else if (ret == ARCHIVE_FATAL) {
+            report(options, &w->result, disk, source, "scan");
+            break;
+        } else if (ret < ARCHIVE_WARN) {
+            report(options, &w->result, disk,
+                   archive_entry_sourcepath(entry), "scan");
+            continue;
+        }
+
+        // Entries are stored relative to the top of the tree
+        path = archive_entry_sourcepath(entry) + strlen(source);
+        while (*path == '/')
+            path++;
+        if (*path == '\0') {
+            archive_read_disk_descend(disk);
+            continue;
+        }
+        if (excluded(options, path))
+            continue;
+
+        // Deferred part is found under directories of the first part
+        deferred = part != COPY_PART_ALL && copy_deferred(options, path);
+        if (part == COPY_PART_FIRST && deferred)
+            continue;
+        if (excluded_by_rule(w, entry, path,
+                             part != COPY_PART_DEFERRED || deferred))
+            continue;
+        archive_read_disk_descend(disk);
+        if (part == COPY_PART_DEFERRED && !deferred)
+            continue;
+
+        archive_entry_copy_pathname(entry, path);
+        // Later paths of a file with several links are stored as links
+        spare = NULL;
+        archive_entry_linkify(w->links, &entry, &spare);
+
+        ret = archive_write_header(w->out, entry);
+        if (ret == ARCHIVE_FATAL) {
+            report(options, &w->result, w->out, path, "write");
+            success = FALSE;
+            break;
+        } else if (ret < ARCHIVE_WARN) {
+            report(options, &w->result, w->out, path, "write");
+            continue;
+        }
+
+        if (archive_entry_filetype(entry) == AE_IFDIR) {
+            w->result.directories++;
+        } else {
+            if (archive_entry_filetype(entry) == AE_IFREG
+                    && archive_entry_hardlink(entry) == NULL) {
+                write_file(disk, w->out, entry, options, &w->result,
+                           &w->progress, w->buffer, w->manifest);
+                drop_pages(archive_entry_sourcepath(entry));
+                copy_release_pages(-1, w->fd, &w->pages, FALSE);
+            }
+            w->result.files++;
+            progress_update(&w->progress, 1, 0);
+        }
+    }
+
+out:
+    archive_read_free(disk);
+    archive_entry_free(entry);
+    return success;
+}
+
+gboolean archive_tree(
+        const char *source,
+        const char *archive,
+        const copy_options *options,
+        copy_stats *stats)
+{
+    archive_writer w = { 0 };
+    copy_options all = *options;
+    copy_size size = { 0 };
+    gchar *partial;
+    gchar *path;
+    gint i;
+
+    w.options = options;
+    w.archive = archive;
+    w.volume_size = options->volume_size ? options->volume_size
+                                         : volume_size_for(archive);
+    w.volume = w.volume_size > 0 ? 0 : -1;
+    w.fd = -1;
+    w.out = archive_write_new();
+    w.buffer = g_malloc(BUFFER_SIZE);
+    archive_write_set_format_pax(w.out);
+    archive_write_add_filter_zstd(w.out);
+    set_threads(w.out, options);
+    archive_write_set_bytes_per_block(w.out, BLOCK_SIZE);
+    archive_write_set_bytes_in_last_block(w.out, 1);
+    w.links = archive_entry_linkresolver_new();
+    archive_entry_linkresolver_set_strategy(w.links,
+            ARCHIVE_FORMAT_TAR_PAX_INTERCHANGE);
+
+    if (!open_volume(&w))
+        goto out;
+    if (archive_write_open(w.out, &w, NULL, write_volumes, NULL)
+            != ARCHIVE_OK) {
+        report(options, &w.result, w.out, archive, "open");
+        goto out;
+    }
+    // Written from scratch, earlier entries do not apply
+    if (options->manifest != NULL) {
+        if (unlink(options->manifest) < 0 && errno != ENOENT) {
+            report_errno(options, &w.result, options->manifest, "unlink",
+                         errno);
+            goto out;
+        }
+        w.manifest = manifest_open(options->manifest);
+        if (w.manifest == NULL) {
+            report_errno(options, &w.result, options->manifest, "open",
+                         errno);
+            goto out;
+        }
+    }
+
+    all.part = COPY_PART_ALL;
+    if (options->progress != NULL)
+        copy_measure(source, &all, &size);
+    progress_init(&w.progress, options->progress, options->user_data,
+                  size.files, size.bytes);
+
+    /*
+     * Deferred directories go last, so that extracting the first part
+     * can stop at the first deferred entry.
+     */
+    if (options->defer == NULL)
+        write_tree(&w, source, COPY_PART_ALL);
+    else if (write_tree(&w, source, COPY_PART_FIRST))
+        write_tree(&w, source, COPY_PART_DEFERRED);
+    progress_finish(&w.progress);
+
+out:
+    if (archive_write_close(w.out) != ARCHIVE_OK)
+        report(options, &w.result, w.out, archive, "close");
+    archive_write_free(w.out);
+    archive_entry_linkresolver_free(w.links);
+    close_volume(&w);
+
+    if (options->verify && w.manifest != NULL && w.result.errors == 0)
+        verify_archive(archive, TRUE, w.manifest, options, &w.result);
+    if (w.manifest != NULL)
+        manifest_close(w.manifest, FALSE);
+
+    /*
+     * The first volume is renamed last, so the archive is complete when
+     * it is there.
+     */
+    for (i = w.volume; i >= MIN(w.volume, 0); i--) {
+        partial = volume_path(archive, i, TRUE);
+        path = volume_path(archive, i, FALSE);
+        if (w.result.errors == 0 && rename(partial, path) < 0) {
+            fprintf(stderr, "%s: rename failed: %s\n", partial,
+                    strerror(errno));
+            w.result.errors++;
+        }
+        if (w.result.errors > 0)
+            unlink(partial);
+        g_free(path);
+        g_free(partial);
+    }
+
+    if (stats != NULL)
+        *stats = w.result;
+    g_free(w.buffer);
+    return w.result.errors == 0;
+}
+
+// Extraction progresses by bytes read from the archive
+static void update_extract_progress(
+        struct archive *in,
+        progress_tracker *progress,
+        guint64 files)
+{
+    guint64 read = archive_filter_bytes(in, -1);
+
+    progress_update(progress, files, read - progress->progress.bytes_done);
+}
+
+// Holes of sparse files are hashed as zeros
+static gboolean extract_data(
+        struct archive *in,
+        struct archive *disk,
+        struct archive_entry *entry,
+        const copy_options *options,
+        copy_stats *stats,
+        progress_tracker *progress,
+        checksum *hash)
+{
+    const char *path = archive_entry_pathname(entry);
+    guint64 position = 0;
+    const void *block;
+    size_t size;
+    la_int64_t offset;
+    int ret;
+
+    while ((ret = archive_read_data_block(in, &block, &size, &offset))
+            == ARCHIVE_OK) {
+        if (hash != NULL) {
+            if ((guint64)offset > position)
+                checksum_update_zeros(hash, offset - position);
+            checksum_update(hash, block, size);
+            position = offset + size;
+        }
+        if (archive_write_data_block(disk, block, size, offset) < ARCHIVE_OK) {
+            report(options, stats, disk, path, "write");
+            return FALSE;
+        }
+        stats->bytes += size;
+        update_extract_progress(in, progress, 0);
+    }
+
+    if (ret != ARCHIVE_EOF) {
+        report(options, stats, in, path, "read");
+        return FALSE;
+    }
+    if (hash != NULL && archive_entry_size(entry) > (la_int64_t)position)
+        checksum_update_zeros(hash, archive_entry_size(entry) - position);
+    return TRUE;
+}
+
+/*
+ * Data of a regular file is compared with the manifest of the copy that
+ * made the archive and added to the manifest of this extraction.
+ */
+static void finish_file(
+        struct archive_entry *entry,
+        const char *relative,
+        const copy_options *options,
+        copy_stats *stats,
+        manifest *m,
+        manifest *expected,
+        checksum *hash,
+        gboolean success)
+{
+    const struct stat *st = archive_entry_stat(entry);
+    char result[CHECKSUM_SIZE];
+    struct stat target;
+
+    checksum_finish(hash, result);
+    if (!success)
+        return;
+
+    if (expected != NULL && !verify_expected(expected, relative, st, result))
+        report_errno(options, stats, archive_entry_pathname(entry), "verify",
+                     EBADMSG);
+    else if (m != NULL && lstat(archive_entry_pathname(entry), &target) == 0)
+        manifest_add(m, relative, st, &target, result);
+}
+
+gboolean extract_archive(
+        const char *archive,
+        const char *target,
+        const copy_options *options,
+        copy_stats *stats)
+{
+    struct archive *in = archive_read_new();
+    struct archive *disk = archive_write_disk_new();
+    volume_reader *reader = volume_reader_new(archive, FALSE, FALSE);
+    struct archive_entry *entry;
+    copy_stats result = { 0 };
+    progress_tracker progress;
+    manifest *expected = NULL;
+    manifest *m = NULL;
+    gboolean deferred = FALSE;
+    checksum *hash;
+    gboolean success;
+    const char *link;
+    gchar *relative;
+    gchar *path;
+    int ret;
+
+    archive_read_support_format_tar(in);
+    archive_read_support_filter_zstd(in);
+    archive_write_disk_set_options(disk, EXTRACT_FLAGS);
+
+    if (volume_reader_open(reader, in) != ARCHIVE_OK) {
+        report(options, &result, in, archive, "open");
+        goto out;
+    }
+    if (options->manifest != NULL) {
+        m = manifest_open(options->manifest);
+        if (m == NULL) {
+            report_errno(options, &result, options->manifest, "open", errno);
+            goto out;
+        }
+    }
+    if (options->expect != NULL) {
+        expected = manifest_load(options->expect);
+        if (expected == NULL) {
+            report_errno(options, &result, options->expect, "open", errno);
+            goto out;
+        }
+    }
+
+    progress_init(&progress, options->progress, options->user_data, 0,
+                  volume_reader_size(reader));
+
+    for (;;) {
+        ret = archive_read_next_header(in, &entry);
+        if (ret == ARCHIVE_EOF) {
+            break;
+        } else if (ret < ARCHIVE_WARN) {
+            // Stream can not be followed past a broken header
+            report(options, &result, in, archive, "read");
+            break;
+        }
+
+        // Deferred entries were written after all the others
+        if (options->part != COPY_PART_ALL && !deferred)
+            deferred = copy_deferred(options, archive_entry_pathname(entry));
+        if (options->part == COPY_PART_FIRST && deferred)
+            break;
+        if (options->part == COPY_PART_DEFERRED && !deferred)
+            continue;
+
+        if (excluded(options, archive_entry_pathname(entry)))
+            continue;
+
+        relative = g_strdup(archive_entry_pathname(entry));
+        path = g_build_filename(target, relative, NULL);
+        archive_entry_copy_pathname(entry, path);
+        link = archive_entry_hardlink(entry);
+        if (link != NULL) {
+            g_free(path);
+            path = g_build_filename(target, link, NULL);
+            archive_entry_copy_hardlink(entry, path);
+        }
+
+        ret = archive_write_header(disk, entry);
+        if (ret < ARCHIVE_WARN) {
+            report(options, &result, disk, archive_entry_pathname(entry),
+                   "create");
+        } else {
+            hash = (m != NULL || expected != NULL) && link == NULL
+                    && archive_entry_filetype(entry) == AE_IFREG
+                    ? checksum_new() : NULL;
+            success = TRUE;
+            if (archive_entry_size(entry) > 0)
+                success = extract_data(in, disk, entry, options, &result,
+                                       &progress, hash);
+            if (archive_write_finish_entry(disk) < ARCHIVE_WARN) {
+                report(options, &result, disk, archive_entry_pathname(entry),
+                       "metadata");
+                success = FALSE;
+            }
+            if (hash != NULL)
+                finish_file(entry, relative, options, &result, m, expected,
+                            hash, success);
+            if (archive_entry_filetype(entry) == AE_IFDIR) {
+                result.directories++;
+            } else {
+                result.files++;
+                update_extract_progress(in, &progress, 1);
+            }
+        }
+        g_free(relative);
+        g_free(path);
+    }
+    progress_finish(&progress);
+
+out:
+    archive_read_free(in);
+    volume_reader_free(reader);
+    // Directory permissions and times are set on close
+    if (archive_write_close(disk) != ARCHIVE_OK)
+        report(options, &result, disk, target, "close");
+    archive_write_free(disk);
+
+    if (options->verify && m != NULL && result.errors == 0)
+        verify_tree(target, m, options, &result);
+    if (expected != NULL)
+        manifest_close(expected, FALSE);
+    if (m != NULL)
+        manifest_close(m, FALSE);
+
+    if (stats != NULL)
+        *stats = result;
+    return result.errors == 0;
+}
+
+// vim: expandtab:ts=4:sw=4
@@ -0,0 +1,80 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#ifndef __HOME_ARCHIVE_H
+#define __HOME_ARCHIVE_H
+
+#include <glib.h>
+#include "copyengine.h"
+
+/*
+ * Archive mode for copying home to a memory card. The tree is streamed
+ * into one zstd compressed pax archive, which keeps ownership, mode,
+ * extended attributes and ACLs on any filesystem. On FAT, or with
+ * options->volume_size, the archive is split into volumes that fit under
+ * the file size limit, see volumes.h. Writes to the card are large and
+ * sequential, and compression runs on options->threads threads. The
+ * archive is written next to its final name and renamed when it is
+ * complete. Holes of sparse files are kept and files with several links
+ * are stored once, like in copy_tree().
+ *
+ * An archive is always written from scratch, so is its manifest. The
+ * manifest only serves verification, of the archive with verify set and
+ * of the extracted files when it is given as expected manifest. Errors
+ * and progress are reported like in copy_tree(). Progress of extraction
+ * counts the bytes read from the archive.
+ *
+ * With defer patterns the deferred directories are written at the end of
+ * the archive, and options->part of extraction selects the entries before
+ * or after the first deferred one. Requests are not served from an
+ * archive, a stream can only be read in order.
+ */
+
+gboolean archive_tree(
+        const char *source,
+        const char *archive,
+        const copy_options *options,
+        copy_stats *stats);
+// Extracts the archive into target directory as a stream
+gboolean extract_archive(
+        const char *archive,
+        const char *target,
+        const copy_options *options,
+        copy_stats *stats);
+
+#endif // __HOME_ARCHIVE_H
+
+// vim: expandtab:ts=4:sw=4
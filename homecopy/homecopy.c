@@ -35,30 +35,57 @@
 ****************************************************************************************/
 
 #include <gio/gio.h>
+#include <gio/gunixinputstream.h>
 #include <glib.h>
+#include <glib-unix.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/inotify.h>
-#include <errno.h>
+#include <string.h>
 #include <unistd.h>
 #include "homecopy.h"
-#define COPY_SERVICE "home-encryption-copy.service"
-#define RESTORE_SERVICE "home-restore.service"
+#define PROBE_PROVIDER sailfish_homecopy
+#include "probes.h"
+#include "trace.h"
+
+#ifndef DATADIR
+#define DATADIR /usr/share/sailfish-device-encryption
+#endif
+
+#define QUOTE(s) #s
+#define STR(s) QUOTE(s)
+
+#define COPY_SCRIPT STR(DATADIR) "/home-encryption-copy.sh"
+#define RESTORE_SCRIPT STR(DATADIR) "/home-restore.sh"
+// Scripts pass this to sailfish-home-copy which writes progress to it
+#define PROGRESS_FD 3
+// and this which it reads requested paths from
+#define REQUEST_FD 4
 
 typedef struct {
     GMainLoop *main_loop;
-    GDBusConnection *connection;
-    GDBusProxy *systemd_manager;
-    int inotify_fd;
+    GSubprocess *process;
+    GDataInputStream *progress;
+    GCancellable *cancellable;
     void (*signal_emitter)(copy_result res);
+    copy_progress_func progress_emitter;
+    gboolean cancelled;
+    // Second run of the restore script for the deferred directories
+    gboolean deferred;
+    int requests;
+    gint64 started;
 } manage_data;
 
 static copy_state state = NOT_COPYING;
-static char service[50];
+static const char *service;
+static copy_progress last_progress;
 
 static manage_data *private_data = NULL;
-static const char *copy_done_file = "/tmp/.sailfish_copy_done";
 static const char *copy_conf_file = "/var/lib/sailfish-device-encryption/home_copy.conf";
+// Left by the restore script while deferred directories are on the card
+static const char *deferred_file = "/var/lib/sailfish-device-encryption/home_restore_deferred";
+static void (*deferred_emitter)(copy_result res);
 
 void set_copy_done()
 {
@@ -67,109 +94,165 @@ void set_copy_done()
 
 static void free_manage_data()
 {
+    g_cancellable_cancel(private_data->cancellable);
     g_main_loop_unref(private_data->main_loop);
-    g_object_unref(private_data->connection);
-    g_object_unref(private_data->systemd_manager);
+    g_clear_object(&private_data->process);
+    g_clear_object(&private_data->progress);
+    g_clear_object(&private_data->cancellable);
+    if (private_data->requests >= 0)
+        close(private_data->requests);
     g_free(private_data);
+    private_data = NULL;
 }
 
-static void exit_with_error(GError *error)
+static void copy(
+        GMainLoop *main_loop,
+        gboolean deferred,
+        void (*emit_signal)(copy_result res),
+        copy_progress_func emit_progress);
+
+static void copy_finished(copy_result res)
 {
-    if (error != NULL) {
-        fprintf(stderr, "%s\n", error->message);
-        g_error_free(error);
-    }
-    private_data->signal_emitter(COPY_PROCESS_ERROR);
+    GMainLoop *main_loop = g_main_loop_ref(private_data->main_loop);
+    copy_progress_func emit_progress = private_data->progress_emitter;
+    const char *name = !strcmp(service, COPY_SCRIPT) ? "Copy"
+            : private_data->deferred ? "DeferredRestore" : "Restore";
+    gboolean restored;
+
+    PROBE(copy_end, service, res);
+    if (res == COPY_PROCESS_ERROR)
+        fprintf(stderr, "%s failed to run\n", service);
+    /*
+     * Restoration UI restarts the user services that cached the empty
+     * home as soon as it gets this, there is nothing to wait for here
+     */
+    private_data->signal_emitter(res);
+    trace_span("homecopy", name, private_data->started);
+    printf("%s: done in %" G_GINT64_FORMAT " ms\n", name,
+           (trace_now() - private_data->started) / 1000);
+
+    restored = !strcmp(service, RESTORE_SCRIPT) && !private_data->deferred
+            && !private_data->cancelled && res == COPY_SUCCESS;
+
     set_copy_done();
-    g_main_loop_quit(private_data->main_loop);
     free_manage_data();
-}
 
-copy_result wait_for_copy()
-{
-    char _Alignas(struct inotify_event) buf[4096];
-    const struct inotify_event *event = NULL;
-    ssize_t len = 0;
-
-    while (len = read(private_data->inotify_fd, buf, sizeof buf), len > 0) {
-        if (len == -1 && errno != EAGAIN) {
-            fprintf(stderr, "inotify read failed\n");
-            return COPY_PROCESS_ERROR;
-        }
-        for (char *ptr = buf; ptr < buf + len;
-                ptr += sizeof(struct inotify_event) + event->len) {
-            event = (const struct inotify_event *) ptr;
-            if (event->mask & IN_CLOSE_WRITE) {
-                FILE *f = fopen(copy_done_file, "r");
-                int copy_res = 1;
-                if (fscanf(f, "%d", &copy_res)) {
-                    fclose(f);
-                    return (copy_res == 0) ? COPY_SUCCESS : COPY_FAILED;
-                }
-            }
-        }
-    }
-    return COPY_PROCESS_ERROR;
+    // Rest of home is restored while the user session is in use
+    if (restored && g_file_test(deferred_file, G_FILE_TEST_EXISTS))
+        copy(main_loop, TRUE, deferred_emitter, emit_progress);
+    g_main_loop_unref(main_loop);
 }
 
-// a marker file is used to track the status of the copy operation.
-static void init_watcher()
+static void read_progress(manage_data *data);
+
+static void got_progress(GObject *stream, GAsyncResult *res, gpointer user_data)
 {
-    FILE *file = fopen(copy_done_file, "w");
-    if (file == NULL) {
-        exit_with_error(NULL);
+    manage_data *data = user_data;
+    copy_progress progress;
+    GError *error = NULL;
+    gchar *line;
+
+    line = g_data_input_stream_read_line_finish_utf8(
+            G_DATA_INPUT_STREAM(stream), res, NULL, &error);
+    if (line == NULL) {
+        // End of stream or copy is over already
+        if (error != NULL && !g_error_matches(error, G_IO_ERROR,
+                                              G_IO_ERROR_CANCELLED))
+            fprintf(stderr, "Reading copy progress failed: %s\n",
+                    error->message);
+        g_clear_error(&error);
         return;
     }
-    fprintf(file, "%d", 1);
-    fclose(file);
-    private_data->inotify_fd = inotify_init();
-    inotify_add_watch(private_data->inotify_fd, copy_done_file, IN_CLOSE_WRITE);
+
+    if (sscanf(line, "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %"
+               G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+               " %" G_GINT64_FORMAT, &progress.files_done,
+               &progress.files_total, &progress.bytes_done,
+               &progress.bytes_total, &progress.bytes_per_second,
+               &progress.eta) == 6) {
+        last_progress = progress;
+        data->progress_emitter(&progress, NULL);
+    }
+    g_free(line);
+
+    read_progress(data);
 }
 
-static void started_copy_service(GObject *proxy, GAsyncResult *res, gpointer data)
+static void read_progress(manage_data *data)
 {
-    GError *error = NULL;
-    GVariant *result = g_dbus_proxy_call_finish((GDBusProxy *)proxy, res, &error);
-    if (result == NULL) {
-        exit_with_error(error);
-        return;
-    }
-    copy_result copy_res = wait_for_copy();
-    private_data->signal_emitter(copy_res);
-    set_copy_done();
-    g_main_loop_quit(private_data->main_loop);
-    free_manage_data();
-    g_variant_unref(result);
+    g_data_input_stream_read_line_async(data->progress, G_PRIORITY_DEFAULT,
+                                        data->cancellable, got_progress, data);
 }
 
-static void got_subscription(GObject *proxy, GAsyncResult *res, gpointer data)
+static void process_exited(GObject *process, GAsyncResult *res, gpointer user_data)
 {
     GError *error = NULL;
-    GVariant *result = g_dbus_proxy_call_finish((GDBusProxy *)proxy, res, &error);
-    if (result == NULL) {
-        exit_with_error(error);
-        return;
+
+    if (!g_subprocess_wait_finish(G_SUBPROCESS(process), res, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        copy_finished(COPY_PROCESS_ERROR);
+    } else if (g_subprocess_get_if_exited(G_SUBPROCESS(process))
+               && g_subprocess_get_exit_status(G_SUBPROCESS(process)) == 0) {
+        copy_finished(COPY_SUCCESS);
+    } else {
+        copy_finished(COPY_FAILED);
     }
-    init_watcher();
+}
 
-    g_dbus_proxy_call(private_data->systemd_manager, "StartUnit",
-                      g_variant_new("(ss)", service, "replace"),
-                      G_DBUS_CALL_FLAGS_NONE, -1, NULL, started_copy_service, &error);
-    g_variant_unref(result);
+// Script and the copy tool it runs are cancelled together
+static void new_process_group(gpointer user_data)
+{
+    setpgid(0, 0);
 }
 
-static void got_systemd_manager(GObject *proxy, GAsyncResult *res, gpointer data)
+// Script result comes from its exit status, progress from a pipe
+static gboolean start_script(GError **error)
 {
-    GError *error = NULL;
-    private_data->systemd_manager = g_dbus_proxy_new_finish(res, &error);
+    GSubprocessLauncher *launcher;
+    GInputStream *stream;
+    gint requests[2];
+    gint fds[2];
 
-    if (private_data->systemd_manager == NULL) {
-        exit_with_error(error);
-        return;
+    if (!g_unix_open_pipe(fds, FD_CLOEXEC, error))
+        return FALSE;
+    if (!g_unix_open_pipe(requests, FD_CLOEXEC, error)) {
+        close(fds[0]);
+        close(fds[1]);
+        return FALSE;
     }
-    g_dbus_proxy_call(private_data->systemd_manager, "Subscribe",
-                      NULL, G_DBUS_CALL_FLAGS_NONE, -1,
-                      NULL, got_subscription, NULL);
+    // Requests are dropped rather than block the service
+    g_unix_set_fd_nonblocking(requests[1], TRUE, NULL);
+    private_data->requests = requests[1];
+
+    launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_NONE);
+    g_subprocess_launcher_set_child_setup(launcher, new_process_group,
+                                          NULL, NULL);
+    g_subprocess_launcher_take_fd(launcher, fds[1], PROGRESS_FD);
+    g_subprocess_launcher_setenv(launcher, "COPY_PROGRESS_FD",
+                                 STR(PROGRESS_FD), TRUE);
+    g_subprocess_launcher_take_fd(launcher, requests[0], REQUEST_FD);
+    g_subprocess_launcher_setenv(launcher, "COPY_REQUEST_FD",
+                                 STR(REQUEST_FD), TRUE);
+    private_data->process = g_subprocess_launcher_spawn(
+            launcher, error, "/bin/sh", service,
+            private_data->deferred ? "--deferred" : NULL, NULL);
+    // Closes the write end of the pipe in this process
+    g_object_unref(launcher);
+
+    if (private_data->process == NULL) {
+        close(fds[0]);
+        return FALSE;
+    }
+
+    stream = g_unix_input_stream_new(fds[0], TRUE);
+    private_data->progress = g_data_input_stream_new(stream);
+    g_object_unref(stream);
+
+    read_progress(private_data);
+    g_subprocess_wait_async(private_data->process, NULL, process_exited,
+                            NULL);
+    return TRUE;
 }
 
 // If path is empty remove copy_conf_file
@@ -194,46 +277,124 @@ gboolean set_copy_location(gchar *path)
     return FALSE;
 }
 
-static void got_bus(GObject *proxy, GAsyncResult *res, gpointer data)
+copy_state get_copy_state()
 {
-    GError *error = NULL;
-    private_data->connection = g_bus_get_finish(res, &error);
-    if (private_data->connection == NULL) {
-        exit_with_error(error);
-        return;
-    }
-    g_dbus_proxy_new(private_data->connection, G_DBUS_PROXY_FLAGS_NONE, NULL,
-                     "org.freedesktop.systemd1",
-                     "/org/freedesktop/systemd1",
-                     "org.freedesktop.systemd1.Manager",
-                     NULL, got_systemd_manager, NULL);
+    return state;
 }
 
-copy_state get_copy_state()
+copy_state get_copy_progress(copy_progress *progress)
 {
+    *progress = last_progress;
     return state;
 }
 
-void copy(GMainLoop *main_loop, void (*emit_signal)(copy_result res))
+/*
+ * Copy ends as failed when the script exits. Interrupted copies resume
+ * from their manifests and partial archives are removed by the scripts.
+ */
+gboolean cancel_copy(void)
 {
+    const gchar *pid;
+
+    if (private_data == NULL || private_data->process == NULL)
+        return FALSE;
+
+    pid = g_subprocess_get_identifier(private_data->process);
+    if (pid == NULL)
+        return FALSE;
+
+    printf("Cancelling %s\n", service);
+    PROBE(copy_cancel, service);
+    private_data->cancelled = TRUE;
+    return kill(-atoi(pid), SIGTERM) == 0;
+}
+
+/*
+ * Paths are absolute paths under /home. The copy tool restores a
+ * requested path before the rest of the deferred directories.
+ */
+gboolean prioritize_restore(const gchar *path)
+{
+    gchar *line;
+    gboolean success;
+
+    if (private_data == NULL || !private_data->deferred
+            || private_data->requests < 0)
+        return FALSE;
+    if (!g_path_is_absolute(path) || strchr(path, '\n') != NULL)
+        return FALSE;
+
+    line = g_strconcat(path, "\n", NULL);
+    success = write(private_data->requests, line, strlen(line))
+            == (ssize_t)strlen(line);
+    if (!success)
+        fprintf(stderr, "Could not request %s: %m\n", path);
+    g_free(line);
+    return success;
+}
+
+static void copy(
+        GMainLoop *main_loop,
+        gboolean deferred,
+        void (*emit_signal)(copy_result res),
+        copy_progress_func emit_progress)
+{
+    GError *error = NULL;
+
     state = COPYING;
+    PROBE(copy_start, service);
+    memset(&last_progress, 0, sizeof(last_progress));
+    last_progress.eta = -1;
     if (private_data == NULL)
         private_data = g_new0(manage_data, 1);
-    private_data->main_loop = main_loop;
+    private_data->deferred = deferred;
+    private_data->requests = -1;
+    private_data->started = trace_now();
+    private_data->main_loop = g_main_loop_ref(main_loop);
     private_data->signal_emitter = emit_signal;
-    g_bus_get(G_BUS_TYPE_SYSTEM, NULL, got_bus, NULL);
+    private_data->progress_emitter = emit_progress;
+    private_data->cancellable = g_cancellable_new();
+
+    if (!start_script(&error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        copy_finished(COPY_PROCESS_ERROR);
+    }
 }
 
-void copy_home(GMainLoop *main_loop, void (*emit_signal)(copy_result res))
+void copy_home(
+        GMainLoop *main_loop,
+        void (*emit_signal)(copy_result res),
+        copy_progress_func emit_progress)
 {
     printf("Starting home copy\n");
-    strcpy(service, COPY_SERVICE);
-    copy(main_loop, emit_signal);
+    service = COPY_SCRIPT;
+    copy(main_loop, FALSE, emit_signal, emit_progress);
 }
 
-void restore_home(GMainLoop *main_loop, void (*emit_signal)(copy_result res))
+void restore_home(
+        GMainLoop *main_loop,
+        void (*emit_signal)(copy_result res),
+        void (*emit_deferred)(copy_result res),
+        copy_progress_func emit_progress)
 {
     printf("Starting home restoration\n");
-    strcpy(service, RESTORE_SERVICE);
-    copy(main_loop, emit_signal);
+    service = RESTORE_SCRIPT;
+    deferred_emitter = emit_deferred;
+    copy(main_loop, FALSE, emit_signal, emit_progress);
+}
+
+gboolean restore_deferred_home(
+        GMainLoop *main_loop,
+        void (*emit_deferred)(copy_result res),
+        copy_progress_func emit_progress)
+{
+    if (state == COPYING || !g_file_test(deferred_file, G_FILE_TEST_EXISTS))
+        return FALSE;
+
+    printf("Resuming restoration of deferred home directories\n");
+    service = RESTORE_SCRIPT;
+    deferred_emitter = emit_deferred;
+    copy(main_loop, TRUE, emit_deferred, emit_progress);
+    return TRUE;
 }
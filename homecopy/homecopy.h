@@ -37,6 +37,9 @@
 #ifndef __COPY_HOME_H
 #define __COPY_HOME_H
 
+#include <glib.h>
+#include "progress.h"
+
 typedef enum _copy_state {
     NOT_COPYING,
     COPYING
@@ -50,8 +53,31 @@ typedef enum _copy_result {
 
 copy_state get_copy_state();
 void set_copy_done();
-void copy_home(GMainLoop *main_loop, void (*emit_signal)(copy_result res));
-void restore_home(GMainLoop *main_loop, void (*emit_signal)(copy_result res));
+// Progress of the copy is reported to emit_progress as it is copied
+void copy_home(
+        GMainLoop *main_loop,
+        void (*emit_signal)(copy_result res),
+        copy_progress_func emit_progress);
+/*
+ * Restores home in two parts. emit_signal gets the result of the first
+ * part, after which the deferred directories are restored in the
+ * background and emit_deferred gets their result.
+ */
+void restore_home(
+        GMainLoop *main_loop,
+        void (*emit_signal)(copy_result res),
+        void (*emit_deferred)(copy_result res),
+        copy_progress_func emit_progress);
+// Resumes an interrupted restoration of the deferred part, if any
+gboolean restore_deferred_home(
+        GMainLoop *main_loop,
+        void (*emit_deferred)(copy_result res),
+        copy_progress_func emit_progress);
+// Restores path next if the deferred part is being restored
+gboolean prioritize_restore(const gchar *path);
 gboolean set_copy_location(gchar *path);
+// Latest progress of the ongoing or last copy
+copy_state get_copy_progress(copy_progress *progress);
+gboolean cancel_copy(void);
 
 #endif // __COPY_HOME_H
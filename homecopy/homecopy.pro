@@ -1,13 +1,36 @@
 TEMPLATE = aux
 
 HEADERS += \
+    checksum.h \
+    copyengine.h \
     copyservice.h \
-    homecopy.h
+    exclusion.h \
+    homearchive.h \
+    homecopy.h \
+    manifest.h \
+    progress.h \
+    sizecache.h \
+    staging.h \
+    verify.h \
+    volumes.h
 
 SOURCES += \
+    checksum.c \
+    copyengine.c \
     copyservice.c \
-    homecopy.c
+    copytool.c \
+    exclusion.c \
+    homearchive.c \
+    homecopy.c \
+    manifest.c \
+    progress.c \
+    sizecache.c \
+    staging.c \
+    verify.c \
+    volumes.c
 
 OTHER_FILES += \
-    dbus-org.sailfishos.HomeCopyService.service \
-    org.sailfishos.HomeCopyService.*
+    exclude.d/*.conf \
+    home-restore-deferred.service \
+    org.sailfishos.HomeCopyService.* \
+    tests/*
@@ -0,0 +1,345 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "manifest.h"
+
+#define MANIFEST_HEADER "# sailfish-home-copy manifest 1\n"
+#define MAX_CHECKSUM_LENGTH 128
+#define REMOVED "-"
+
+typedef struct {
+    gchar *checksum;
+    guint64 size;
+    struct timespec mtime;
+    // Time stamps of the target may be coarser than the source
+    struct timespec target_mtime;
+    gboolean seen;
+} manifest_entry;
+
+struct _manifest {
+    gchar *path;
+    FILE *file;
+    GHashTable *entries;
+    GMutex lock;
+};
+
+static void entry_free(gpointer data)
+{
+    manifest_entry *entry = data;
+
+    g_free(entry->checksum);
+    g_free(entry);
+}
+
+static gboolean same_time(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static void write_entry(FILE *file, const char *path, manifest_entry *entry)
+{
+    gchar *escaped = g_strescape(path, NULL);
+
+    fprintf(file, "%s %" G_GUINT64_FORMAT " %ld.%09ld %ld.%09ld %s\n",
+            entry->checksum, entry->size,
+            (long)entry->mtime.tv_sec, entry->mtime.tv_nsec,
+            (long)entry->target_mtime.tv_sec, entry->target_mtime.tv_nsec,
+            escaped);
+    g_free(escaped);
+}
+
+// Incomplete last line of an interrupted copy is ignored
+static void parse_line(manifest *m, char *line, ssize_t length)
+{
+    char checksum[MAX_CHECKSUM_LENGTH + 1];
+    manifest_entry *entry;
+    guint64 size;
+    long mtime, mtime_nsec, target_mtime, target_mtime_nsec;
+    int offset = 0;
+
+    if (line[0] == '#' || length < 1 || line[length - 1] != '\n')
+        return;
+    line[length - 1] = '\0';
+
+    if (sscanf(line, "%128s %" G_GUINT64_FORMAT " %ld.%ld %ld.%ld%n",
+               checksum, &size, &mtime, &mtime_nsec, &target_mtime,
+               &target_mtime_nsec, &offset) != 6
+            || line[offset] != ' ' || line[offset + 1] == '\0')
+        return;
+
+    if (!strcmp(checksum, REMOVED)) {
+        gchar *path = g_strcompress(line + offset + 1);
+        g_hash_table_remove(m->entries, path);
+        g_free(path);
+        return;
+    }
+
+    entry = g_new0(manifest_entry, 1);
+    entry->checksum = g_strdup(checksum);
+    entry->size = size;
+    entry->mtime.tv_sec = mtime;
+    entry->mtime.tv_nsec = mtime_nsec;
+    entry->target_mtime.tv_sec = target_mtime;
+    entry->target_mtime.tv_nsec = target_mtime_nsec;
+    g_hash_table_replace(m->entries, g_strcompress(line + offset + 1), entry);
+}
+
+static gboolean load(manifest *m)
+{
+    FILE *file = fopen(m->path, "r");
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+
+    if (file == NULL)
+        return FALSE;
+
+    while ((length = getline(&line, &size, file)) != -1)
+        parse_line(m, line, length);
+
+    free(line);
+    fclose(file);
+    printf("Loaded %u entries from %s\n", g_hash_table_size(m->entries),
+           m->path);
+    return TRUE;
+}
+
+static manifest *manifest_new(const char *path)
+{
+    manifest *m = g_new0(manifest, 1);
+
+    m->path = g_strdup(path);
+    m->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                       entry_free);
+    g_mutex_init(&m->lock);
+    return m;
+}
+
+manifest *manifest_load(const char *path)
+{
+    manifest *m = manifest_new(path);
+
+    if (!load(m)) {
+        manifest_close(m, FALSE);
+        return NULL;
+    }
+    return m;
+}
+
+manifest *manifest_open(const char *path)
+{
+    manifest *m = manifest_new(path);
+
+    // Missing manifest is the start of a new copy
+    if (!load(m) && errno != ENOENT) {
+        manifest_close(m, FALSE);
+        return NULL;
+    }
+
+    m->file = fopen(path, "a");
+    if (m->file == NULL) {
+        manifest_close(m, FALSE);
+        return NULL;
+    }
+
+    // Each entry reaches the file once its line is complete
+    setvbuf(m->file, NULL, _IOLBF, 0);
+    if (ftell(m->file) == 0)
+        fputs(MANIFEST_HEADER, m->file);
+    return m;
+}
+
+static gboolean compact(manifest *m)
+{
+    gchar *path = g_strconcat(m->path, ".new", NULL);
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+    FILE *file;
+    gboolean success;
+
+    file = fopen(path, "w");
+    if (file == NULL) {
+        g_free(path);
+        return FALSE;
+    }
+
+    fputs(MANIFEST_HEADER, file);
+    g_hash_table_iter_init(&iter, m->entries);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (((manifest_entry *)value)->seen)
+            write_entry(file, key, value);
+    }
+
+    success = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    success = fclose(file) == 0 && success;
+    if (success)
+        success = rename(path, m->path) == 0;
+    else
+        unlink(path);
+    g_free(path);
+    return success;
+}
+
+void manifest_close(manifest *m, gboolean compact_entries)
+{
+    if (m->file != NULL)
+        fclose(m->file);
+    if (compact_entries && !compact(m))
+        fprintf(stderr, "Could not rewrite %s: %s\n", m->path, strerror(errno));
+
+    g_hash_table_unref(m->entries);
+    g_mutex_clear(&m->lock);
+    g_free(m->path);
+    g_free(m);
+}
+
+gboolean manifest_unchanged(
+        manifest *m,
+        const char *path,
+        const struct stat *source,
+        const struct stat *target)
+{
+    manifest_entry *entry;
+    gboolean unchanged;
+
+    g_mutex_lock(&m->lock);
+    entry = g_hash_table_lookup(m->entries, path);
+    unchanged = entry != NULL
+            && entry->size == (guint64)source->st_size
+            && same_time(&entry->mtime, &source->st_mtim)
+            && target->st_size == source->st_size
+            && same_time(&entry->target_mtime, &target->st_mtim);
+    if (unchanged)
+        entry->seen = TRUE;
+    g_mutex_unlock(&m->lock);
+    return unchanged;
+}
+
+void manifest_add(
+        manifest *m,
+        const char *path,
+        const struct stat *source,
+        const struct stat *target,
+        const char *checksum)
+{
+    manifest_entry *entry = g_new0(manifest_entry, 1);
+
+    entry->checksum = g_strdup(checksum);
+    entry->size = source->st_size;
+    entry->mtime = source->st_mtim;
+    entry->target_mtime = target->st_mtim;
+    entry->seen = TRUE;
+
+    g_mutex_lock(&m->lock);
+    if (m->file != NULL)
+        write_entry(m->file, path, entry);
+    g_hash_table_replace(m->entries, g_strdup(path), entry);
+    g_mutex_unlock(&m->lock);
+}
+
+GPtrArray *manifest_take_unseen(manifest *m)
+{
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+
+    g_mutex_lock(&m->lock);
+    g_hash_table_iter_init(&iter, m->entries);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (!((manifest_entry *)value)->seen) {
+            g_ptr_array_add(paths, g_strdup(key));
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+    g_mutex_unlock(&m->lock);
+    return paths;
+}
+
+void manifest_remove(manifest *m, const char *path)
+{
+    manifest_entry removed = { .checksum = REMOVED };
+
+    g_mutex_lock(&m->lock);
+    if (g_hash_table_remove(m->entries, path) && m->file != NULL)
+        write_entry(m->file, path, &removed);
+    g_mutex_unlock(&m->lock);
+}
+
+gchar *manifest_lookup(
+        manifest *m,
+        const char *path,
+        const struct stat *source)
+{
+    manifest_entry *entry;
+    gchar *checksum = NULL;
+
+    g_mutex_lock(&m->lock);
+    entry = g_hash_table_lookup(m->entries, path);
+    if (entry != NULL && entry->size == (guint64)source->st_size
+            && (same_time(&entry->mtime, &source->st_mtim)
+                || same_time(&entry->target_mtime, &source->st_mtim)))
+        checksum = g_strdup(entry->checksum);
+    g_mutex_unlock(&m->lock);
+    return checksum;
+}
+
+void manifest_foreach_seen(manifest *m, manifest_func func, gpointer user_data)
+{
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+    manifest_entry *entry;
+
+    g_mutex_lock(&m->lock);
+    g_hash_table_iter_init(&iter, m->entries);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        entry = value;
+        if (entry->seen)
+            func(key, entry->checksum, entry->size, user_data);
+    }
+    g_mutex_unlock(&m->lock);
+}
+
+// vim: expandtab:ts=4:sw=4
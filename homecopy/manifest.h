@@ -0,0 +1,103 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#ifndef __MANIFEST_H
+#define __MANIFEST_H
+
+#include <glib.h>
+#include <sys/stat.h>
+
+/*
+ * Record of the files that a copy has completed. Each line holds the
+ * checksum, size and modification time of one source file, modification
+ * time of its copy and its escaped relative path. Entries are appended as
+ * files are copied, so the manifest of an interrupted copy is valid up to
+ * the last complete line and the latest line of a path wins. A removed
+ * path is recorded as a line with "-" for checksum. Copying again with
+ * the same manifest skips files that have not changed since.
+ *
+ * Checksums are made with checksum.h.
+ *
+ * All functions are safe to call from several threads.
+ */
+
+typedef struct _manifest manifest;
+
+typedef void (*manifest_func)(
+        const char *path,
+        const char *checksum,
+        guint64 size,
+        gpointer user_data);
+
+manifest *manifest_open(const char *path);
+// Read only manifest of an earlier copy, NULL with errno set if the file
+// can not be read
+manifest *manifest_load(const char *path);
+// Rewrites the manifest without older and unseen entries if compact is set
+void manifest_close(manifest *m, gboolean compact);
+/*
+ * TRUE if the entry of path matches the source and the target has the
+ * same size and time stamp. Such an entry is kept when compacting.
+ */
+gboolean manifest_unchanged(
+        manifest *m,
+        const char *path,
+        const struct stat *source,
+        const struct stat *target);
+void manifest_add(
+        manifest *m,
+        const char *path,
+        const struct stat *source,
+        const struct stat *target,
+        const char *checksum);
+// Removes and returns paths that were not seen in this copy
+GPtrArray *manifest_take_unseen(manifest *m);
+void manifest_remove(manifest *m, const char *path);
+/*
+ * Returns a copy of the checksum of path if its entry matches the size
+ * and time stamp of source, either as the source or as the copy of an
+ * earlier copy. NULL otherwise.
+ */
+gchar *manifest_lookup(
+        manifest *m,
+        const char *path,
+        const struct stat *source);
+// Calls func for the entries seen in this copy, the manifest is locked
+void manifest_foreach_seen(manifest *m, manifest_func func, gpointer user_data);
+
+#endif // __MANIFEST_H
+
+// vim: expandtab:ts=4:sw=4
@@ -0,0 +1,108 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#include <glib.h>
+#include <string.h>
+#include "progress.h"
+
+// Weight of the latest interval in the smoothed rate, percent
+#define RATE_WEIGHT 30
+
+void progress_init(
+        progress_tracker *tracker,
+        copy_progress_func func,
+        gpointer user_data,
+        guint64 files_total,
+        guint64 bytes_total)
+{
+    memset(tracker, 0, sizeof(*tracker));
+    tracker->func = func;
+    tracker->user_data = user_data;
+    tracker->progress.files_total = files_total;
+    tracker->progress.bytes_total = bytes_total;
+    tracker->progress.eta = -1;
+    tracker->last_report = g_get_monotonic_time();
+}
+
+static void report(progress_tracker *tracker, gint64 now)
+{
+    copy_progress *progress = &tracker->progress;
+    gint64 elapsed = now - tracker->last_report;
+    guint64 rate;
+
+    if (elapsed > 0) {
+        rate = (progress->bytes_done - tracker->last_bytes)
+                * G_USEC_PER_SEC / elapsed;
+        if (progress->bytes_per_second == 0)
+            progress->bytes_per_second = rate;
+        else
+            progress->bytes_per_second = (rate * RATE_WEIGHT
+                    + progress->bytes_per_second * (100 - RATE_WEIGHT)) / 100;
+    }
+
+    if (progress->bytes_per_second > 0
+            && progress->bytes_total >= progress->bytes_done)
+        progress->eta = (progress->bytes_total - progress->bytes_done)
+                / progress->bytes_per_second;
+
+    tracker->last_report = now;
+    tracker->last_bytes = progress->bytes_done;
+    tracker->func(progress, tracker->user_data);
+}
+
+void progress_update(progress_tracker *tracker, guint64 files, guint64 bytes)
+{
+    gint64 now;
+
+    tracker->progress.files_done += files;
+    tracker->progress.bytes_done += bytes;
+    if (tracker->func == NULL)
+        return;
+
+    now = g_get_monotonic_time();
+    if (now - tracker->last_report >= PROGRESS_INTERVAL)
+        report(tracker, now);
+}
+
+void progress_finish(progress_tracker *tracker)
+{
+    if (tracker->func != NULL) {
+        tracker->progress.eta = 0;
+        tracker->func(&tracker->progress, tracker->user_data);
+    }
+}
+
+// vim: expandtab:ts=4:sw=4
@@ -0,0 +1,83 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#ifndef __PROGRESS_H
+#define __PROGRESS_H
+
+#include <glib.h>
+
+/*
+ * Progress of a copy. Rate is smoothed over the reports and eta is -1
+ * until it can be estimated. Totals are 0 when they are not known.
+ */
+
+typedef struct {
+    guint64 files_done;
+    guint64 files_total;
+    guint64 bytes_done;
+    guint64 bytes_total;
+    guint64 bytes_per_second;
+    gint64 eta;
+} copy_progress;
+
+typedef void (*copy_progress_func)(
+        const copy_progress *progress,
+        gpointer user_data);
+
+// Reports at most this often, microseconds
+#define PROGRESS_INTERVAL (G_USEC_PER_SEC / 2)
+
+typedef struct {
+    copy_progress progress;
+    copy_progress_func func;
+    gpointer user_data;
+    gint64 last_report;
+    guint64 last_bytes;
+} progress_tracker;
+
+void progress_init(
+        progress_tracker *tracker,
+        copy_progress_func func,
+        gpointer user_data,
+        guint64 files_total,
+        guint64 bytes_total);
+// Not thread safe, callers serialize updates
+void progress_update(progress_tracker *tracker, guint64 files, guint64 bytes);
+void progress_finish(progress_tracker *tracker);
+
+#endif // __PROGRESS_H
+
+// vim: expandtab:ts=4:sw=4
@@ -0,0 +1,187 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#include <errno.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "exclusion.h"
+#include "sizecache.h"
+
+// Name of the line of the total, not a valid name of an entry
+#define TOTAL_NAME "."
+
+static void checksum_strings(GChecksum *checksum, const char * const *strings)
+{
+    for (; strings && *strings; strings++)
+        g_checksum_update(checksum, (const guchar *)*strings,
+                          strlen(*strings) + 1);
+    g_checksum_update(checksum, (const guchar *)"\n", 1);
+}
+
+gchar *size_cache_key(const char *source, const copy_options *options)
+{
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    const char *strings[] = { source, NULL };
+    gchar part[16];
+    gchar *key;
+
+    g_snprintf(part, sizeof(part), "%d", options->part);
+    checksum_strings(checksum, strings);
+    strings[0] = part;
+    checksum_strings(checksum, strings);
+    checksum_strings(checksum, options->exclude);
+    // Deferred directories count only when measuring a part
+    if (options->part != COPY_PART_ALL)
+        checksum_strings(checksum, options->defer);
+    exclusion_checksum(options->rules, checksum);
+    key = g_strdup(g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    return key;
+}
+
+static gboolean parse_line(char *line, copy_size *size, gchar **name)
+{
+    int offset;
+
+    g_strchomp(line);
+    if (sscanf(line, "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %"
+               G_GUINT64_FORMAT "%n", &size->files, &size->bytes,
+               &size->space, &offset) != 3 || line[offset] != ' ')
+        return FALSE;
+    *name = g_strcompress(line + offset + 1);
+    return TRUE;
+}
+
+gboolean size_cache_load(const char *path, const char *key, copy_scan *scan)
+{
+    gboolean total = FALSE;
+    copy_size *entry;
+    copy_size size;
+    struct stat st;
+    char *line = NULL;
+    size_t length = 0;
+    gchar *name;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return FALSE;
+    if (fstat(fileno(file), &st) < 0
+            || st.st_mtime + SIZE_CACHE_MAX_AGE < time(NULL)
+            || getline(&line, &length, file) == -1
+            || strncmp(line, key, strlen(key)) || line[strlen(key)] != ' ') {
+        free(line);
+        fclose(file);
+        return FALSE;
+    }
+
+    while (getline(&line, &length, file) != -1) {
+        if (!parse_line(line, &size, &name))
+            break;
+        if (!strcmp(name, TOTAL_NAME)) {
+            scan->total = size;
+            total = TRUE;
+            g_free(name);
+        } else {
+            entry = g_new(copy_size, 1);
+            *entry = size;
+            g_hash_table_replace(scan->entries, name, entry);
+        }
+    }
+    free(line);
+    fclose(file);
+
+    if (!total)
+        g_hash_table_remove_all(scan->entries);
+    return total;
+}
+
+static void write_line(FILE *file, const char *name, const copy_size *size)
+{
+    gchar *escaped = g_strescape(name, NULL);
+
+    fprintf(file, "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %"
+            G_GUINT64_FORMAT " %s\n", size->files, size->bytes, size->space,
+            escaped);
+    g_free(escaped);
+}
+
+void size_cache_save(
+        const char *path,
+        const char *key,
+        const char *source,
+        const copy_scan *scan)
+{
+    gchar *new_path = g_strconcat(path, ".new", NULL);
+    gchar *escaped = g_strescape(source, NULL);
+    GHashTableIter iter;
+    gpointer name;
+    gpointer size;
+    gboolean success;
+    FILE *file;
+
+    file = fopen(new_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "%s: open failed: %s\n", new_path, strerror(errno));
+        goto out;
+    }
+
+    fprintf(file, "%s %s\n", key, escaped);
+    write_line(file, TOTAL_NAME, &scan->total);
+    g_hash_table_iter_init(&iter, scan->entries);
+    while (g_hash_table_iter_next(&iter, &name, &size))
+        write_line(file, name, size);
+
+    success = fflush(file) == 0;
+    success = fclose(file) == 0 && success;
+    if (success)
+        success = rename(new_path, path) == 0;
+    if (!success) {
+        fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+        unlink(new_path);
+    }
+
+out:
+    g_free(escaped);
+    g_free(new_path);
+}
+
+// vim: expandtab:ts=4:sw=4
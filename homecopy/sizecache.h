@@ -0,0 +1,69 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#ifndef __SIZECACHE_H
+#define __SIZECACHE_H
+
+#include <glib.h>
+#include "copyengine.h"
+
+/*
+ * Sizes measured by copy_scan() kept for the next measure of the same
+ * tree with the same options, so that preparation, planning, copying and
+ * the settings share one walk of home. The first line holds the key of
+ * the source and options and the escaped source path. Each following line
+ * holds files, bytes and space of an entry at the top of the tree and its
+ * escaped name, and the total as ".". Results older than
+ * SIZE_CACHE_MAX_AGE are measured again. Changes to home are not
+ * detected, so the scripts keep the file in /run and remove it when they
+ * start.
+ */
+
+#define SIZE_CACHE_MAX_AGE (10 * 60)
+
+// Key of the measure of source with options, free with g_free()
+gchar *size_cache_key(const char *source, const copy_options *options);
+// FALSE if path has no fresh sizes for key
+gboolean size_cache_load(const char *path, const char *key, copy_scan *scan);
+void size_cache_save(
+        const char *path,
+        const char *key,
+        const char *source,
+        const copy_scan *scan);
+
+#endif // __SIZECACHE_H
+
+// vim: expandtab:ts=4:sw=4
@@ -0,0 +1,327 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+#include "exclusion.h"
+#include "staging.h"
+
+#define MEMINFO_FILE "/proc/meminfo"
+#define PRESSURE_FILE "/proc/pressure/memory"
+#define RESERVE_MIN (128ULL * 1024 * 1024)
+// Sixth of memory, a third of the usual tmpfs of half of the memory
+#define RESERVE_SHARE 6
+// Percentage of time stalled on memory that is too much to go on with
+#define PRESSURE_LIMIT 10.0
+// zram compresses pages one by one, so are the samples
+#define SAMPLE_PAGE_SIZE 4096
+#define SAMPLE_PAGES_PER_FILE 4
+#define SAMPLE_PAGES_MAX 4096
+// Allocator overhead of zram and pages that compress worse than the sample
+#define RATIO_MARGIN 0.9
+#define RATIO_MAX 3.0
+// Filesystem metadata and journal-less ext4 overhead on the zram device
+#define DEVICE_OVERHEAD_SHARE 4
+#define DEVICE_OVERHEAD_MIN (64ULL * 1024 * 1024)
+
+typedef struct {
+    // Sampled pages and their size after compression
+    guint64 pages;
+    guint64 compressed;
+    // Space of sampled files and its estimated size after compression
+    guint64 sampled_space;
+    gdouble estimated;
+} sample_state;
+
+gboolean memory_status_read(memory_status *status)
+{
+    char line[256];
+    unsigned long long value;
+    double avg10;
+    FILE *file;
+
+    memset(status, 0, sizeof(*status));
+    file = fopen(MEMINFO_FILE, "r");
+    if (file == NULL)
+        return FALSE;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "MemTotal: %llu kB", &value) == 1)
+            status->total = value * 1024;
+        else if (sscanf(line, "MemAvailable: %llu kB", &value) == 1)
+            status->available = value * 1024;
+    }
+    fclose(file);
+
+    // Kernels without pressure stall information have no file
+    file = fopen(PRESSURE_FILE, "r");
+    if (file != NULL) {
+        while (fgets(line, sizeof(line), file) != NULL) {
+            if (sscanf(line, "some avg10=%lf", &avg10) == 1)
+                status->some_avg10 = avg10;
+            else if (sscanf(line, "full avg10=%lf", &avg10) == 1)
+                status->full_avg10 = avg10;
+        }
+        fclose(file);
+    }
+    return status->total > 0;
+}
+
+guint64 staging_reserve(const memory_status *status)
+{
+    return MAX(RESERVE_MIN, status->total / RESERVE_SHARE);
+}
+
+guint64 staging_room(
+        const char *target,
+        const memory_status *status,
+        gdouble ratio)
+{
+    guint64 reserve = staging_reserve(status);
+    struct statvfs fs;
+    guint64 memory;
+
+    memory = status->available > reserve ? status->available - reserve : 0;
+    memory = memory * ratio;
+    if (target == NULL)
+        return memory;
+    if (statvfs(target, &fs) < 0)
+        return 0;
+    return MIN((guint64)fs.f_bavail * fs.f_frsize, memory);
+}
+
+staging_plan staging_choose(
+        const char *target,
+        gdouble ratio,
+        guint64 all_size,
+        guint64 users_size)
+{
+    memory_status status;
+    guint64 room;
+
+    if (!memory_status_read(&status))
+        return STAGING_NONE;
+
+    // Memory that is already short does not take more data
+    room = status.some_avg10 > PRESSURE_LIMIT ? 0
+            : staging_room(target, &status, ratio);
+    fprintf(stderr, "Staging room %" G_GUINT64_FORMAT " MiB on %s, home takes %"
+            G_GUINT64_FORMAT " MiB and user directories %" G_GUINT64_FORMAT
+            " MiB\n", room >> 20, target ? target : "zram", all_size >> 20,
+            users_size >> 20);
+
+    if (all_size <= room)
+        return STAGING_ALL;
+    if (users_size <= room)
+        return STAGING_USERS;
+    return STAGING_NONE;
+}
+
+gboolean staging_critical(const memory_status *status, guint64 reserve)
+{
+    return status->available < reserve / 2
+            || status->full_avg10 > PRESSURE_LIMIT;
+}
+
+static la_ssize_t count_compressed(
+        struct archive *out,
+        void *user_data,
+        const void *buffer,
+        size_t length)
+{
+    *(guint64 *)user_data += length;
+    return length;
+}
+
+// Size of one page after zstd compression, or its size if not compressible
+static guint64 compressed_size(const char *page, size_t length)
+{
+    struct archive_entry *entry;
+    struct archive *out;
+    guint64 size = 0;
+
+    out = archive_write_new();
+    entry = archive_entry_new();
+    archive_write_add_filter_zstd(out);
+    archive_write_set_format_raw(out);
+    archive_write_set_bytes_per_block(out, 0);
+    archive_entry_set_filetype(entry, AE_IFREG);
+    archive_entry_set_size(entry, length);
+    if (archive_write_open(out, &size, NULL, count_compressed, NULL) != ARCHIVE_OK
+            || archive_write_header(out, entry) != ARCHIVE_OK
+            || archive_write_data(out, page, length) < 0
+            || archive_write_close(out) != ARCHIVE_OK)
+        size = length;
+    archive_entry_free(entry);
+    archive_write_free(out);
+    return MIN(size, SAMPLE_PAGE_SIZE);
+}
+
+// Compresses a few pages spread over the file
+static void sample_file(int dir_fd, const char *name, const struct stat *st,
+                        sample_state *state)
+{
+    char page[SAMPLE_PAGE_SIZE];
+    guint64 compressed = 0;
+    guint64 pages = 0;
+    guint64 space;
+    ssize_t length;
+    off_t offset;
+    int fd;
+    int i;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    for (i = 0; i < SAMPLE_PAGES_PER_FILE; i++) {
+        offset = st->st_size / SAMPLE_PAGES_PER_FILE * i
+                / SAMPLE_PAGE_SIZE * SAMPLE_PAGE_SIZE;
+        if (i > 0 && offset < (off_t)(pages * SAMPLE_PAGE_SIZE))
+            break;
+        length = pread(fd, page, sizeof(page), offset);
+        if (length <= 0)
+            break;
+        // The rest of the page is zeros on the device
+        memset(page + length, 0, sizeof(page) - length);
+        compressed += compressed_size(page, sizeof(page));
+        pages++;
+    }
+    close(fd);
+    if (pages == 0)
+        return;
+
+    // Holes take no space on the device
+    space = (guint64)st->st_blocks * 512;
+    state->pages += pages;
+    state->compressed += compressed;
+    // Weighted by size, large files take most of the device
+    state->estimated += (gdouble)space * compressed
+            / (pages * SAMPLE_PAGE_SIZE);
+    state->sampled_space += space;
+}
+
+static void sample_directory(
+        int dir_fd,
+        const char *path,
+        const copy_options *options,
+        sample_state *state)
+{
+    DIR *dir = fdopendir(dir_fd);
+    struct dirent *entry;
+    struct stat st;
+    gchar *child;
+    int fd;
+
+    if (dir == NULL) {
+        close(dir_fd);
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL
+            && state->pages < SAMPLE_PAGES_MAX) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")
+                || (path[0] == '\0' && options->exclude
+                    && g_strv_contains(options->exclude, entry->d_name)))
+            continue;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+
+        child = path[0] ? g_build_filename(path, entry->d_name, NULL)
+                        : g_strdup(entry->d_name);
+        if (exclusion_match(options->rules, child) >= 0) {
+            g_free(child);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            fd = openat(dirfd(dir), entry->d_name,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0)
+                sample_directory(fd, child, options, state);
+        } else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            sample_file(dirfd(dir), entry->d_name, &st, state);
+        }
+        g_free(child);
+    }
+    closedir(dir);
+}
+
+gdouble staging_sample_ratio(const char *source, const copy_options *options)
+{
+    sample_state state = { 0 };
+    gdouble ratio;
+    int fd;
+
+    fd = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return 1.0;
+    sample_directory(fd, "", options, &state);
+    if (state.sampled_space == 0)
+        return 1.0;
+
+    ratio = state.sampled_space / MAX(state.estimated, 1.0);
+    fprintf(stderr, "Sampled %" G_GUINT64_FORMAT " pages of %"
+            G_GUINT64_FORMAT " MiB of files, compressed to %" G_GUINT64_FORMAT
+            " KiB, ratio %.2f\n", state.pages, state.sampled_space >> 20,
+            state.compressed >> 10, ratio);
+    return CLAMP(ratio * RATIO_MARGIN, 1.0, RATIO_MAX);
+}
+
+guint64 staging_device_size(guint64 size)
+{
+    return size + MAX(DEVICE_OVERHEAD_MIN, size / DEVICE_OVERHEAD_SHARE);
+}
+
+const char *staging_plan_name(staging_plan plan)
+{
+    switch (plan) {
+        case STAGING_ALL:
+            return "all";
+        case STAGING_USERS:
+            return "users";
+        default:
+            return "none";
+    }
+}
+
+// vim: expandtab:ts=4:sw=4
@@ -0,0 +1,99 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#ifndef __STAGING_H
+#define __STAGING_H
+
+#include <glib.h>
+#include "copyengine.h"
+
+/*
+ * Planning of home staging in memory during preparation. Home is copied
+ * to tmpfs, where it takes memory from the rest of the system. Planning
+ * leaves a reserve of memory free, and a copy that watches memory stops
+ * when the system gets short of memory or stalls on it, see
+ * /proc/pressure/memory, before the OOM killer picks a victim.
+ *
+ * Home that does not fit to tmpfs may still fit to a compressed zram
+ * device, which takes memory only for the compressed pages. Its room
+ * is estimated from the compression ratio of a sample of home.
+ */
+
+typedef struct {
+    // MemTotal and MemAvailable of /proc/meminfo in bytes
+    guint64 total;
+    guint64 available;
+    // Percentage of the last 10 seconds when tasks waited for memory,
+    // 0 without pressure stall information
+    gdouble some_avg10;
+    gdouble full_avg10;
+} memory_status;
+
+typedef enum {
+    // Copy all of home
+    STAGING_ALL,
+    // Copy only the home directories of users
+    STAGING_USERS,
+    // Create new home directories from /etc/skel
+    STAGING_NONE
+} staging_plan;
+
+gboolean memory_status_read(memory_status *status);
+// Memory to keep free for the rest of the system
+guint64 staging_reserve(const memory_status *status);
+// Bytes that fit to target, limited by its filesystem and free memory
+// compressed by ratio, NULL target is a new zram device
+guint64 staging_room(
+        const char *target,
+        const memory_status *status,
+        gdouble ratio);
+// Richest plan that fits, sizes are copy_size.space
+staging_plan staging_choose(
+        const char *target,
+        gdouble ratio,
+        guint64 all_size,
+        guint64 users_size);
+// Expected compression ratio of source on zram, at least 1
+gdouble staging_sample_ratio(const char *source, const copy_options *options);
+// Size of zram device for size bytes of files
+guint64 staging_device_size(guint64 size);
+// TRUE if copying more to memory puts the system at risk
+gboolean staging_critical(const memory_status *status, guint64 reserve);
+const char *staging_plan_name(staging_plan plan);
+
+#endif // __STAGING_H
+
+// vim: expandtab:ts=4:sw=4
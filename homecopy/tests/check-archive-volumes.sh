@@ -0,0 +1,91 @@
+#!/bin/sh
+
+# Archives a home of more than 4 GiB of incompressible data to a vfat
+# image, restores it in two parts like home-restore.sh and compares it
+# with the original. The archive must come out as volumes below 4 GiB.
+# Needs root for the loop device. Without vfat support the archive is
+# written to a directory with the volume size of vfat instead.
+#
+# Environment: HOME_SIZE of the random data in MiB and KEEP_WORKDIR=1 to
+# keep the files of a successful run.
+
+HOME_COPY=${1:-home-copy}
+HOME_SIZE=${HOME_SIZE:-4400}
+FAT_FILE_MAX=4294967295
+
+if [ "$(id -u)" != 0 ]; then
+    echo "check-archive-volumes must be run as root" >&2
+    exit 1
+fi
+
+# Needs room for home, the archive and the restored home
+WORKDIR=$(mktemp -d /var/tmp/check-archive.XXXXXX)
+LOOP=
+RESULT=1
+
+cleanup() {
+    mountpoint -q "$WORKDIR/card" && umount "$WORKDIR/card"
+    [ -n "$LOOP" ] && losetup -d $LOOP
+    if [ $RESULT -eq 0 ] && [ "$KEEP_WORKDIR" != 1 ]; then
+        rm -rf "$WORKDIR"
+    else
+        echo "Files are in $WORKDIR"
+    fi
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+# Media are deferred like in the home copy scripts
+mkdir -p "$WORKDIR/home/user/Pictures" "$WORKDIR/home/user/.config" \
+    "$WORKDIR/card"
+head -c ${HOME_SIZE}M /dev/urandom > "$WORKDIR/home/user/Pictures/big" \
+    || fail "could not create home"
+echo settings > "$WORKDIR/home/user/.config/settings"
+ln "$WORKDIR/home/user/.config/settings" "$WORKDIR/home/user/settings"
+ln -s .config "$WORKDIR/home/user/config"
+truncate -s 1G "$WORKDIR/home/user/sparse"
+
+VOLUME_SIZE=
+if command -v mkfs.vfat > /dev/null \
+        && { grep -qw vfat /proc/filesystems || modprobe vfat 2> /dev/null; }; then
+    truncate -s $(( HOME_SIZE + 1024 ))M "$WORKDIR/card.img"
+    LOOP=$(losetup -f --show "$WORKDIR/card.img") || exit 1
+    mkfs.vfat -F 32 $LOOP > /dev/null || exit 1
+    mount -t vfat $LOOP "$WORKDIR/card" || exit 1
+else
+    echo "No vfat, using volumes of vfat size in a directory"
+    VOLUME_SIZE="--volume-size 4095"
+fi
+
+ARCHIVE=$WORKDIR/card/home.tar.zst
+"$HOME_COPY" --defer '*/Pictures' $VOLUME_SIZE \
+    --manifest "$WORKDIR/card/home.manifest" --verify \
+    --archive "$WORKDIR/home" "$ARCHIVE" || fail "archiving"
+
+[ ! -e "$ARCHIVE" ] || fail "archive was not split"
+[ -f "$ARCHIVE.001" ] || fail "archive has one volume"
+for volume in "$ARCHIVE".[0-9][0-9][0-9]; do
+    [ $(stat -c %s "$volume") -le $FAT_FILE_MAX ] \
+        || fail "$volume does not fit to vfat"
+done
+
+for part in --first --deferred; do
+    "$HOME_COPY" --defer '*/Pictures' $part \
+        --expect "$WORKDIR/card/home.manifest" \
+        --manifest "$WORKDIR/restore.manifest" --verify \
+        --extract "$ARCHIVE" "$WORKDIR/restored" || fail "restoring $part"
+done
+
+diff -r --no-dereference "$WORKDIR/home" "$WORKDIR/restored" \
+    || fail "restored home differs"
+[ "$(stat -c %i "$WORKDIR/restored/user/settings")" \
+        = "$(stat -c %i "$WORKDIR/restored/user/.config/settings")" ] \
+    || fail "links were not restored"
+
+echo "PASS: restored $HOME_SIZE MiB from $(ls "$ARCHIVE".* | wc -l) volumes"
+RESULT=0
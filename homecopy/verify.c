@@ -0,0 +1,296 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "checksum.h"
+#include "verify.h"
+#include "volumes.h"
+
+#define BUFFER_SIZE (128 * 1024)
+
+typedef struct {
+    const copy_options *options;
+    manifest *manifest;
+    copy_stats *stats;
+    const char *target;
+    int target_dir;
+    GMutex lock;
+} verify_context;
+
+typedef struct {
+    gchar *path;
+    gchar *checksum;
+} verify_item;
+
+static void report(
+        const copy_options *options,
+        copy_stats *stats,
+        const char *path,
+        const char *operation,
+        int errnum)
+{
+    stats->errors++;
+    if (options->error)
+        options->error(path, operation, errnum, options->user_data);
+    else
+        fprintf(stderr, "%s: %s failed: %s\n", path, operation,
+                strerror(errnum));
+}
+
+static void failed(
+        verify_context *ctx,
+        const char *path,
+        const char *operation,
+        int errnum)
+{
+    gchar *full_path = g_build_filename(ctx->target, path, NULL);
+
+    g_mutex_lock(&ctx->lock);
+    report(ctx->options, ctx->stats, full_path, operation, errnum);
+    g_mutex_unlock(&ctx->lock);
+    manifest_remove(ctx->manifest, path);
+    g_free(full_path);
+}
+
+static void verify_file(gpointer data, gpointer user_data)
+{
+    verify_item *item = data;
+    verify_context *ctx = user_data;
+    char result[CHECKSUM_SIZE];
+    gchar *buffer;
+    int fd;
+
+    fd = openat(ctx->target_dir, item->path,
+                O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        failed(ctx, item->path, "open", errno);
+        goto out;
+    }
+
+    // Pages of the copy are clean after syncfs and can be dropped
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    buffer = g_malloc(BUFFER_SIZE);
+    if (!checksum_fd(fd, buffer, BUFFER_SIZE, result)) {
+        failed(ctx, item->path, "read", errno);
+    } else if (strcmp(result, item->checksum)) {
+        failed(ctx, item->path, "verify", EBADMSG);
+    } else {
+        g_mutex_lock(&ctx->lock);
+        ctx->stats->verified++;
+        g_mutex_unlock(&ctx->lock);
+    }
+    g_free(buffer);
+    close(fd);
+
+out:
+    g_free(item->path);
+    g_free(item->checksum);
+    g_free(item);
+}
+
+static void add_item(
+        const char *path,
+        const char *checksum,
+        guint64 size,
+        gpointer user_data)
+{
+    verify_item *item = g_new0(verify_item, 1);
+
+    item->path = g_strdup(path);
+    item->checksum = g_strdup(checksum);
+    g_ptr_array_add(user_data, item);
+}
+
+gboolean verify_tree(
+        const char *target,
+        manifest *m,
+        const copy_options *options,
+        copy_stats *stats)
+{
+    verify_context ctx = { 0 };
+    GPtrArray *items = g_ptr_array_new();
+    guint errors = stats->errors;
+    GThreadPool *pool = NULL;
+    GError *error = NULL;
+    guint i;
+
+    ctx.options = options;
+    ctx.manifest = m;
+    ctx.stats = stats;
+    ctx.target = target;
+    g_mutex_init(&ctx.lock);
+
+    ctx.target_dir = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ctx.target_dir < 0) {
+        report(options, stats, target, "open", errno);
+        goto out;
+    }
+    if (syncfs(ctx.target_dir) < 0) {
+        report(options, stats, target, "sync", errno);
+        goto out;
+    }
+
+    pool = g_thread_pool_new(verify_file, &ctx,
+                             options->threads ? options->threads
+                                              : g_get_num_processors(),
+                             FALSE, &error);
+    if (pool == NULL) {
+        report(options, stats, target, "thread pool", EAGAIN);
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        goto out;
+    }
+
+    // Workers remove failed entries, so the manifest is not locked for them
+    manifest_foreach_seen(m, add_item, items);
+    for (i = 0; i < items->len; i++)
+        g_thread_pool_push(pool, g_ptr_array_index(items, i), NULL);
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+out:
+    if (ctx.target_dir >= 0)
+        close(ctx.target_dir);
+    g_ptr_array_free(items, TRUE);
+    g_mutex_clear(&ctx.lock);
+    return stats->errors == errors;
+}
+
+static gboolean read_entry(
+        struct archive *in,
+        struct archive_entry *entry,
+        char result[CHECKSUM_SIZE])
+{
+    checksum *c = checksum_new();
+    guint64 position = 0;
+    const void *block;
+    size_t size;
+    la_int64_t offset;
+    int ret;
+
+    while ((ret = archive_read_data_block(in, &block, &size, &offset))
+            == ARCHIVE_OK) {
+        if ((guint64)offset > position)
+            checksum_update_zeros(c, offset - position);
+        checksum_update(c, block, size);
+        position = offset + size;
+    }
+    if (archive_entry_size(entry) > (la_int64_t)position)
+        checksum_update_zeros(c, archive_entry_size(entry) - position);
+
+    checksum_finish(c, result);
+    return ret == ARCHIVE_EOF;
+}
+
+gboolean verify_archive(
+        const char *archive,
+        gboolean partial,
+        manifest *m,
+        const copy_options *options,
+        copy_stats *stats)
+{
+    struct archive *in = archive_read_new();
+    volume_reader *reader = volume_reader_new(archive, partial, TRUE);
+    struct archive_entry *entry;
+    char result[CHECKSUM_SIZE];
+    guint errors = stats->errors;
+    const char *path;
+    gchar *expected;
+    int ret;
+
+    archive_read_support_format_tar(in);
+    archive_read_support_filter_zstd(in);
+    if (volume_reader_open(reader, in) != ARCHIVE_OK) {
+        fprintf(stderr, "%s: %s\n", archive, archive_error_string(in));
+        report(options, stats, archive, "open", EIO);
+        goto out;
+    }
+
+    for (;;) {
+        ret = archive_read_next_header(in, &entry);
+        if (ret == ARCHIVE_EOF) {
+            break;
+        } else if (ret < ARCHIVE_WARN) {
+            fprintf(stderr, "%s: %s\n", archive, archive_error_string(in));
+            report(options, stats, archive, "read", EIO);
+            break;
+        }
+
+        if (archive_entry_filetype(entry) != AE_IFREG
+                || archive_entry_hardlink(entry) != NULL)
+            continue;
+
+        path = archive_entry_pathname(entry);
+        expected = manifest_lookup(m, path, archive_entry_stat(entry));
+        if (!read_entry(in, entry, result)) {
+            report(options, stats, path, "read", EIO);
+        } else if (expected == NULL || strcmp(result, expected)) {
+            report(options, stats, path, "verify", EBADMSG);
+            manifest_remove(m, path);
+        } else {
+            stats->verified++;
+        }
+        g_free(expected);
+    }
+
+out:
+    archive_read_free(in);
+    volume_reader_free(reader);
+    return stats->errors == errors;
+}
+
+gboolean verify_expected(
+        manifest *expected,
+        const char *path,
+        const struct stat *st,
+        const char *checksum)
+{
+    gchar *earlier = manifest_lookup(expected, path, st);
+    // A file without an entry or with other size or time was changed too
+    gboolean matches = earlier != NULL && !strcmp(earlier, checksum);
+
+    g_free(earlier);
+    return matches;
+}
+
+// vim: expandtab:ts=4:sw=4
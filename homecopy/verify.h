@@ -0,0 +1,85 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#ifndef __VERIFY_H
+#define __VERIFY_H
+
+#include <glib.h>
+#include <sys/stat.h>
+#include "copyengine.h"
+#include "manifest.h"
+
+/*
+ * Verification of a finished copy against the checksums that its
+ * manifest got while the source was read. Written data is flushed and
+ * dropped from the page cache first, so the files are read back from
+ * the storage rather than from memory. Files of a tree are read by a
+ * pool of worker threads. A file that does not match is reported with
+ * EBADMSG and its entry is removed from the manifest, so that copying
+ * again with the manifest copies it again.
+ *
+ * Errors are reported and counted in stats like in copy_tree(). Only
+ * the errors and verified fields of stats are changed.
+ */
+
+// Verifies the files seen by the copy that made the manifest
+gboolean verify_tree(
+        const char *target,
+        manifest *m,
+        const copy_options *options,
+        copy_stats *stats);
+// Verifies regular files of a finished archive or its volumes
+gboolean verify_archive(
+        const char *archive,
+        gboolean partial,
+        manifest *m,
+        const copy_options *options,
+        copy_stats *stats);
+/*
+ * Compares a checksum with the one an earlier copy got for the same
+ * path, see manifest_lookup(). Returns FALSE if the file was changed
+ * without a change in its size and time stamp, i.e. it got corrupted, and
+ * also if it has no entry or its size or time stamp changed.
+ */
+gboolean verify_expected(
+        manifest *expected,
+        const char *path,
+        const struct stat *st,
+        const char *checksum);
+
+#endif // __VERIFY_H
+
+// vim: expandtab:ts=4:sw=4
@@ -0,0 +1,216 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#include <archive.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <linux/magic.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+#include "copyengine.h"
+#include "volumes.h"
+
+#define BLOCK_SIZE (1024 * 1024)
+
+struct _volume_reader {
+    gchar *archive;
+    gboolean partial;
+    gboolean sync;
+    // 0 if the archive is not split
+    gint volumes;
+    guint64 size;
+    // Volume being read and its path
+    gint index;
+    gchar *path;
+    int fd;
+    copy_pages pages;
+    gchar *buffer;
+};
+
+guint64 volume_size_for(const char *path)
+{
+    gchar *directory = g_path_get_dirname(path);
+    struct statfs fs;
+    guint64 size = 0;
+
+    if (statfs(directory, &fs) == 0 && fs.f_type == MSDOS_SUPER_MAGIC)
+        size = VOLUME_SIZE_FAT;
+    g_free(directory);
+    return size;
+}
+
+gchar *volume_path(const char *archive, gint index, gboolean partial)
+{
+    const char *suffix = partial ? ".partial" : "";
+
+    if (index < 0)
+        return g_strconcat(archive, suffix, NULL);
+    return g_strdup_printf("%s.%03d%s", archive, index, suffix);
+}
+
+volume_reader *volume_reader_new(
+        const char *archive,
+        gboolean partial,
+        gboolean sync)
+{
+    volume_reader *reader = g_new0(volume_reader, 1);
+    gchar *path = volume_path(archive, -1, partial);
+    struct stat st;
+
+    reader->archive = g_strdup(archive);
+    reader->partial = partial;
+    reader->sync = sync;
+    reader->index = -1;
+    reader->fd = -1;
+    reader->buffer = g_malloc(BLOCK_SIZE);
+
+    if (stat(path, &st) == 0) {
+        reader->size = st.st_size;
+    } else {
+        for (;;) {
+            g_free(path);
+            path = volume_path(archive, reader->volumes, partial);
+            if (stat(path, &st) < 0)
+                break;
+            reader->size += st.st_size;
+            reader->volumes++;
+        }
+    }
+    g_free(path);
+    return reader;
+}
+
+static void close_volume(volume_reader *reader)
+{
+    if (reader->fd >= 0) {
+        copy_release_pages(reader->fd, -1, &reader->pages, TRUE);
+        close(reader->fd);
+        reader->fd = -1;
+    }
+    g_free(reader->path);
+    reader->path = NULL;
+}
+
+// Leaves fd at -1 after the last volume
+static gboolean open_next(struct archive *in, volume_reader *reader)
+{
+    close_volume(reader);
+    reader->index++;
+    if (reader->index >= MAX(reader->volumes, 1))
+        return TRUE;
+
+    reader->path = volume_path(reader->archive,
+                               reader->volumes > 0 ? reader->index : -1,
+                               reader->partial);
+    memset(&reader->pages, 0, sizeof(reader->pages));
+    reader->fd = open(reader->path, O_RDONLY | O_CLOEXEC);
+    if (reader->fd < 0) {
+        archive_set_error(in, errno, "%s: open failed", reader->path);
+        return FALSE;
+    }
+    if (reader->sync) {
+        if (fdatasync(reader->fd) < 0) {
+            archive_set_error(in, errno, "%s: sync failed", reader->path);
+            close_volume(reader);
+            return FALSE;
+        }
+        posix_fadvise(reader->fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    return TRUE;
+}
+
+static int open_volumes(struct archive *in, void *data)
+{
+    return open_next(in, data) ? ARCHIVE_OK : ARCHIVE_FATAL;
+}
+
+static la_ssize_t read_volumes(
+        struct archive *in,
+        void *data,
+        const void **buffer)
+{
+    volume_reader *reader = data;
+    ssize_t length;
+
+    *buffer = reader->buffer;
+    while (reader->fd >= 0) {
+        length = read(reader->fd, reader->buffer, BLOCK_SIZE);
+        if (length > 0) {
+            reader->pages.position += length;
+            copy_release_pages(reader->fd, -1, &reader->pages, FALSE);
+            return length;
+        } else if (length == 0) {
+            if (!open_next(in, reader))
+                return -1;
+        } else if (errno != EINTR) {
+            archive_set_error(in, errno, "%s: read failed", reader->path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int close_volumes(struct archive *in, void *data)
+{
+    close_volume(data);
+    return ARCHIVE_OK;
+}
+
+int volume_reader_open(volume_reader *reader, struct archive *in)
+{
+    return archive_read_open(in, reader, open_volumes, read_volumes,
+                             close_volumes);
+}
+
+guint64 volume_reader_size(const volume_reader *reader)
+{
+    return reader->size;
+}
+
+void volume_reader_free(volume_reader *reader)
+{
+    if (reader == NULL)
+        return;
+    close_volume(reader);
+    g_free(reader->buffer);
+    g_free(reader->archive);
+    g_free(reader);
+}
+
+// vim: expandtab:ts=4:sw=4
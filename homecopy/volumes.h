@@ -0,0 +1,78 @@
+/****************************************************************************************
+** Copyright (c) 2026 Jolla Ltd.
+**
+** All rights reserved.
+**
+** This file is part of Sailfish Device Encryption package.
+**
+** You may use this file under the terms of BSD license as follows:
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**
+** 1. Redistributions of source code must retain the above copyright notice, this
+**    list of conditions and the following disclaimer.
+**
+** 2. Redistributions in binary form must reproduce the above copyright notice,
+**    this list of conditions and the following disclaimer in the documentation
+**    and/or other materials provided with the distribution.
+**
+** 3. Neither the name of the copyright holder nor the names of its
+**    contributors may be used to endorse or promote products derived from
+**    this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+** DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+** FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+** DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+** OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**
+****************************************************************************************/
+
+#ifndef __VOLUMES_H
+#define __VOLUMES_H
+
+#include <archive.h>
+#include <glib.h>
+
+/*
+ * Archives on filesystems with a file size limit are split into volumes
+ * named archive.000, archive.001 and so on, which are read back in order
+ * as one stream. FAT can not hold a file of 4 GiB, so archives there are
+ * always split. A volume is written as its name with .partial appended
+ * until the archive is complete.
+ *
+ * Reading drops the pages read from the page cache, and with sync set the
+ * volumes are flushed and dropped first, so they are read from the
+ * storage rather than from memory.
+ */
+
+// Largest volume that fits to FAT
+#define VOLUME_SIZE_FAT ((guint64)4095 * 1024 * 1024)
+
+// Volume size for an archive written to path, 0 if it is not split
+guint64 volume_size_for(const char *path);
+// Path of volume index of archive, or archive itself if index is -1
+gchar *volume_path(const char *archive, gint index, gboolean partial);
+
+typedef struct _volume_reader volume_reader;
+
+// Reads archive, or its volumes if there is no archive of that name
+volume_reader *volume_reader_new(
+        const char *archive,
+        gboolean partial,
+        gboolean sync);
+// Opens in to read the volumes, errors are reported by in
+int volume_reader_open(volume_reader *reader, struct archive *in);
+// Bytes of all volumes
+guint64 volume_reader_size(const volume_reader *reader);
+void volume_reader_free(volume_reader *reader);
+
+#endif // __VOLUMES_H
+
+// vim: expandtab:ts=4:sw=4
@@ -68,11 +68,27 @@ DBusInterface {
         call("copyHome", [])
     }
 
+    // Copy ends with copied(false)
+    function cancelCopy() {
+        call("cancelCopy", [])
+    }
+
     signal copied(bool success)
 
+    // Updated while copying, remainingSeconds is -1 when not known
+    property real progress
+    property real bytesPerSecond
+    property int remainingSeconds: -1
+
     function copyDone(value) {
         console.log("SD copied:", value)
         copied(value)
     }
 
+    function copyProgress(filesDone, filesTotal, bytesDone, bytesTotal, rate, eta) {
+        progress = bytesTotal > 0 ? Math.min(bytesDone / bytesTotal, 1.0) : 0
+        bytesPerSecond = rate
+        remainingSeconds = eta
+    }
+
 }
@@ -106,6 +106,18 @@ DBusInterface {
         call("PrepareToEncrypt", [passphrase, overwriteType])
     }
 
+    // Callback gets total seconds and seconds per phase,
+    // copyTarget is empty when home is not copied to memory card
+    function estimateDuration(overwriteType, copyTarget, callback) {
+        typedCall("EstimateDuration",
+                  [{ "type": "s", "value": overwriteType },
+                   { "type": "s", "value": copyTarget }],
+                  function(total, phases) { callback(total, phases) },
+                  function(error, message) {
+                      console.warn("Could not estimate encryption duration:", message)
+                  })
+    }
+
     function encryptionFinished(success, error) {
         encryptionStatus = success ? EncryptionStatus.Encrypted : EncryptionStatus.Error
     }
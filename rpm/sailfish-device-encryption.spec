@@ -22,12 +22,14 @@ BuildRequires: sailfish-minui-dbus-devel
 BuildRequires: sailfish-minui-label-tool
 BuildRequires: sailfish-svg2png >= 0.3.4
 BuildRequires: systemd
+BuildRequires: systemtap-sdt-devel
 BuildRequires: %{name}-l10n-all-translations
 BuildRequires: usb-moded-devel
 BuildRequires: pkgconfig(sailfishaccesscontrol) >= 0.0.3
 BuildRequires: pkgconfig(dsme)
 BuildRequires: pkgconfig(dsme_dbus_if)
 BuildRequires: pkgconfig(glib-2.0)
+BuildRequires: pkgconfig(libarchive)
 BuildRequires: pkgconfig(libcryptsetup)
 BuildRequires: pkgconfig(libdbusaccess)
 BuildRequires: pkgconfig(libresource)
@@ -57,7 +59,9 @@ Password agent to unlock encrypted partitions on device boot.
 Summary:  Sailfish Encryption Service
 # Packages of commands required by home-encryption-*.sh scripts
 Requires: coreutils
+Requires: e2fsprogs
 Requires: grep
+Requires: lvm2
 Requires: shadow-utils >= 4.8.1
 Requires: systemd
 Requires: util-linux
@@ -104,6 +108,8 @@ fi
 %package homecopy
 Summary: Tool for saving user data on home encryption
 Requires: oneshot
+# Home copy service runs in sailfish-encryption-service
+Requires: %{name}-service = %{version}-%{release}
 
 %description homecopy
 %{summary}.
@@ -172,6 +178,9 @@ make DESTDIR=%{buildroot} install
 mkdir -p %{buildroot}/%{_userunitdir}/user-session.target.wants/
 ln -s ../home-restore-ui.service \
       %{buildroot}/%{_userunitdir}/user-session.target.wants/
+mkdir -p %{buildroot}/%{unitdir}/multi-user.target.wants/
+ln -s ../home-restore-deferred.service \
+      %{buildroot}/%{unitdir}/multi-user.target.wants/
 
 # Compatiblity and documentation files
 mkdir -p %{buildroot}/%{_sysconfdir}
@@ -205,7 +214,9 @@ mkdir -p %{buildroot}%{_sharedstatedir}/%{name}
 %defattr(-,root,root,-)
 %license LICENSE.BSD
 %ghost %{_sysconfdir}/crypttab
+%ghost %{_localstatedir}/log/sailfish-device-encryption-trace.json
 %{_libexecdir}/sailfish-encryption-service
+%{_libexecdir}/sailfish-home-copy
 %{unitdir}/dbus-%{dbusname}.service
 %{dbus_system_dir}/%{dbusname}.conf
 %{dbus_service_dir}/%{dbusname}.service
@@ -266,12 +277,11 @@ fi
 %files homecopy
 %defattr(-,root,root,-)
 %license LICENSE.BSD
-%{unitdir}/dbus-%{copydbusname}.service
 %{_libexecdir}/sailfish-home-copy-service
-%{unitdir}/home-encryption-copy.service
-%{unitdir}/home-restore.service
 %{_userunitdir}/home-restore-ui.service
 %{_userunitdir}/user-session.target.wants/home-restore-ui.service
+%{unitdir}/home-restore-deferred.service
+%{unitdir}/multi-user.target.wants/home-restore-deferred.service
 %{dbus_system_dir}/%{copydbusname}.conf
 %{dbus_service_dir}/%{copydbusname}.service
 %{_libexecdir}/sailfish-home-restoration
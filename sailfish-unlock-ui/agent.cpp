@@ -39,6 +39,8 @@
 #include "devicelocksettings.h"
 #include "logging.h"
 #include "pin.h"
+#define PROBE_PROVIDER sailfish_unlock
+#include "probes.h"
 #include <dirent.h>
 #include <glib.h>
 #include <sailfish-minui-dbus/eventloop.h>
@@ -147,6 +149,7 @@ bool Agent::handleNewAskFile(int descriptor, uint32_t events)
 {
     (void)events;
     log_debug("new ask file");
+    PROBE(ask_file_event);
 
     // Flush inotify events
     int available;
@@ -203,6 +206,7 @@ bool Agent::findAskFile()
     for (int i = 0; i < count; i++) {
         if (parseAskFile(files[i]->d_name)) {
             log_debug("found ask file " << m_askFile);
+            PROBE(ask_file_found, m_askFile.c_str());
             ret = true;
             break;
         }
@@ -312,6 +316,8 @@ bool Agent::sendPassword(const std::string& password)
         len = 1;
     }
 
+    PROBE(send_password);
+
     if ((sd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
         log_err("socket open failed");
         return false;
@@ -334,6 +340,7 @@ bool Agent::sendPassword(const std::string& password)
     }
 
     close(sd);
+    PROBE(password_sent);
     return true;
 }
 
@@ -7,6 +7,9 @@ QMAKE_CFLAGS += -Wno-missing-field-initializers
 # as qmake does not grok CPPFLAGS, use CFLAGS
 QMAKE_CFLAGS += -D_GNU_SOURCE
 
+# USDT probe macros are shared with the encryption service
+INCLUDEPATH += ../encryption-service
+
 CONFIG -= qt
 CONFIG += link_pkgconfig
 CONFIG += sailfish-minui-resources
@@ -29,6 +32,7 @@ HEADERS += \
     emergencybutton.h \
     logging.h \
     pin.h \
+    ../encryption-service/probes.h \
     touchinput.h
 
 SOURCES += \